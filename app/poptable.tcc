@@ -43,6 +43,7 @@ tamed void populate(const Json& params) {
             }
 
             pclient = new RemoteClient(fd, "");
+            pclient->set_batch(64);
             break;
 
         case mode_memcached:
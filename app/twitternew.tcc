@@ -82,6 +82,7 @@ TwitterNewPopulator::TwitterNewPopulator(const Json& param)
       execute_(param["execute"].as_b(true)),
       push_(param["push"].as_b(false)),
       pull_(param["pull"].as_b(false)),
+      adaptive_(param["adaptive"].as_b(false)),
       fetch_(param["fetch"].as_b(false)),
       subtables_(param["subtables"].as_b(true)),
       eager_(param["eager"].as_b(false)),
@@ -109,6 +110,7 @@ TwitterNewPopulator::TwitterNewPopulator(const Json& param)
       shape_(param["shape"].as_d(55)) {
 
     mandatory_assert(!(push_ && pull_));
+    mandatory_assert(!(adaptive_ && (push_ || pull_)));
     mandatory_assert(!postrate_ == !timeout_);
 
     if (pull_ || push_) {
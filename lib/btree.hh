@@ -0,0 +1,834 @@
+#ifndef PEQUOD_BTREE_HH
+#define PEQUOD_BTREE_HH 1
+#include <iterator>
+#include <utility>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include "compiler.hh"
+#include "str.hh"
+#include "string.hh"
+
+// B+tree of intrusive elements ordered by T::key()
+//
+// Offers the subset of boost::intrusive::set that pequod's stores use, so
+// it can stand in for the rbtree ServerStore. Elements live in wide leaves
+// that are linked in key order, so scans walk arrays instead of chasing
+// tree pointers. Each leaf remembers the prefix shared by all its keys and
+// caches the next 8 bytes of every key as an integer slice; lookups inside
+// a leaf only dereference elements when two slices tie.
+//
+// Like the intrusive set, iterators stay valid until their element is
+// erased. An iterator caches its leaf position, but checks it against the
+// element's hook before use: a split or shift may have moved the element,
+// and erases may have freed its old leaf.
+//
+// Internal nodes count the elements under each child, so rank() and nth()
+// find positions in logarithmic time.
+//
+// Leaves that empty out are freed, but partially full leaves are never
+// merged.
+
+class btree_set_base_hook {
+  public:
+    inline btree_set_base_hook()
+        : btree_leaf_(nullptr) {
+    }
+    inline btree_set_base_hook(const btree_set_base_hook&)
+        : btree_leaf_(nullptr) {
+    }
+    inline btree_set_base_hook& operator=(const btree_set_base_hook&) {
+        return *this;
+    }
+    inline bool is_linked() const {
+        return btree_leaf_ != nullptr;
+    }
+  private:
+    void* btree_leaf_;
+    template <typename T, int W> friend class btree_set;
+};
+
+template <typename T, int W = 32>
+class btree_set {
+    struct leaf;
+    struct internode;
+  public:
+    typedef T value_type;
+    typedef Str key_type;
+    template <typename V> class iter;
+    typedef iter<T> iterator;
+    typedef iter<const T> const_iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+    struct insert_commit_data {
+        leaf* l;
+        int i;
+    };
+
+    inline btree_set();
+    ~btree_set();
+
+    inline size_t size() const;
+    inline bool empty() const;
+
+    inline iterator begin();
+    inline const_iterator begin() const;
+    inline iterator end();
+    inline const_iterator end() const;
+    inline reverse_iterator rbegin();
+    inline const_reverse_iterator rbegin() const;
+    inline reverse_iterator rend();
+    inline const_reverse_iterator rend() const;
+
+    // comparator arguments are accepted for boost::intrusive::set
+    // compatibility; the order is always that of T::key()
+    template <typename C> inline iterator find(Str key, C comp);
+    template <typename C> inline const_iterator find(Str key, C comp) const;
+    template <typename C> inline size_t count(Str key, C comp) const;
+    template <typename C> inline iterator lower_bound(Str key, C comp);
+    template <typename C> inline const_iterator lower_bound(Str key, C comp) const;
+
+    inline iterator iterator_to(T& x);
+    inline const_iterator iterator_to(const T& x) const;
+
+    size_t rank(const_iterator it) const;
+    iterator nth(size_t n);
+    inline const_iterator nth(size_t n) const;
+
+    template <typename C>
+    std::pair<iterator, bool> insert_check(Str key, C comp,
+                                           insert_commit_data& cd);
+    template <typename C>
+    std::pair<iterator, bool> insert_check(const_iterator hint, Str key, C comp,
+                                           insert_commit_data& cd);
+    iterator insert_commit(T& x, const insert_commit_data& cd);
+    iterator insert_before(const_iterator pos, T& x);
+
+    iterator erase(const_iterator it);
+    T* unlink_leftmost_without_rebalance();
+
+    void check() const;
+
+  private:
+    struct node {
+        internode* parent;
+        int n;
+        bool isleaf;
+    };
+    struct leaf : public node {
+        leaf* prev;
+        leaf* next;
+        int plen;               // length of the prefix all keys share
+        uint64_t slice[W];      // big-endian key bytes following the prefix
+        T* v[W];
+    };
+    struct internode : public node {
+        String key[W - 1];      // key[i] separates child[i] and child[i+1]
+        node* child[W];
+        size_t count[W];        // elements under child[i]
+    };
+
+    node* root_;
+    leaf* first_;
+    leaf* last_;
+    size_t size_;
+
+    btree_set(const btree_set&) = delete;
+    btree_set& operator=(const btree_set&) = delete;
+
+    static inline leaf*& hook_leaf(const T* x);
+    static inline uint64_t slice_of(Str key, int offset);
+    static inline int common_prefix(Str a, Str b);
+    static inline int index_of(const leaf* l, const T* x);
+    static inline int child_index(const internode* p, const node* x);
+    static inline size_t subtree_size(const node* x);
+    static inline void adjust_counts(node* x, int delta);
+    static void recount(node* x);
+    static void refresh(leaf* l);
+
+    leaf* find_leaf(Str key) const;
+    static int leaf_lower_bound(const leaf* l, Str key, bool& found);
+    leaf* split_leaf(leaf* l, int at);
+    void insert_child(node* left, Str sep, node* right);
+    void remove_child(internode* p, node* x);
+    void free_node(node* x);
+    size_t check_counts(const node* x) const;
+};
+
+template <typename T, int W> template <typename V>
+class btree_set<T, W>::iter {
+  public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef V value_type;
+    typedef ptrdiff_t difference_type;
+    typedef V* pointer;
+    typedef V& reference;
+
+    inline iter()
+        : t_(nullptr), l_(nullptr), i_(0), v_(nullptr) {
+    }
+    inline iter(const btree_set<T, W>* t, leaf* l, int i)
+        : t_(t), l_(l), i_(i), v_(l ? l->v[i] : nullptr) {
+    }
+    template <typename VV>
+    inline iter(const iter<VV>& x)
+        : t_(x.t_), l_(x.l_), i_(x.i_), v_(x.v_) {
+    }
+
+    inline V& operator*() const {
+        return *v_;
+    }
+    inline V* operator->() const {
+        return v_;
+    }
+
+    template <typename VV>
+    inline bool operator==(const iter<VV>& x) const {
+        return v_ == x.v_;
+    }
+    template <typename VV>
+    inline bool operator!=(const iter<VV>& x) const {
+        return v_ != x.v_;
+    }
+
+    inline iter<V>& operator++() {
+        sync();
+        if (++i_ < l_->n)
+            v_ = l_->v[i_];
+        else if ((l_ = l_->next)) {
+            i_ = 0;
+            v_ = l_->v[0];
+        } else {
+            i_ = 0;
+            v_ = nullptr;
+        }
+        return *this;
+    }
+    inline iter<V> operator++(int) {
+        iter<V> x(*this);
+        ++*this;
+        return x;
+    }
+    inline iter<V>& operator--() {
+        if (!v_) {
+            l_ = t_->last_;
+            i_ = l_->n - 1;
+        } else {
+            sync();
+            if (i_ == 0) {
+                l_ = l_->prev;
+                i_ = l_->n;
+            }
+            --i_;
+        }
+        v_ = l_->v[i_];
+        return *this;
+    }
+    inline iter<V> operator--(int) {
+        iter<V> x(*this);
+        --*this;
+        return x;
+    }
+
+  private:
+    const btree_set<T, W>* t_;
+    leaf* l_;
+    int i_;
+    V* v_;
+
+    // The element may have moved since this iterator was made, and its
+    // old leaf may have been freed, so check the leaf through the hook.
+    inline void sync() {
+        leaf* l = hook_leaf(v_);
+        if (l != l_ || i_ >= l->n || l->v[i_] != v_) {
+            l_ = l;
+            i_ = index_of(l, v_);
+        }
+    }
+
+    template <typename VV> friend class iter;
+    friend class btree_set<T, W>;
+};
+
+
+template <typename T, int W>
+inline btree_set<T, W>::btree_set()
+    : root_(nullptr), first_(nullptr), last_(nullptr), size_(0) {
+    static_assert(W >= 4, "btree_set nodes are too narrow");
+}
+
+template <typename T, int W>
+btree_set<T, W>::~btree_set() {
+    for (leaf* l = first_; l; l = l->next)
+        for (int i = 0; i < l->n; ++i)
+            hook_leaf(l->v[i]) = nullptr;
+    free_node(root_);
+}
+
+template <typename T, int W>
+inline size_t btree_set<T, W>::size() const {
+    return size_;
+}
+
+template <typename T, int W>
+inline bool btree_set<T, W>::empty() const {
+    return size_ == 0;
+}
+
+template <typename T, int W>
+inline auto btree_set<T, W>::begin() -> iterator {
+    return iterator(this, first_, 0);
+}
+
+template <typename T, int W>
+inline auto btree_set<T, W>::begin() const -> const_iterator {
+    return const_iterator(this, first_, 0);
+}
+
+template <typename T, int W>
+inline auto btree_set<T, W>::end() -> iterator {
+    return iterator(this, nullptr, 0);
+}
+
+template <typename T, int W>
+inline auto btree_set<T, W>::end() const -> const_iterator {
+    return const_iterator(this, nullptr, 0);
+}
+
+template <typename T, int W>
+inline auto btree_set<T, W>::rbegin() -> reverse_iterator {
+    return reverse_iterator(end());
+}
+
+template <typename T, int W>
+inline auto btree_set<T, W>::rbegin() const -> const_reverse_iterator {
+    return const_reverse_iterator(end());
+}
+
+template <typename T, int W>
+inline auto btree_set<T, W>::rend() -> reverse_iterator {
+    return reverse_iterator(begin());
+}
+
+template <typename T, int W>
+inline auto btree_set<T, W>::rend() const -> const_reverse_iterator {
+    return const_reverse_iterator(begin());
+}
+
+template <typename T, int W>
+inline auto btree_set<T, W>::hook_leaf(const T* x) -> leaf*& {
+    const btree_set_base_hook* h = x;
+    return reinterpret_cast<leaf*&>(const_cast<btree_set_base_hook*>(h)->btree_leaf_);
+}
+
+template <typename T, int W>
+inline uint64_t btree_set<T, W>::slice_of(Str key, int offset) {
+    int len = key.length() - offset;
+    if (len >= 8) {
+        uint64_t x;
+        memcpy(&x, key.data() + offset, 8);
+        return net_to_host_order(x);
+    }
+    uint64_t x = 0;
+    for (int i = 0; i < len; ++i)
+        x |= uint64_t(static_cast<unsigned char>(key[offset + i])) << (56 - 8 * i);
+    return x;
+}
+
+template <typename T, int W>
+inline int btree_set<T, W>::common_prefix(Str a, Str b) {
+    int len = std::min(a.length(), b.length()), i = 0;
+    while (i < len && a[i] == b[i])
+        ++i;
+    return i;
+}
+
+template <typename T, int W>
+inline int btree_set<T, W>::index_of(const leaf* l, const T* x) {
+    int i = 0;
+    while (l->v[i] != x)
+        ++i;
+    return i;
+}
+
+template <typename T, int W>
+inline int btree_set<T, W>::child_index(const internode* p, const node* x) {
+    int i = 0;
+    while (p->child[i] != x)
+        ++i;
+    return i;
+}
+
+template <typename T, int W>
+inline size_t btree_set<T, W>::subtree_size(const node* x) {
+    if (x->isleaf)
+        return x->n;
+    const internode* in = static_cast<const internode*>(x);
+    size_t n = 0;
+    for (int i = 0; i < in->n; ++i)
+        n += in->count[i];
+    return n;
+}
+
+template <typename T, int W>
+inline void btree_set<T, W>::adjust_counts(node* x, int delta) {
+    for (internode* p = x->parent; p; x = p, p = p->parent)
+        p->count[child_index(p, x)] += delta;
+}
+
+// Recompute the counts on the path from x to the root.
+template <typename T, int W>
+void btree_set<T, W>::recount(node* x) {
+    for (internode* p = x->parent; p; x = p, p = p->parent)
+        p->count[child_index(p, x)] = subtree_size(x);
+}
+
+template <typename T, int W>
+void btree_set<T, W>::refresh(leaf* l) {
+    l->plen = common_prefix(l->v[0]->key(), l->v[l->n - 1]->key());
+    for (int i = 0; i < l->n; ++i)
+        l->slice[i] = slice_of(l->v[i]->key(), l->plen);
+}
+
+template <typename T, int W>
+auto btree_set<T, W>::find_leaf(Str key) const -> leaf* {
+    node* x = root_;
+    while (!x->isleaf) {
+        internode* in = static_cast<internode*>(x);
+        int lo = 0, hi = in->n - 1;
+        while (lo < hi) {
+            int m = (lo + hi) >> 1;
+            if (key < in->key[m])
+                hi = m;
+            else
+                lo = m + 1;
+        }
+        x = in->child[lo];
+    }
+    return static_cast<leaf*>(x);
+}
+
+template <typename T, int W>
+int btree_set<T, W>::leaf_lower_bound(const leaf* l, Str key, bool& found) {
+    found = false;
+    // keys outside the shared prefix sort before or after the whole leaf
+    Str first = l->v[0]->key();
+    int plen = l->plen;
+    int c = memcmp(key.data(), first.data(), std::min(key.length(), plen));
+    if (c < 0 || (c == 0 && key.length() < plen))
+        return 0;
+    else if (c > 0)
+        return l->n;
+
+    uint64_t ks = slice_of(key, plen);
+    int lo = 0, hi = l->n;
+    while (lo < hi) {
+        int m = (lo + hi) >> 1;
+        if (l->slice[m] < ks)
+            lo = m + 1;
+        else
+            hi = m;
+    }
+    for (; lo < l->n && l->slice[lo] == ks; ++lo) {
+        int cmp = String_generic::compare(l->v[lo]->key().data(), l->v[lo]->key().length(),
+                                          key.data(), key.length());
+        if (cmp >= 0) {
+            found = cmp == 0;
+            break;
+        }
+    }
+    return lo;
+}
+
+template <typename T, int W> template <typename C>
+inline auto btree_set<T, W>::find(Str key, C) -> iterator {
+    if (!root_)
+        return end();
+    bool found;
+    leaf* l = find_leaf(key);
+    int i = leaf_lower_bound(l, key, found);
+    return found ? iterator(this, l, i) : end();
+}
+
+template <typename T, int W> template <typename C>
+inline auto btree_set<T, W>::find(Str key, C comp) const -> const_iterator {
+    return const_cast<btree_set<T, W>*>(this)->find(key, comp);
+}
+
+template <typename T, int W> template <typename C>
+inline size_t btree_set<T, W>::count(Str key, C comp) const {
+    return find(key, comp) != end();
+}
+
+template <typename T, int W> template <typename C>
+inline auto btree_set<T, W>::lower_bound(Str key, C) -> iterator {
+    if (!root_)
+        return end();
+    bool found;
+    leaf* l = find_leaf(key);
+    int i = leaf_lower_bound(l, key, found);
+    if (i < l->n)
+        return iterator(this, l, i);
+    return iterator(this, l->next, 0);
+}
+
+template <typename T, int W> template <typename C>
+inline auto btree_set<T, W>::lower_bound(Str key, C comp) const -> const_iterator {
+    return const_cast<btree_set<T, W>*>(this)->lower_bound(key, comp);
+}
+
+template <typename T, int W>
+inline auto btree_set<T, W>::iterator_to(T& x) -> iterator {
+    leaf* l = hook_leaf(&x);
+    return iterator(this, l, index_of(l, &x));
+}
+
+template <typename T, int W>
+inline auto btree_set<T, W>::iterator_to(const T& x) const -> const_iterator {
+    leaf* l = hook_leaf(&x);
+    return const_iterator(this, l, index_of(l, &x));
+}
+
+/** @brief Return the number of elements before @a it. */
+template <typename T, int W>
+size_t btree_set<T, W>::rank(const_iterator it) const {
+    if (!it.v_)
+        return size_;
+    it.sync();
+    size_t r = it.i_;
+    for (const node* x = it.l_; const internode* p = x->parent; x = p)
+        for (int i = 0; p->child[i] != x; ++i)
+            r += p->count[i];
+    return r;
+}
+
+/** @brief Return an iterator to the element with rank @a n, or end(). */
+template <typename T, int W>
+auto btree_set<T, W>::nth(size_t n) -> iterator {
+    if (n >= size_)
+        return end();
+    node* x = root_;
+    while (!x->isleaf) {
+        internode* in = static_cast<internode*>(x);
+        int i = 0;
+        for (; n >= in->count[i]; ++i)
+            n -= in->count[i];
+        x = in->child[i];
+    }
+    return iterator(this, static_cast<leaf*>(x), n);
+}
+
+template <typename T, int W>
+inline auto btree_set<T, W>::nth(size_t n) const -> const_iterator {
+    return const_cast<btree_set<T, W>*>(this)->nth(n);
+}
+
+template <typename T, int W> template <typename C>
+auto btree_set<T, W>::insert_check(Str key, C, insert_commit_data& cd)
+    -> std::pair<iterator, bool> {
+    cd.l = nullptr;
+    cd.i = 0;
+    if (!root_)
+        return std::make_pair(end(), true);
+    bool found;
+    cd.l = find_leaf(key);
+    cd.i = leaf_lower_bound(cd.l, key, found);
+    if (found)
+        return std::make_pair(iterator(this, cd.l, cd.i), false);
+    return std::make_pair(end(), true);
+}
+
+template <typename T, int W> template <typename C>
+auto btree_set<T, W>::insert_check(const_iterator hint, Str key, C comp,
+                                   insert_commit_data& cd)
+    -> std::pair<iterator, bool> {
+    // appends to the last leaf and inserts inside one leaf skip the descent
+    if (hint == end()) {
+        if (last_ && last_->v[last_->n - 1]->key() < key) {
+            cd.l = last_;
+            cd.i = last_->n;
+            return std::make_pair(end(), true);
+        }
+    } else {
+        hint.sync();
+        leaf* l = hint.l_;
+        int i = hint.i_;
+        if (key == l->v[i]->key())
+            return std::make_pair(iterator(this, l, i), false);
+        else if (i > 0 && key < l->v[i]->key() && l->v[i - 1]->key() < key) {
+            cd.l = l;
+            cd.i = i;
+            return std::make_pair(end(), true);
+        }
+    }
+    return insert_check(key, comp, cd);
+}
+
+template <typename T, int W>
+auto btree_set<T, W>::insert_commit(T& x, const insert_commit_data& cd) -> iterator {
+    leaf* l = cd.l;
+    int i = cd.i;
+    if (!l) {
+        l = new leaf;
+        l->parent = nullptr;
+        l->n = 0;
+        l->isleaf = true;
+        l->prev = l->next = nullptr;
+        root_ = first_ = last_ = l;
+    }
+
+    leaf* r = nullptr;
+    if (l->n == W) {
+        // split in half, unless appending at the end of the tree: then
+        // start a fresh leaf so sequential loads fill their leaves
+        int at = l == last_ && i == W ? W : W / 2;
+        r = split_leaf(l, at);
+        if (i >= at) {
+            l = r;
+            i -= at;
+        }
+    }
+
+    memmove(&l->v[i + 1], &l->v[i], sizeof(T*) * (l->n - i));
+    memmove(&l->slice[i + 1], &l->slice[i], sizeof(uint64_t) * (l->n - i));
+    l->v[i] = &x;
+    hook_leaf(&x) = l;
+    ++l->n;
+    ++size_;
+    if (l->n == 1 || i == 0 || i == l->n - 1) {
+        // a new first or last key can shorten the shared prefix
+        int plen = common_prefix(l->v[0]->key(), l->v[l->n - 1]->key());
+        if (l->n == 1 || plen != l->plen)
+            refresh(l);
+        else
+            l->slice[i] = slice_of(x.key(), plen);
+    } else
+        l->slice[i] = slice_of(x.key(), l->plen);
+
+    if (r) {
+        insert_child(r->prev, r->v[0]->key(), r);
+        recount(r->prev);
+        recount(r);
+    } else
+        adjust_counts(l, 1);
+    return iterator(this, l, i);
+}
+
+template <typename T, int W>
+auto btree_set<T, W>::insert_before(const_iterator, T& x) -> iterator {
+    // the position is implied by the key; routing needs the real leaf
+    insert_commit_data cd;
+    std::pair<iterator, bool> p = insert_check(x.key(), 0, cd);
+    assert(p.second);
+    (void) p;
+    return insert_commit(x, cd);
+}
+
+template <typename T, int W>
+auto btree_set<T, W>::split_leaf(leaf* l, int at) -> leaf* {
+    leaf* r = new leaf;
+    r->parent = l->parent;
+    r->isleaf = true;
+    r->n = l->n - at;
+    memcpy(r->v, &l->v[at], sizeof(T*) * r->n);
+    for (int i = 0; i < r->n; ++i)
+        hook_leaf(r->v[i]) = r;
+    l->n = at;
+
+    r->prev = l;
+    r->next = l->next;
+    if (l->next)
+        l->next->prev = r;
+    else
+        last_ = r;
+    l->next = r;
+
+    if (l->n)
+        refresh(l);
+    if (r->n)
+        refresh(r);
+    return r;
+}
+
+template <typename T, int W>
+void btree_set<T, W>::insert_child(node* left, Str sep, node* right) {
+    internode* p = left->parent;
+    if (!p) {
+        p = new internode;
+        p->parent = nullptr;
+        p->n = 1;
+        p->isleaf = false;
+        p->child[0] = left;
+        p->count[0] = subtree_size(left);
+        left->parent = p;
+        root_ = p;
+    }
+
+    int pos = 1;
+    while (p->child[pos - 1] != left)
+        ++pos;
+
+    if (p->n == W) {
+        // move the upper half to a new sibling and push its bound up
+        int mid = W / 2;
+        internode* q = new internode;
+        q->parent = p->parent;
+        q->isleaf = false;
+        q->n = W - mid;
+        for (int i = 0; i < q->n; ++i) {
+            q->child[i] = p->child[mid + i];
+            q->count[i] = p->count[mid + i];
+            q->child[i]->parent = q;
+            if (i < q->n - 1)
+                q->key[i].swap(p->key[mid + i]);
+        }
+        String up;
+        up.swap(p->key[mid - 1]);
+        p->n = mid;
+        insert_child(p, up, q);
+        if (pos > mid) {
+            p = q;
+            pos -= mid;
+        }
+    }
+
+    for (int j = p->n; j > pos; --j) {
+        p->child[j] = p->child[j - 1];
+        p->count[j] = p->count[j - 1];
+        p->key[j - 1].swap(p->key[j - 2]);
+    }
+    p->child[pos] = right;
+    p->key[pos - 1] = String(sep);
+    right->parent = p;
+    ++p->n;
+    // counts on the path above are fixed up by the caller
+    p->count[pos - 1] = subtree_size(left);
+    p->count[pos] = subtree_size(right);
+}
+
+template <typename T, int W>
+void btree_set<T, W>::remove_child(internode* p, node* x) {
+    if (!p) {
+        root_ = nullptr;
+        return;
+    }
+
+    int ci = 0;
+    while (p->child[ci] != x)
+        ++ci;
+    for (int j = ci; j < p->n - 1; ++j) {
+        p->child[j] = p->child[j + 1];
+        p->count[j] = p->count[j + 1];
+    }
+    // the left neighbor's range grows over x's; the first child is
+    // bounded only by the parent
+    for (int j = ci ? ci - 1 : 0; j < p->n - 2; ++j)
+        p->key[j].swap(p->key[j + 1]);
+    if (p->n > 1)
+        p->key[p->n - 2] = String();
+    --p->n;
+
+    if (p->n == 0) {
+        remove_child(p->parent, p);
+        delete p;
+    } else if (p == root_ && p->n == 1) {
+        root_ = p->child[0];
+        root_->parent = nullptr;
+        delete p;
+    }
+}
+
+template <typename T, int W>
+auto btree_set<T, W>::erase(const_iterator it) -> iterator {
+    it.sync();
+    leaf* l = it.l_;
+    int i = it.i_;
+    hook_leaf(it.v_) = nullptr;
+    --l->n;
+    --size_;
+    adjust_counts(l, -1);
+    memmove(&l->v[i], &l->v[i + 1], sizeof(T*) * (l->n - i));
+    memmove(&l->slice[i], &l->slice[i + 1], sizeof(uint64_t) * (l->n - i));
+    // the shared prefix of the remaining keys can only grow, so the
+    // slices stay valid
+
+    if (i < l->n)
+        return iterator(this, l, i);
+    iterator next(this, l->next, 0);
+    if (l->n == 0) {
+        if (l->prev)
+            l->prev->next = l->next;
+        else
+            first_ = l->next;
+        if (l->next)
+            l->next->prev = l->prev;
+        else
+            last_ = l->prev;
+        remove_child(l->parent, l);
+        delete l;
+    }
+    return next;
+}
+
+template <typename T, int W>
+T* btree_set<T, W>::unlink_leftmost_without_rebalance() {
+    if (!first_)
+        return nullptr;
+    T* x = first_->v[0];
+    erase(const_iterator(this, first_, 0));
+    return x;
+}
+
+template <typename T, int W>
+void btree_set<T, W>::free_node(node* x) {
+    if (!x)
+        return;
+    if (x->isleaf)
+        delete static_cast<leaf*>(x);
+    else {
+        internode* in = static_cast<internode*>(x);
+        for (int i = 0; i < in->n; ++i)
+            free_node(in->child[i]);
+        delete in;
+    }
+}
+
+template <typename T, int W>
+void btree_set<T, W>::check() const {
+    size_t n = 0;
+    const T* prev = nullptr;
+    for (leaf* l = first_; l; l = l->next) {
+        mandatory_assert(l->n > 0 && l->n <= W);
+        mandatory_assert(l->prev ? l->prev->next == l : first_ == l);
+        mandatory_assert(l->next || last_ == l);
+        for (int i = 0; i < l->n; ++i) {
+            mandatory_assert(hook_leaf(l->v[i]) == l);
+            mandatory_assert(l->slice[i] == slice_of(l->v[i]->key(), l->plen));
+            mandatory_assert(!prev || prev->key() < l->v[i]->key());
+            bool found;
+            mandatory_assert(find_leaf(l->v[i]->key()) == l);
+            mandatory_assert(leaf_lower_bound(l, l->v[i]->key(), found) == i && found);
+            prev = l->v[i];
+            ++n;
+        }
+    }
+    mandatory_assert(n == size_);
+    mandatory_assert(!root_ || check_counts(root_) == size_);
+}
+
+template <typename T, int W>
+size_t btree_set<T, W>::check_counts(const node* x) const {
+    if (x->isleaf)
+        return x->n;
+    const internode* in = static_cast<const internode*>(x);
+    size_t n = 0;
+    for (int i = 0; i < in->n; ++i) {
+        mandatory_assert(in->child[i]->parent == in);
+        mandatory_assert(check_counts(in->child[i]) == in->count[i]);
+        n += in->count[i];
+    }
+    return n;
+}
+
+#endif
@@ -0,0 +1,249 @@
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <boost/intrusive/set.hpp>
+#include <boost/random.hpp>
+#include "btree.hh"
+#include "str.hh"
+#include <sys/time.h>
+#include <sys/resource.h>
+
+namespace bi = boost::intrusive;
+
+struct entry : public bi::set_base_hook<bi::optimize_size<true> >,
+               public btree_set_base_hook {
+    char buf[32];
+    int len;
+
+    entry(Str key)
+        : len(key.length()) {
+        memcpy(buf, key.data(), len);
+    }
+    Str key() const {
+        return Str(buf, len);
+    }
+};
+
+inline bool operator<(const entry& a, const entry& b) {
+    return a.key() < b.key();
+}
+
+struct entry_compare {
+    bool operator()(const entry& a, Str b) const {
+        return a.key() < b;
+    }
+    bool operator()(Str a, const entry& b) const {
+        return a < b.key();
+    }
+};
+
+typedef bi::set<entry> rb_store;
+typedef btree_set<entry> bt_store;
+
+// Insert each key through the hinted path pequod's Table::modify uses:
+// sinks remember the last datum they wrote and try just past it first.
+template <typename S>
+void insert_key(S& store, Str key, entry*& hint) {
+    typename S::insert_commit_data cd;
+    std::pair<typename S::iterator, bool> p;
+    if (hint) {
+        auto it = store.iterator_to(*hint);
+        ++it;
+        p = store.insert_check(it, key, entry_compare(), cd);
+    } else
+        p = store.insert_check(key, entry_compare(), cd);
+    if (p.second)
+        hint = &*store.insert_commit(*new entry(key), cd);
+    else
+        hint = &*p.first;
+}
+
+static double elapsed(const struct rusage& a, const struct rusage& b) {
+    struct timeval tv;
+    timersub(&b.ru_utime, &a.ru_utime, &tv);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Timeline keys in the shape twitternew produces: t|<user>|<time>|<poster>.
+// Posts arrive in time order and fan out to the poster's followers, so each
+// timeline grows at its end while the store as a whole sees interleaved
+// inserts. Reads scan the newest entries of random timelines.
+template <typename S>
+void timeline_bench(const char* name, int nusers, int npost, int fanout,
+                    int nscan, int scanlen) {
+    S store;
+    boost::mt19937 gen;
+    boost::random_number_generator<boost::mt19937> rng(gen);
+    std::vector<entry*> hints(nusers, nullptr);
+    char buf[64];
+    struct rusage ru[4];
+
+    getrusage(RUSAGE_SELF, &ru[0]);
+    for (int t = 0; t < npost; ++t) {
+        unsigned poster = rng(nusers);
+        for (int f = 0; f < fanout; ++f) {
+            unsigned user = (poster + 1 + rng(nusers - 1)) % nusers;
+            int len = sprintf(buf, "t|%08u|%010u|%08u", user, t, poster);
+            insert_key(store, Str(buf, len), hints[user]);
+        }
+    }
+    getrusage(RUSAGE_SELF, &ru[1]);
+
+    size_t nscanned = 0;
+    for (int s = 0; s < nscan; ++s) {
+        unsigned user = rng(nusers);
+        int len = sprintf(buf, "t|%08u|%010u", user, npost - npost / 8);
+        char endbuf[16];
+        int endlen = sprintf(endbuf, "t|%08u}", user);
+        Str last(endbuf, endlen);
+        int n = 0;
+        for (auto it = store.lower_bound(Str(buf, len), entry_compare());
+             it != store.end() && it->key() < last && n < scanlen; ++it, ++n)
+            /* do nothing */;
+        nscanned += n;
+    }
+    getrusage(RUSAGE_SELF, &ru[2]);
+
+    for (int s = 0; s < nscan; ++s) {
+        unsigned user = rng(nusers);
+        int len = sprintf(buf, "t|%08u|%010u|%08u", user, unsigned(rng(npost)),
+                          unsigned(rng(nusers)));
+        nscanned += store.count(Str(buf, len), entry_compare());
+    }
+    getrusage(RUSAGE_SELF, &ru[3]);
+
+    fprintf(stderr, "%s: %zu keys  insert %.3f  scan %.3f  lookup %.3f  (%zu scanned)\n",
+            name, store.size(), elapsed(ru[0], ru[1]), elapsed(ru[1], ru[2]),
+            elapsed(ru[2], ru[3]), nscanned);
+
+    while (entry* e = store.unlink_leftmost_without_rebalance())
+        delete e;
+}
+
+// Random inserts, erases and range checks against std::set.
+static void fuzz(int N) {
+    boost::mt19937 gen;
+    boost::random_number_generator<boost::mt19937> rng(gen);
+    bt_store store;
+    std::set<std::string> model;
+    char buf[64];
+
+    for (int i = 0; i < N; ++i) {
+        // short common prefixes exercise slice ties and prefix changes
+        int len = sprintf(buf, "t|%04u|%0*u", unsigned(rng(8)), int(1 + rng(6)),
+                          unsigned(rng(3000)));
+        Str key(buf, len);
+        int op = rng(9);
+        if (op < 4) {
+            // exact, end-of-tree and plain insert positions
+            bt_store::insert_commit_data cd;
+            std::pair<bt_store::iterator, bool> p;
+            if (op == 0)
+                p = store.insert_check(store.lower_bound(key, entry_compare()),
+                                       key, entry_compare(), cd);
+            else if (op == 1)
+                p = store.insert_check(store.end(), key, entry_compare(), cd);
+            else
+                p = store.insert_check(key, entry_compare(), cd);
+            mandatory_assert(p.second == !model.count(std::string(buf, len)));
+            if (p.second) {
+                store.insert_commit(*new entry(key), cd);
+                model.insert(std::string(buf, len));
+            }
+        } else if (op < 6) {
+            auto it = store.find(key, entry_compare());
+            mandatory_assert((it != store.end()) == !!model.count(std::string(buf, len)));
+            if (it != store.end()) {
+                entry* e = &*it;
+                auto next = store.erase(it);
+                auto mnext = model.erase(model.find(std::string(buf, len)));
+                mandatory_assert(next == store.end()
+                                 ? mnext == model.end()
+                                 : mnext != model.end() && next->key() == Str(mnext->data(), mnext->length()));
+                delete e;
+            }
+        } else if (op == 8) {
+            // hold an iterator while inserts split its leaf and erases
+            // around it free the leaf it was made in
+            auto it = store.lower_bound(key, entry_compare());
+            if (it == store.end())
+                continue;
+            entry* held = &*it;
+            for (int n = 0; n < 40; ++n) {
+                int xlen = sprintf(buf, "%.7s%0*u", held->buf, int(1 + rng(6)),
+                                   unsigned(rng(3000)));
+                bt_store::insert_commit_data cd;
+                if (store.insert_check(Str(buf, xlen), entry_compare(), cd).second) {
+                    store.insert_commit(*new entry(Str(buf, xlen)), cd);
+                    model.insert(std::string(buf, xlen));
+                }
+            }
+            for (int dir = 0; dir < 2; ++dir)
+                for (int n = 0; n < 40; ++n) {
+                    auto x = store.iterator_to(*held);
+                    if (dir == 0 ? x == store.begin() : ++x == store.end())
+                        break;
+                    if (dir == 0)
+                        --x;
+                    entry* e = &*x;
+                    model.erase(std::string(e->buf, e->len));
+                    store.erase(x);
+                    delete e;
+                }
+            auto mit = model.upper_bound(std::string(held->buf, held->len));
+            ++it;
+            mandatory_assert(mit == model.end()
+                             ? it == store.end()
+                             : it != store.end() && it->key() == Str(mit->data(), mit->length()));
+        } else {
+            auto it = store.lower_bound(key, entry_compare());
+            auto mit = model.lower_bound(std::string(buf, len));
+            if (it != store.begin()) {
+                auto prev = it;
+                --prev;
+                mandatory_assert(prev->key() < key);
+            }
+            for (int n = 0; n < 5 && mit != model.end(); ++n, ++it, ++mit)
+                mandatory_assert(it != store.end()
+                                 && it->key() == Str(mit->data(), mit->length()));
+            if (mit == model.end())
+                mandatory_assert(it == store.end());
+        }
+        if (i % 10000 == 0) {
+            store.check();
+            size_t r = 0;
+            for (auto it = store.begin(); it != store.end(); ++it, ++r)
+                mandatory_assert(store.rank(it) == r && store.nth(r) == it);
+            mandatory_assert(store.rank(store.end()) == r && store.nth(r) == store.end());
+        }
+    }
+    store.check();
+    mandatory_assert(store.size() == model.size());
+    auto mit = model.begin();
+    for (auto it = store.begin(); it != store.end(); ++it, ++mit)
+        mandatory_assert(it->key() == Str(mit->data(), mit->length()));
+    auto rit = store.rbegin();
+    for (auto mrit = model.rbegin(); mrit != model.rend(); ++mrit, ++rit)
+        mandatory_assert(rit->key() == Str(mrit->data(), mrit->length()));
+    while (entry* e = store.unlink_leftmost_without_rebalance())
+        delete e;
+    fprintf(stderr, "fuzz: ok\n");
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "-f") == 0)
+        fuzz(1000000);
+    else if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+        int nusers = argc > 2 ? atoi(argv[2]) : 2000;
+        int npost = argc > 3 ? atoi(argv[3]) : 200000;
+        timeline_bench<rb_store>("rbtree", nusers, npost, 10, 200000, 50);
+        timeline_bench<bt_store>("btree", nusers, npost, 10, 200000, 50);
+    } else {
+        fprintf(stderr, "Usage: btreetest -f | btreetest -b [NUSERS [NPOSTS]]\n");
+        exit(1);
+    }
+}
@@ -21,18 +21,31 @@
 #include <stdint.h>
 
 HashAllocator::HashAllocator(size_t size)
-    : _free(0), _buffer(0), _size(size)
+    : _free(0), _buffer(0), _size(size), _balloc(0), _bfree(0)
 {
 #ifdef VALGRIND_CREATE_MEMPOOL
     VALGRIND_CREATE_MEMPOOL(this, 0, 0);
 #endif
 }
 
+HashAllocator::HashAllocator(size_t size, buffer_allocator balloc,
+			     buffer_deallocator bfree)
+    : _free(0), _buffer(0), _size(size), _balloc(balloc), _bfree(bfree)
+{
+    assert(balloc && bfree);
+#ifdef VALGRIND_CREATE_MEMPOOL
+    VALGRIND_CREATE_MEMPOOL(this, 0, 0);
+#endif
+}
+
 HashAllocator::~HashAllocator()
 {
     while (buffer *b = _buffer) {
 	_buffer = b->next;
-	delete[] reinterpret_cast<char *>(b);
+	if (_bfree)
+	    _bfree(b, b->maxpos);
+	else
+	    delete[] reinterpret_cast<char *>(b);
     }
 #ifdef VALGRIND_DESTROY_MEMPOOL
     VALGRIND_DESTROY_MEMPOOL(this);
@@ -55,7 +68,12 @@ void *HashAllocator::hard_allocate()
     if (nelements < min_nelements)
 	nelements = min_nelements;
 
-    buffer *b = reinterpret_cast<buffer *>(new char[sizeof(buffer) + _size * nelements]);
+    size_t nbytes = sizeof(buffer) + _size * nelements;
+    buffer *b;
+    if (_balloc)
+	b = reinterpret_cast<buffer *>(_balloc(nbytes));
+    else
+	b = reinterpret_cast<buffer *>(new char[nbytes]);
     if (b) {
 	b->next = _buffer;
 	_buffer = b;
@@ -84,6 +102,14 @@ void HashAllocator::swap(HashAllocator &x)
     _buffer = x._buffer;
     x._buffer = xbuffer;
 
+    buffer_allocator xballoc = _balloc;
+    _balloc = x._balloc;
+    x._balloc = xballoc;
+
+    buffer_deallocator xbfree = _bfree;
+    _bfree = x._bfree;
+    x._bfree = xbfree;
+
 #ifdef VALGRIND_MOVE_MEMPOOL
     VALGRIND_MOVE_MEMPOOL(this, reinterpret_cast<HashAllocator *>(100));
     VALGRIND_MOVE_MEMPOOL(&x, this);
@@ -8,7 +8,11 @@
 
 class HashAllocator { public:
 
+    typedef void *(*buffer_allocator)(size_t);
+    typedef void (*buffer_deallocator)(void *, size_t);
+
     HashAllocator(size_t size);
+    HashAllocator(size_t size, buffer_allocator balloc, buffer_deallocator bfree);
     ~HashAllocator();
 
     inline void increase_size(size_t new_size) {
@@ -46,6 +50,8 @@ class HashAllocator { public:
     link *_free;
     buffer *_buffer;
     size_t _size;
+    buffer_allocator _balloc;
+    buffer_deallocator _bfree;
 
     void *hard_allocate();
 
@@ -66,4 +66,12 @@ Hosts *Hosts::get_instance(const String &hostFile) {
     return new Hosts(hostFile);
 }
 
+// n hosts on one machine with consecutive ports, as used by sharded servers.
+Hosts *Hosts::make_local(const String &name, uint32_t basePort, int n) {
+    Hosts *h = new Hosts();
+    for (int i = 0; i < n; ++i)
+        h->hosts_.push_back(Host(name, basePort + i, i));
+    return h;
+}
+
 }
@@ -30,6 +30,7 @@ class Host {
 class Hosts {
   public:
     static Hosts *get_instance(const String &hostFile);
+    static Hosts *make_local(const String &name, uint32_t basePort, int n);
 
     const Host *get_by_uid(uint64_t uid) const;
     inline const Host *get_by_seqid(int seqid) const;
@@ -40,6 +41,7 @@ class Hosts {
   private:
     std::vector<Host> hosts_;
 
+    Hosts() = default;
     Hosts(const String &hostFile);
 };
 
@@ -0,0 +1,588 @@
+#ifndef PEQUOD_INTERVAL_INDEX_HH
+#define PEQUOD_INTERVAL_INDEX_HH 1
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include "compiler.hh"
+#include "interval.hh"
+#include "str.hh"
+
+// Interval set over intervals with Str endpoints, tuned for stabbing queries
+//
+// Offers the subset of interval_tree that Table uses for source ranges.
+// Intervals live in a few sorted snapshot arrays ("levels"). Each level is
+// laid out as an implicit augmented binary tree: the entry at index i has
+// tree height equal to the number of trailing one bits in i, and caches
+// the largest iend() in its subtree (H. Li's cgranges layout). Queries
+// descend that implicit tree and scan small subtrees linearly, so they
+// read contiguous memory instead of chasing node pointers. Each level
+// copies its endpoints into one arena.
+//
+// Inserts collect in a short pending list. A full pending list is merged
+// with the smallest levels like a binary counter, so level i holds about
+// pending_max << i intervals and inserts cost O(log n) amortized. Erases
+// clear their slot; a level is compacted once half its slots are dead.
+// Each query pays for the extra levels it visits, so once there have been
+// more queries than intervals since the last full merge, the next query
+// merges everything into a single level.
+//
+// Query iterators and stab_batch callbacks may insert and erase intervals,
+// including the current one. Erased intervals are skipped and intervals
+// inserted during a query may or may not be reported. Iterators must be
+// destroyed in the reverse order of their creation.
+
+template <typename T>
+class interval_index {
+  public:
+    typedef T value_type;
+    typedef Str endpoint_type;
+    class iterator;
+
+    inline interval_index();
+
+    inline bool empty() const;
+    inline size_t size() const;
+
+    inline void insert(T& x);
+    void erase(T& x);
+
+    inline iterator begin_contains(Str key);
+    inline iterator begin_contains(Str first, Str last);
+    inline iterator begin_contains(const ::interval<Str>& x);
+    inline iterator begin_overlaps(Str first, Str last);
+    inline iterator begin_overlaps(const ::interval<Str>& x);
+    inline iterator end() const;
+
+    // Call f(i, x) for every interval x that contains keys[i], in key
+    // order. keys must be sorted; runs of nearby keys share one sweep of
+    // each level instead of descending it once per key.
+    template <typename F> void stab_batch(const Str* keys, size_t nkeys, F f);
+
+    T* unlink_leftmost_without_rebalance();
+
+    void check() const;
+
+    template <typename TT> friend std::ostream& operator<<(std::ostream& s, const interval_index<TT>& x);
+
+  private:
+    struct entry {
+        Str first;
+        Str last;
+        Str max_last;
+        T* x;
+    };
+    struct level {
+        std::vector<entry> entries;
+        std::vector<char> arena;
+        size_t nlive;
+        int height;
+        inline level()
+            : nlive(0), height(-1) {
+        }
+    };
+    struct handle {
+        uint32_t level;
+        uint32_t i;
+    };
+    struct contains_point;
+    struct contains_interval;
+    struct overlaps_interval;
+
+    std::vector<level> levels_;
+    std::vector<T*> pending_;
+    std::vector<handle> scratch_;
+    size_t size_;
+    size_t nquery_;
+    int busy_;
+
+    enum { pending_max = 16, leaf_height = 3, sweep_max = 64 };
+
+    inline T* resolve(handle h) const;
+    void flush();
+    inline void maybe_merge_all();
+    void merge_all();
+    void build(level& l, std::vector<T*>& xs);
+    template <typename P> iterator query(const P& p);
+    template <typename P> void query_level(uint32_t li, const P& p);
+    static inline size_t upper_bound_first(const level& l, Str key);
+};
+
+template <typename T>
+struct interval_index<T>::contains_point {
+    Str key;
+    inline bool before_end(Str first) const {
+        return !(key < first);
+    }
+    inline bool after_begin(Str max_last) const {
+        return key < max_last;
+    }
+    inline bool check(Str first, Str last) const {
+        return !(key < first) && key < last;
+    }
+};
+
+template <typename T>
+struct interval_index<T>::contains_interval {
+    Str first;
+    Str last;
+    inline bool before_end(Str xfirst) const {
+        return !(first < xfirst);
+    }
+    inline bool after_begin(Str max_last) const {
+        return !(max_last < last);
+    }
+    inline bool check(Str xfirst, Str xlast) const {
+        return ::interval<Str>::contains(xfirst, xlast, first, last);
+    }
+};
+
+template <typename T>
+struct interval_index<T>::overlaps_interval {
+    Str first;
+    Str last;
+    inline bool before_end(Str xfirst) const {
+        return xfirst < last;
+    }
+    inline bool after_begin(Str max_last) const {
+        return first < max_last;
+    }
+    inline bool check(Str xfirst, Str xlast) const {
+        return ::interval<Str>::overlaps(xfirst, xlast, first, last);
+    }
+};
+
+template <typename T>
+class interval_index<T>::iterator {
+  public:
+    inline iterator()
+        : ix_(nullptr), x_(nullptr) {
+    }
+    inline iterator(iterator&& x)
+        : ix_(x.ix_), base_(x.base_), pos_(x.pos_), end_(x.end_), x_(x.x_) {
+        x.ix_ = nullptr;
+    }
+    iterator(const iterator&) = delete;
+    iterator& operator=(const iterator&) = delete;
+    inline ~iterator() {
+        if (ix_) {
+            ix_->scratch_.resize(base_);
+            --ix_->busy_;
+        }
+    }
+
+    inline T& operator*() const {
+        return *x_;
+    }
+    inline T* operator->() const {
+        return x_;
+    }
+    template <typename X> inline bool operator==(const X& x) const {
+        return x_ == x.operator->();
+    }
+    template <typename X> inline bool operator!=(const X& x) const {
+        return x_ != x.operator->();
+    }
+
+    inline void operator++() {
+        x_ = nullptr;
+        while (!x_ && pos_ != end_)
+            x_ = ix_->resolve(ix_->scratch_[pos_++]);
+    }
+
+  private:
+    interval_index<T>* ix_;
+    size_t base_;
+    size_t pos_;
+    size_t end_;
+    T* x_;
+
+    inline iterator(interval_index<T>* ix, size_t base)
+        : ix_(ix), base_(base), pos_(base), end_(ix->scratch_.size()) {
+        ++ix_->busy_;
+        ++*this;
+    }
+
+    friend class interval_index<T>;
+};
+
+template <typename T>
+inline interval_index<T>::interval_index()
+    : size_(0), nquery_(0), busy_(0) {
+}
+
+template <typename T>
+inline bool interval_index<T>::empty() const {
+    return size_ == 0;
+}
+
+template <typename T>
+inline size_t interval_index<T>::size() const {
+    return size_;
+}
+
+template <typename T>
+inline T* interval_index<T>::resolve(handle h) const {
+    if (h.level == levels_.size())
+        return pending_[h.i];
+    else
+        return levels_[h.level].entries[h.i].x;
+}
+
+template <typename T>
+inline void interval_index<T>::insert(T& x) {
+    pending_.push_back(&x);
+    ++size_;
+    // running queries hold positions, so levels only change when idle
+    if (pending_.size() >= pending_max && !busy_)
+        flush();
+}
+
+template <typename T>
+void interval_index<T>::erase(T& x) {
+    --size_;
+    for (size_t i = pending_.size(); i != 0; --i)
+        if (pending_[i - 1] == &x) {
+            if (busy_)
+                pending_[i - 1] = nullptr;
+            else {
+                pending_[i - 1] = pending_.back();
+                pending_.pop_back();
+            }
+            return;
+        }
+
+    Str first = x.ibegin();
+    for (auto& l : levels_) {
+        auto it = std::lower_bound(l.entries.begin(), l.entries.end(), first,
+                                   [](const entry& e, Str k) { return e.first < k; });
+        for (; it != l.entries.end() && it->first == first; ++it)
+            if (it->x == &x) {
+                it->x = nullptr;
+                --l.nlive;
+                // compact a mostly dead level through the pending list
+                if (!busy_ && l.nlive < l.entries.size() / 2) {
+                    for (auto& e : l.entries)
+                        if (e.x)
+                            pending_.push_back(e.x);
+                    l = level();
+                    if (pending_.size() >= pending_max)
+                        flush();
+                }
+                return;
+            }
+    }
+    mandatory_assert(false && "interval_index::erase of a missing interval");
+}
+
+template <typename T>
+void interval_index<T>::flush() {
+    // merge pending_ and levels 0..j-1 into the first empty level j
+    std::vector<T*> xs;
+    for (auto x : pending_)
+        if (x)
+            xs.push_back(x);
+    pending_.clear();
+    size_t j = 0;
+    for (; j != levels_.size() && !levels_[j].entries.empty(); ++j) {
+        for (auto& e : levels_[j].entries)
+            if (e.x)
+                xs.push_back(e.x);
+        levels_[j] = level();
+    }
+    // dead slots may leave a merge small enough for a lower level
+    while (j && (size_t(pending_max) << (j - 1)) >= xs.size())
+        --j;
+    if (j == levels_.size())
+        levels_.push_back(level());
+    if (!xs.empty())
+        build(levels_[j], xs);
+}
+
+template <typename T>
+inline void interval_index<T>::maybe_merge_all() {
+    if (++nquery_ > size_ && !busy_)
+        merge_all();
+}
+
+template <typename T>
+void interval_index<T>::merge_all() {
+    nquery_ = 0;
+    size_t nlevels = !pending_.empty();
+    for (auto& l : levels_)
+        nlevels += !l.entries.empty();
+    if (nlevels <= 1 && pending_.empty())
+        return;
+
+    std::vector<T*> xs;
+    xs.reserve(size_);
+    for (auto x : pending_)
+        if (x)
+            xs.push_back(x);
+    pending_.clear();
+    for (auto& l : levels_) {
+        for (auto& e : l.entries)
+            if (e.x)
+                xs.push_back(e.x);
+        l = level();
+    }
+    size_t j = 0;
+    while ((size_t(pending_max) << j) < xs.size())
+        ++j;
+    levels_.resize(std::max(levels_.size(), j + 1));
+    if (!xs.empty())
+        build(levels_[j], xs);
+}
+
+template <typename T>
+void interval_index<T>::build(level& l, std::vector<T*>& xs) {
+    std::sort(xs.begin(), xs.end(), [](T* a, T* b) {
+            int cmp = a->ibegin().compare(b->ibegin());
+            return cmp < 0 || (cmp == 0 && a->iend() < b->iend());
+        });
+
+    size_t nbytes = 0;
+    for (auto x : xs)
+        nbytes += x->ibegin().length() + x->iend().length();
+    l.arena.resize(nbytes);
+    l.entries.resize(xs.size());
+    l.nlive = xs.size();
+    char* p = l.arena.data();
+    for (size_t i = 0; i != xs.size(); ++i) {
+        Str first = xs[i]->ibegin(), last = xs[i]->iend();
+        memcpy(p, first.data(), first.length());
+        l.entries[i].first = Str(p, first.length());
+        p += first.length();
+        memcpy(p, last.data(), last.length());
+        l.entries[i].last = Str(p, last.length());
+        p += last.length();
+        l.entries[i].x = xs[i];
+    }
+
+    // Fill in subtree maxima bottom up. `last` tracks the maximum of the
+    // rightmost, possibly incomplete, subtree at each height.
+    entry* es = l.entries.data();
+    size_t n = l.entries.size();
+    Str last;
+    size_t last_i = 0;
+    for (size_t i = 0; i < n; i += 2) {
+        es[i].max_last = es[i].last;
+        last = es[i].last;
+        last_i = i;
+    }
+    int k;
+    for (k = 1; (size_t(1) << k) <= n; ++k) {
+        size_t x = size_t(1) << (k - 1), step = x << 2;
+        for (size_t i = (x << 1) - 1; i < n; i += step) {
+            Str m = es[i].last;
+            if (m < es[i - x].max_last)
+                m = es[i - x].max_last;
+            Str r = i + x < n ? es[i + x].max_last : last;
+            if (m < r)
+                m = r;
+            es[i].max_last = m;
+        }
+        last_i = (last_i >> k) & 1 ? last_i - x : last_i + x;
+        if (last_i < n && last < es[last_i].max_last)
+            last = es[last_i].max_last;
+    }
+    l.height = k - 1;
+}
+
+template <typename T>
+inline size_t interval_index<T>::upper_bound_first(const level& l, Str key) {
+    return std::upper_bound(l.entries.begin(), l.entries.end(), key,
+                            [](Str k, const entry& e) { return k < e.first; })
+        - l.entries.begin();
+}
+
+template <typename T> template <typename P>
+void interval_index<T>::query_level(uint32_t li, const P& p) {
+    struct frame {
+        size_t x;
+        int k;
+        bool right;
+    } stack[64];
+    const level& l = levels_[li];
+    const entry* es = l.entries.data();
+    size_t n = l.entries.size();
+    if (l.height < 0)
+        return;
+
+    int t = 0;
+    stack[t++] = frame{(size_t(1) << l.height) - 1, l.height, false};
+    while (t) {
+        frame f = stack[--t];
+        if (f.k <= leaf_height) {
+            // small subtree: scan it in order
+            size_t i = (f.x >> f.k) << f.k;
+            size_t iend = std::min(i + (size_t(2) << f.k) - 1, n);
+            for (; i < iend && p.before_end(es[i].first); ++i)
+                if (es[i].x && p.check(es[i].first, es[i].last))
+                    scratch_.push_back(handle{li, uint32_t(i)});
+        } else if (!f.right) {
+            size_t y = f.x - (size_t(1) << (f.k - 1));
+            stack[t++] = frame{f.x, f.k, true};
+            if (y >= n || p.after_begin(es[y].max_last))
+                stack[t++] = frame{y, f.k - 1, false};
+        } else if (f.x < n && p.before_end(es[f.x].first)) {
+            if (es[f.x].x && p.check(es[f.x].first, es[f.x].last))
+                scratch_.push_back(handle{li, uint32_t(f.x)});
+            stack[t++] = frame{f.x + (size_t(1) << (f.k - 1)), f.k - 1, false};
+        }
+    }
+}
+
+template <typename T> template <typename P>
+auto interval_index<T>::query(const P& p) -> iterator {
+    maybe_merge_all();
+    size_t base = scratch_.size();
+    for (uint32_t li = 0; li != levels_.size(); ++li)
+        query_level(li, p);
+    for (size_t i = 0; i != pending_.size(); ++i)
+        if (pending_[i] && p.check(pending_[i]->ibegin(), pending_[i]->iend()))
+            scratch_.push_back(handle{uint32_t(levels_.size()), uint32_t(i)});
+    return iterator(this, base);
+}
+
+template <typename T>
+inline auto interval_index<T>::begin_contains(Str key) -> iterator {
+    return query(contains_point{key});
+}
+
+template <typename T>
+inline auto interval_index<T>::begin_contains(Str first, Str last) -> iterator {
+    return query(contains_interval{first, last});
+}
+
+template <typename T>
+inline auto interval_index<T>::begin_contains(const ::interval<Str>& x) -> iterator {
+    return query(contains_interval{x.ibegin(), x.iend()});
+}
+
+template <typename T>
+inline auto interval_index<T>::begin_overlaps(Str first, Str last) -> iterator {
+    return query(overlaps_interval{first, last});
+}
+
+template <typename T>
+inline auto interval_index<T>::begin_overlaps(const ::interval<Str>& x) -> iterator {
+    return query(overlaps_interval{x.ibegin(), x.iend()});
+}
+
+template <typename T>
+inline auto interval_index<T>::end() const -> iterator {
+    return iterator();
+}
+
+template <typename T> template <typename F>
+void interval_index<T>::stab_batch(const Str* keys, size_t nkeys, F f) {
+    if (!nkeys)
+        return;
+    maybe_merge_all();
+    ++busy_;
+    // per level: the intervals that contained the last key, and the first
+    // entry that starts after it
+    uint32_t nlevels = levels_.size();
+    std::vector<std::vector<uint32_t> > active(nlevels);
+    std::vector<size_t> next(nlevels);
+    size_t base = scratch_.size();
+
+    for (size_t k = 0; k != nkeys; ++k) {
+        Str key = keys[k];
+        for (uint32_t li = 0; li != nlevels; ++li) {
+            const entry* es = levels_[li].entries.data();
+            size_t upto = upper_bound_first(levels_[li], key);
+            std::vector<uint32_t>& act = active[li];
+            if (k == 0 || upto - next[li] > sweep_max) {
+                // far from the last key: start over from a stabbing query
+                query_level(li, contains_point{key});
+                act.clear();
+                for (size_t i = base; i != scratch_.size(); ++i)
+                    act.push_back(scratch_[i].i);
+                scratch_.resize(base);
+            } else {
+                // sweep: drop intervals that ended, add those that started
+                size_t j = 0;
+                for (size_t i = 0; i != act.size(); ++i)
+                    if (key < es[act[i]].last)
+                        act[j++] = act[i];
+                act.resize(j);
+                for (size_t i = next[li]; i != upto; ++i)
+                    if (key < es[i].last)
+                        act.push_back(i);
+            }
+            next[li] = upto;
+
+            // levels stay put while busy_, but f may erase
+            for (size_t i = 0; i != act.size(); ++i)
+                if (T* x = es[act[i]].x)
+                    f(k, x);
+        }
+        for (size_t i = 0; i != pending_.size(); ++i)
+            if (T* x = pending_[i])
+                if (contains_point{key}.check(x->ibegin(), x->iend()))
+                    f(k, x);
+    }
+
+    --busy_;
+}
+
+template <typename T>
+T* interval_index<T>::unlink_leftmost_without_rebalance() {
+    T* x = nullptr;
+    while (!x && !pending_.empty()) {
+        x = pending_.back();
+        pending_.pop_back();
+    }
+    while (!x && !levels_.empty()) {
+        level& l = levels_.back();
+        while (!x && !l.entries.empty()) {
+            x = l.entries.back().x;
+            l.entries.pop_back();
+        }
+        if (l.entries.empty())
+            levels_.pop_back();
+    }
+    if (x)
+        --size_;
+    return x;
+}
+
+template <typename T>
+void interval_index<T>::check() const {
+    size_t nlive = 0;
+    for (auto& l : levels_) {
+        size_t nlevel = 0;
+        for (size_t i = 0; i != l.entries.size(); ++i) {
+            const entry& e = l.entries[i];
+            if (i)
+                mandatory_assert(!(e.first < l.entries[i - 1].first));
+            if (e.x) {
+                mandatory_assert(e.first == e.x->ibegin() && e.last == e.x->iend());
+                ++nlevel;
+            }
+        }
+        mandatory_assert(nlevel == l.nlive);
+        nlive += nlevel;
+    }
+    for (auto x : pending_)
+        nlive += x != nullptr;
+    mandatory_assert(nlive == size_);
+}
+
+template <typename T>
+std::ostream& operator<<(std::ostream& s, const interval_index<T>& ix) {
+    for (auto& l : ix.levels_)
+        for (auto& e : l.entries)
+            if (e.x)
+                s << *e.x << "\n";
+    for (auto x : ix.pending_)
+        if (x)
+            s << *x << "\n";
+    return s;
+}
+
+#endif
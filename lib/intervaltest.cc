@@ -0,0 +1,245 @@
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <boost/random.hpp>
+#include "interval_tree.hh"
+#include "interval_index.hh"
+#include "str.hh"
+#include "string.hh"
+#include <sys/time.h>
+#include <sys/resource.h>
+
+struct range {
+    typedef Str endpoint_type;
+    String first;
+    String last;
+    Str subtree_iend_;
+    rblinks<range> rblinks_;
+
+    range(Str f, Str l)
+        : first(f), last(l) {
+    }
+    Str ibegin() const {
+        return first;
+    }
+    Str iend() const {
+        return last;
+    }
+    Str subtree_iend() const {
+        return subtree_iend_;
+    }
+    void set_subtree_iend(Str x) {
+        subtree_iend_ = x;
+    }
+};
+
+std::ostream& operator<<(std::ostream& s, const range& r) {
+    return s << "[" << r.first << ", " << r.last << ")";
+}
+
+static double elapsed(const struct rusage& a, const struct rusage& b) {
+    struct timeval tv;
+    timersub(&b.ru_utime, &a.ru_utime, &tv);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Source ranges in the shape twitternew's timeline join leaves in the "p"
+// table: each follower of a poster subscribes to [p|poster|since, p|poster})
+// from the time it first checked its timeline. Posters are drawn with a
+// skew toward low ids, so a few celebrities carry thousands of
+// overlapping ranges. Posts stab p|poster|now with the same skew.
+static unsigned skewed_poster(int nposters,
+                              boost::random_number_generator<boost::mt19937>& rng) {
+    double x = double(rng(nposters)) * rng(nposters) * rng(nposters);
+    return unsigned(x / nposters / nposters);
+}
+
+static void make_subscriptions(std::vector<range*>& rs, int nposters,
+                               int nsubs, int ntime, boost::mt19937& gen) {
+    boost::random_number_generator<boost::mt19937> rng(gen);
+    char fbuf[64], lbuf[64];
+    for (int i = 0; i < nsubs; ++i) {
+        unsigned poster = skewed_poster(nposters, rng);
+        int flen = sprintf(fbuf, "p|%08u|%010u", poster, unsigned(rng(ntime)));
+        int llen = sprintf(lbuf, "p|%08u}", poster);
+        rs.push_back(new range(Str(fbuf, flen), Str(lbuf, llen)));
+    }
+}
+
+static void make_posts(std::vector<String>& keys, int nposters, int nposts,
+                       int ntime, boost::mt19937& gen) {
+    boost::random_number_generator<boost::mt19937> rng(gen);
+    char buf[64];
+    for (int i = 0; i < nposts; ++i) {
+        unsigned poster = skewed_poster(nposters, rng);
+        int len = sprintf(buf, "p|%08u|%010u", poster, ntime + i);
+        keys.push_back(String(buf, len));
+    }
+}
+
+static void bench(int nposters, int nsubs, int nposts) {
+    boost::mt19937 gen;
+    std::vector<range*> rs;
+    std::vector<String> keys;
+    int ntime = 1000000;
+    make_subscriptions(rs, nposters, nsubs, ntime, gen);
+    make_posts(keys, nposters, nposts, ntime, gen);
+
+    interval_tree<range> tree;
+    interval_index<range> index;
+    struct rusage ru[6];
+    size_t nfound[3] = {0, 0, 0};
+
+    getrusage(RUSAGE_SELF, &ru[0]);
+    for (auto r : rs)
+        tree.insert(*r);
+    getrusage(RUSAGE_SELF, &ru[1]);
+    for (auto& k : keys)
+        for (auto it = tree.begin_contains(Str(k)); it != tree.end(); ++it)
+            ++nfound[0];
+    getrusage(RUSAGE_SELF, &ru[2]);
+
+    for (auto r : rs)
+        index.insert(*r);
+    // first query pays for the snapshot
+    for (auto it = index.begin_contains(Str(keys[0])); it != index.end(); ++it)
+        /* do nothing */;
+    getrusage(RUSAGE_SELF, &ru[3]);
+    for (auto& k : keys)
+        for (auto it = index.begin_contains(Str(k)); it != index.end(); ++it)
+            ++nfound[1];
+    getrusage(RUSAGE_SELF, &ru[4]);
+
+    // sorted batches of 64 posts, as a notification batch would deliver
+    std::vector<Str> batch;
+    for (size_t i = 0; i < keys.size(); i += 64) {
+        batch.assign(keys.begin() + i, keys.begin() + std::min(i + 64, keys.size()));
+        std::sort(batch.begin(), batch.end());
+        index.stab_batch(batch.data(), batch.size(),
+                         [&](size_t, range*) { ++nfound[2]; });
+    }
+    getrusage(RUSAGE_SELF, &ru[5]);
+
+    mandatory_assert(nfound[0] == nfound[1] && nfound[1] == nfound[2]);
+    fprintf(stderr, "%d posters, %d ranges, %d posts, %zu matches\n"
+            "  rbtree: insert %.3f  stab %.3f\n"
+            "  index:  build  %.3f  stab %.3f  batch %.3f\n",
+            nposters, nsubs, nposts, nfound[0],
+            elapsed(ru[0], ru[1]), elapsed(ru[1], ru[2]),
+            elapsed(ru[2], ru[3]), elapsed(ru[3], ru[4]), elapsed(ru[4], ru[5]));
+
+    while (tree.unlink_leftmost_without_rebalance())
+        /* do nothing */;
+    for (auto r : rs)
+        delete r;
+}
+
+template <typename P>
+static void expect(std::vector<range*> got, const std::vector<range*>& live, P pred) {
+    std::vector<range*> want;
+    for (auto r : live)
+        if (pred(r))
+            want.push_back(r);
+    std::sort(got.begin(), got.end());
+    std::sort(want.begin(), want.end());
+    mandatory_assert(got == want);
+}
+
+// Random inserts, erases and queries against a brute-force scan.
+static void fuzz(int N) {
+    boost::mt19937 gen;
+    boost::random_number_generator<boost::mt19937> rng(gen);
+    interval_index<range> index;
+    std::vector<range*> live;
+    char fbuf[64], lbuf[64];
+
+    for (int i = 0; i < N; ++i) {
+        int op = rng(10);
+        int flen = sprintf(fbuf, "k%03u", unsigned(rng(500)));
+        int llen = sprintf(lbuf, "k%03u", unsigned(rng(500)));
+        Str a(fbuf, flen), b(lbuf, llen);
+        if (b < a)
+            std::swap(a, b);
+        if (op < 4) {
+            range* r = new range(a, b);
+            index.insert(*r);
+            live.push_back(r);
+        } else if (op < 6 && !live.empty()) {
+            size_t j = rng(live.size());
+            index.erase(*live[j]);
+            delete live[j];
+            live[j] = live.back();
+            live.pop_back();
+        } else if (op == 6) {
+            std::vector<range*> got;
+            for (auto it = index.begin_contains(a); it != index.end(); ++it)
+                got.push_back(it.operator->());
+            expect(got, live, [&](range* r) { return r->first <= a && a < r->last; });
+        } else if (op == 7) {
+            std::vector<range*> got;
+            for (auto it = index.begin_overlaps(a, b); it != index.end(); ++it)
+                got.push_back(it.operator->());
+            expect(got, live, [&](range* r) { return a < r->last && r->first < b; });
+        } else if (op == 8) {
+            std::vector<range*> got;
+            for (auto it = index.begin_contains(a, b); it != index.end(); ++it)
+                got.push_back(it.operator->());
+            expect(got, live, [&](range* r) { return r->first <= a && b <= r->last; });
+        } else {
+            // erase everything that contains a key while iterating
+            for (auto it = index.begin_contains(a); it != index.end(); ) {
+                range* r = it.operator->();
+                ++it;
+                index.erase(*r);
+                live.erase(std::find(live.begin(), live.end(), r));
+                delete r;
+            }
+            std::vector<range*> got;
+            for (auto it = index.begin_contains(a); it != index.end(); ++it)
+                got.push_back(it.operator->());
+            mandatory_assert(got.empty());
+        }
+
+        if (i % 1000 == 0) {
+            std::vector<String> ks;
+            for (int k = 0; k < 16; ++k) {
+                int len = sprintf(fbuf, "k%03u", unsigned(rng(500)));
+                ks.push_back(String(fbuf, len));
+            }
+            std::sort(ks.begin(), ks.end());
+            std::vector<Str> keys(ks.begin(), ks.end());
+            std::vector<std::vector<range*> > got(keys.size());
+            index.stab_batch(keys.data(), keys.size(),
+                             [&](size_t k, range* r) { got[k].push_back(r); });
+            for (size_t k = 0; k != keys.size(); ++k)
+                expect(got[k], live, [&](range* r) {
+                        return r->first <= keys[k] && keys[k] < r->last;
+                    });
+            index.check();
+        }
+    }
+    index.check();
+    mandatory_assert(index.size() == live.size());
+    while (index.unlink_leftmost_without_rebalance())
+        /* do nothing */;
+    mandatory_assert(index.empty());
+    for (auto r : live)
+        delete r;
+    fprintf(stderr, "fuzz: ok\n");
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "-f") == 0)
+        fuzz(200000);
+    else if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+        int nposters = argc > 2 ? atoi(argv[2]) : 20000;
+        int nsubs = argc > 3 ? atoi(argv[3]) : 500000;
+        bench(nposters, nsubs, 500000);
+    } else {
+        fprintf(stderr, "Usage: intervaltest -f | intervaltest -b [NPOSTERS [NRANGES]]\n");
+        exit(1);
+    }
+}
@@ -150,7 +150,7 @@ inline char* write_double(char* s, double x) {
     *s++ = ffloat64;
     return write_in_net_order<double>(s, x);
 }
-inline char* write_string(char* s, const char *data, int len) {
+inline char* write_string_header(char* s, int len) {
     if (len < nfixstr)
         *s++ = 0xA0 + len;
     else if (len < 256) {
@@ -163,6 +163,10 @@ inline char* write_string(char* s, const char *data, int len) {
         *s++ = fstr32;
         s = write_in_net_order<uint32_t>(s, len);
     }
+    return s;
+}
+inline char* write_string(char* s, const char *data, int len) {
+    s = write_string_header(s, len);
     memcpy(s, data, len);
     return s + len;
 }
@@ -419,4 +419,90 @@ String Partitioner::unparse() const {
     return ps_.unparse();
 }
 
+void Partitioner::reassign(const String &first, const String &last, int owner) {
+    assert(first < last);
+    auto it = moved_.lower_bound(first);
+
+    // trim an earlier move that starts before first, keeping any tail
+    // past last
+    if (it != moved_.begin()) {
+        auto prev = it;
+        --prev;
+        if (first < prev->second.last) {
+            if (last < prev->second.last)
+                moved_.insert(make_pair(last, prev->second));
+            prev->second.last = first;
+        }
+    }
+
+    // drop moves inside [first, last), and trim one that runs past last
+    while (it != moved_.end() && it->first < last) {
+        if (last < it->second.last) {
+            moved tail = it->second;
+            moved_.erase(it);
+            moved_.insert(make_pair(last, tail));
+            break;
+        }
+        it = moved_.erase(it);
+    }
+
+    moved_[first] = moved{last, owner};
+}
+
+void Partitioner::analyze_moved(const String &first, const String &last,
+                                unsigned limit,
+                                std::vector<keyrange> &result) const {
+    std::vector<keyrange> base;
+    ps_.analyze(first, last, 0, base);
+    base.push_back(keyrange(last, -1));
+    result.clear();
+
+    auto m = moved_.upper_bound(first);
+    if (m != moved_.begin()) {
+        --m;
+        if (!(first < m->second.last))
+            ++m;
+    }
+
+    // walk the partition table's pieces, cutting out the moved ranges
+    for (size_t i = 0; i + 1 != base.size(); ++i) {
+        String k = base[i].key;
+        const String &kend = base[i + 1].key;
+        while (k < kend) {
+            while (m != moved_.end() && !(k < m->second.last))
+                ++m;
+            int owner = base[i].owner;
+            String next = kend;
+            if (m != moved_.end() && !(k < m->first)) {
+                owner = m->second.owner;
+                if (m->second.last < kend)
+                    next = m->second.last;
+            } else if (m != moved_.end() && m->first < kend)
+                next = m->first;
+            if (result.empty() || result.back().owner != owner)
+                result.push_back(keyrange(k, owner));
+            k = next;
+        }
+    }
+
+    if (result.empty())
+        result.push_back(keyrange(first, owner(first)));
+    else if (limit && result.size() > limit)
+        result.resize(limit, keyrange(String(), -1));
+}
+
+Json Partitioner::unparse_reassigned() const {
+    Json j = Json::make_array();
+    for (auto &m : moved_)
+        j.push_back(Json::array(m.first, m.second.last, m.second.owner));
+    return j;
+}
+
+void Partitioner::cell(Str key, String &first, String &last) const {
+    partition_iterator pi = ps_.find(key);
+    first = pi.key();
+    ++pi;
+    last = pi.key();
+}
+
 }
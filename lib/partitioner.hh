@@ -3,6 +3,7 @@
 #include "keyrange.hh"
 #include "str.hh"
 #include <vector>
+#include <map>
 #include <random>
 
 class Json;
@@ -137,6 +138,16 @@ class Partitioner {
 
     inline bool is_backend(int seqid) const;
 
+    // Give [first, last) to owner, overriding the partition table and any
+    // earlier reassignment of those keys. Used by live range migration.
+    void reassign(const String &first, const String &last, int owner);
+    inline size_t nreassigned() const;
+    Json unparse_reassigned() const;
+
+    // Set [first, last) to the smallest range of the partition table
+    // that holds key: the unit the load balancer moves.
+    void cell(Str key, String &first, String &last) const;
+
     static Partitioner *make(const String &name, uint32_t nhosts, uint32_t default_owner);
     static Partitioner *make(const String &name, uint32_t nbacking, uint32_t nhosts, uint32_t default_owner);
 
@@ -146,6 +157,16 @@ class Partitioner {
     int nhosts_;
     int nbacking_;
     partition_set ps_;
+
+  private:
+    struct moved {
+        String last;
+        int owner;
+    };
+    std::map<String, moved> moved_;     // disjoint, by first key
+
+    void analyze_moved(const String &first, const String &last,
+                       unsigned limit, std::vector<keyrange> &result) const;
 };
 
 
@@ -291,10 +312,18 @@ inline Partitioner::~Partitioner() {
 inline void Partitioner::analyze(const String &first, const String &last,
                                  unsigned limit,
                                  std::vector<keyrange> &result) const {
-    ps_.analyze(first, last, limit, result);
+    if (moved_.empty())
+        ps_.analyze(first, last, limit, result);
+    else
+        analyze_moved(first, last, limit, result);
 }
 
 inline int Partitioner::owner(const String &key) const {
+    if (unlikely(!moved_.empty())) {
+        auto it = moved_.upper_bound(key);
+        if (it != moved_.begin() && key < (--it)->second.last)
+            return it->second.owner;
+    }
     return ps_.find(key).server();
 }
 
@@ -307,5 +336,9 @@ inline bool Partitioner::is_backend(int seqid) const {
     return seqid < nbacking_;
 }
 
+inline size_t Partitioner::nreassigned() const {
+    return moved_.size();
+}
+
 }
 #endif
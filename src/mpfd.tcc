@@ -17,6 +17,8 @@ void msgpack_fd::construct() {
     rdlen_ = 0;
     rdtotal_ = 0;
     rdquota_ = rdbatch;
+    rdframe_need_ = 0;
+    rdframe_ = false;
     rdreply_seq_ = 0;
 
     wrelem_.push_back(wrelem());
@@ -60,19 +62,42 @@ msgpack_fd::~msgpack_fd() {
 }
 
 void msgpack_fd::write(const Json& j) {
-    wrelem* w = &wrelem_.back();
-    if (wrsize_ >= wrlowat_ && !wrblocked_)
-        write_once();
-    if (w->sa.length() >= wrhiwat) {
+    wrelem* w = write_tail();
+    int mark = w->sa.length();
+    msgpack::unparse(w->sa, j);
+    write_account(w, mark);
+    write_wake();
+}
+
+/** @brief Write a binary frame (see pqframe.hh).
+
+    The reader hands a frame on as a Json array holding the frame itself:
+    [command, seq, frame] for a request, [command, seq, status, frame] for
+    a reply. Large frames are referenced and sent with writev. */
+void msgpack_fd::write_frame(const String& frame) {
+    wrelem* w = write_tail();
+    int mark = w->sa.length();
+    if (frame.length() < wrextmin)
+        w->sa.append(frame.data(), frame.length());
+    else if (w->sa.empty())
+        w->ext = frame;
+    else {
         wrelem_.push_back(wrelem());
-        w = &wrelem_.back();
-        w->sa.reserve(wrcap);
-        w->pos = 0;
+        wrelem_.back().ext = frame;
+        wrelem_.back().pos = 0;
     }
-    int old_len = w->sa.length();
-    msgpack::unparse(w->sa, j);
-    wrsize_ += w->sa.length() - old_len;
-    wrtotal_ += w->sa.length() - old_len;
+    if (frame.length() < wrextmin)
+        write_account(w, mark);
+    else {
+        wrsize_ += frame.length();
+        wrtotal_ += frame.length();
+        wrelem_.push_back(wrelem());
+        wrelem_.back().pos = 0;
+    }
+    write_wake();
+}
+
+void msgpack_fd::write_wake() {
     if (wrwake_)
         tamer::at_asap(std::move(wrwake_));
     assert(!wrwake_);
@@ -100,18 +125,26 @@ bool msgpack_fd::read_one_message() {
     assert(rdquota_ != 0);
 
  readmore:
-    // if buffer empty, read more data
-    if (rdpos_ == rdlen_) {
+    // if buffer empty, or a frame is incomplete, read more data
+    if (rdpos_ == rdlen_ || rdframe_need_) {
         // make new buffer or reuse existing buffer
-        if (rdcap - rdpos_ < 4096) {
-            if (rdbuf_.is_shared())
+        if (rdpos_ == rdlen_ && rdbuf_.length() - rdpos_ < 4096) {
+            if (rdbuf_.is_shared() || rdbuf_.length() != rdcap)
                 rdbuf_ = String::make_uninitialized(rdcap);
             rdpos_ = rdlen_ = 0;
+        } else if (rdframe_need_ > rdbuf_.length() - rdpos_) {
+            // frames are parsed in place, so move this one's start to a
+            // buffer that can hold all of it
+            String buf = String::make_uninitialized(std::max(size_t(rdcap), rdframe_need_));
+            memcpy(buf.mutable_data(), rdbuf_.data() + rdpos_, rdlen_ - rdpos_);
+            rdbuf_ = buf;
+            rdlen_ -= rdpos_;
+            rdpos_ = 0;
         }
 
         ssize_t amt = ::read(rfd_.value(),
-                             const_cast<char*>(rdbuf_.data()) + rdpos_,
-                             rdcap - rdpos_);
+                             const_cast<char*>(rdbuf_.data()) + rdlen_,
+                             rdbuf_.length() - rdlen_);
 
         if (amt != 0 && amt != (ssize_t) -1) {
             rdlen_ += amt;
@@ -128,6 +161,14 @@ bool msgpack_fd::read_one_message() {
     }
 
     // process new data
+    if (rdparser_.empty() && pq::Frame::is_frame(rdbuf_.data() + rdpos_)) {
+        if (!read_frame())
+            goto readmore;
+        --rdquota_;
+        if (rdquota_ == 0)
+            rdwake_();
+        return true;
+    }
     size_t amt = rdparser_.consume(rdbuf_.begin() + rdpos_,
                                    rdlen_ - rdpos_, rdbuf_);
     rdpos_ += amt;
@@ -143,6 +184,28 @@ bool msgpack_fd::read_one_message() {
         goto readmore;
 }
 
+// Take the frame at rdpos_ if it has fully arrived.
+bool msgpack_fd::read_frame() {
+    const char* s = rdbuf_.data() + rdpos_;
+    size_t len = pq::Frame::wire_length(s, rdlen_ - rdpos_);
+    if (!len || rdlen_ - rdpos_ < len) {
+        rdframe_need_ = len ? len : size_t(pq::frame_header_size);
+        return false;
+    }
+
+    String frame = rdbuf_.fast_substring(s, s + len);
+    int command = pq::Frame::command(s);
+    if (command < 0)
+        rdparser_.result() = Json::array(command, pq::Frame::seq(s),
+                                         pq::Frame::status(s), frame);
+    else
+        rdparser_.result() = Json::array(command, pq::Frame::seq(s), frame);
+    rdframe_need_ = 0;
+    rdframe_ = true;
+    rdpos_ += len;
+    return true;
+}
+
 tamed void msgpack_fd::reader_coroutine() {
     // NB The msgpack_fd::coroutines may outlive the msgpack_fd itself. They
     // are programmed to survive the deletion of the msgpack_fd by checking
@@ -157,7 +220,7 @@ tamed void msgpack_fd::reader_coroutine() {
     kill = rdkill_ = tamer::make_event(rendez);
 
     while (kill && rfd_) {
-        if (rdquota_ == 0 && rdpos_ != rdlen_)
+        if (rdquota_ == 0 && rdpos_ != rdlen_ && !rdframe_need_)
             twait [description_] { tamer::at_asap(make_event()); }
         else if (rdquota_ == 0)
             twait [description_] { tamer::at_fd_read(rfd_.value(), make_event()); }
@@ -183,9 +246,10 @@ tamed void msgpack_fd::reader_coroutine() {
 
 bool msgpack_fd::dispatch(bool exit_on_request) {
     Json& result = rdparser_.result();
-    if (!rdparser_.success())
+    if (!rdframe_ && !rdparser_.success())
         result = Json();        // XXX reset connection
     rdparser_.reset();
+    rdframe_ = false;
     if (result.is_a() && result[0].is_i() && result[1].is_i()
         && result[0].as_i() < 0) {
         unsigned long seq = result[1].as_i();
@@ -218,31 +282,33 @@ bool msgpack_fd::dispatch(bool exit_on_request) {
 void msgpack_fd::check() const {
     // document invariants
     assert(!wrelem_.empty());
+    assert(wrelem_.back().ext.empty());
     for (auto& w : wrelem_)
-        assert(w.pos <= w.sa.length());
+        assert(w.pos <= w.length());
     for (size_t i = 1; i < wrelem_.size(); ++i)
         assert(wrelem_[i].pos == 0);
     for (size_t i = 0; i + 1 < wrelem_.size(); ++i)
-        assert(wrelem_[i].pos < wrelem_[i].sa.length());
+        assert(wrelem_[i].pos < wrelem_[i].length());
     if (wrelem_.size() == 1)
-        assert(wrelem_[0].pos < wrelem_[0].sa.length()
+        assert(wrelem_[0].pos < wrelem_[0].length()
                || wrelem_[0].sa.empty());
     size_t wrsize = 0;
     for (auto& w : wrelem_)
-        wrsize += w.sa.length() - w.pos;
+        wrsize += w.length() - w.pos;
     assert(wrsize == wrsize_);
 }
 
 void msgpack_fd::write_once() {
     // check();
-    assert(!wrelem_.front().sa.empty());
+    assert(wrelem_.front().length() != 0);
 
-    struct iovec iov[3];
-    int iov_count = (wrelem_.size() > 3 ? 3 : (int) wrelem_.size());
+    // large scan values sit in their own elements, so gather several
+    struct iovec iov[wriovmax];
+    int iov_count = (wrelem_.size() > wriovmax ? wriovmax : (int) wrelem_.size());
     size_t total = 0;
     for (int i = 0; i != iov_count; ++i) {
-        iov[i].iov_base = wrelem_[i].sa.data() + wrelem_[i].pos;
-        iov[i].iov_len = wrelem_[i].sa.length() - wrelem_[i].pos;
+        iov[i].iov_base = const_cast<char*>(wrelem_[i].data()) + wrelem_[i].pos;
+        iov[i].iov_len = wrelem_[i].length() - wrelem_[i].pos;
         total += iov[i].iov_len;
     }
 
@@ -257,12 +323,12 @@ void msgpack_fd::write_once() {
         wrpos_ += amt;
         wrsize_ -= amt;
         while (wrelem_.size() > 1
-               && amt >= wrelem_.front().sa.length() - wrelem_.front().pos) {
-            amt -= wrelem_.front().sa.length() - wrelem_.front().pos;
+               && amt >= wrelem_.front().length() - wrelem_.front().pos) {
+            amt -= wrelem_.front().length() - wrelem_.front().pos;
             wrelem_.pop_front();
         }
         wrelem_.front().pos += amt;
-        if (wrelem_.front().pos == wrelem_.front().sa.length()) {
+        if (wrelem_.front().pos == wrelem_.front().length()) {
             assert(wrelem_.size() == 1);
             wrelem_.front().sa.clear();
             wrelem_.front().pos = 0;
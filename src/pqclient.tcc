@@ -30,7 +30,7 @@ tamed void DirectClient::count(const String& first, const String& last, const St
     twait [first + "," + last] {
         server_.validate(first, last, make_event(it));
     }
-    e(std::distance(it, server_.table_for(first, last).lower_bound(scanlast)));
+    e(server_.table_for(first, last).count(first, scanlast));
 }
 
 tamed void DirectClient::add_count(const String& first, const String& last,
@@ -47,7 +47,7 @@ tamed void DirectClient::add_count(const String& first, const String& last, cons
     twait [first + "," + last] {
         server_.validate(first, last, make_event(it));
     }
-    e(e.result() + std::distance(it, server_.table_for(first, last).lower_bound(scanlast)));
+    e(e.result() + server_.table_for(first, last).count(first, scanlast));
 }
 
 tamed void DirectClient::scan(const String& first, const String& last,
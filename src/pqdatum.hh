@@ -1,7 +1,9 @@
 #ifndef PEQUOD_DATUM_HH
 #define PEQUOD_DATUM_HH
 #include <boost/intrusive/set.hpp>
+#include "btree.hh"
 #include "pqbase.hh"
+#include "pqmemory.hh"
 #include "local_str.hh"
 
 namespace pq {
@@ -14,6 +16,11 @@ typedef boost::intrusive::set_base_hook<
 typedef boost::intrusive::set_member_hook<
     boost::intrusive::link_mode<boost::intrusive::normal_link>,
     boost::intrusive::optimize_size<true> > pequod_set_member_hook;
+#if HAVE_BTREE_STORE
+typedef btree_set_base_hook pequod_store_hook;
+#else
+typedef pequod_set_base_hook pequod_store_hook;
+#endif
 
 template <typename T> class KeyHook {
   public:
@@ -22,7 +29,7 @@ template <typename T> class KeyHook {
     }
 };
 
-class Datum : public pequod_set_base_hook, public KeyHook<Datum> {
+class Datum : public pequod_store_hook, public KeyHook<Datum> {
   public:
     static const char table_marker[];
 
@@ -50,6 +57,9 @@ class Datum : public pequod_set_base_hook, public KeyHook<Datum> {
     static const Datum empty_datum;
     static const Datum max_datum;
 
+    static inline void* operator new(size_t sz);
+    static inline void operator delete(void* p, size_t sz);
+
   private:
     LocalStr<24> key_;
     String value_;
@@ -87,8 +97,33 @@ struct DatumDispose {
     }
 };
 
+#if HAVE_BTREE_STORE
+typedef btree_set<Datum> ServerStore;
+
+// The B+tree counts the elements under each node, so positions are
+// logarithmic; the red-black tree has to walk.
+inline size_t store_distance(const ServerStore& s, ServerStore::const_iterator a,
+                             ServerStore::const_iterator b) {
+    return s.rank(b) - s.rank(a);
+}
+inline ServerStore::iterator store_advance(ServerStore& s, ServerStore::iterator it,
+                                           size_t n) {
+    return s.nth(s.rank(it) + n);
+}
+#else
 typedef boost::intrusive::set<Datum> ServerStore;
 
+inline size_t store_distance(const ServerStore&, ServerStore::const_iterator a,
+                             ServerStore::const_iterator b) {
+    return std::distance(a, b);
+}
+inline ServerStore::iterator store_advance(ServerStore&, ServerStore::iterator it,
+                                           size_t n) {
+    std::advance(it, n);
+    return it;
+}
+#endif
+
 
 inline bool operator<(const Datum& a, const Datum& b) {
     return a.key() < b.key();
@@ -112,6 +147,14 @@ inline Datum::Datum(Str key, const String& value)
     : key_(key), value_(value), refcount_(0), owner_{nullptr} {
 }
 
+inline void* Datum::operator new(size_t sz) {
+    return datum_pool.allocate(sz);
+}
+
+inline void Datum::operator delete(void* p, size_t sz) {
+    datum_pool.deallocate(p, sz);
+}
+
 inline bool Datum::is_table() const {
     return value_.data() == table_marker;
 }
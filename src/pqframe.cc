@@ -0,0 +1,80 @@
+#include "pqframe.hh"
+#if HAVE_LIBLZ4
+#include <lz4.h>
+#endif
+
+namespace pq {
+
+String FrameWriter::finish(size_t compress_min) {
+    char* s = sa_.data();
+    write_in_net_order<uint32_t>(s + frame_header_size, n_);
+    size_t plen = sa_.length() - frame_header_size;
+#if HAVE_LIBLZ4
+    if (compress_min && plen >= compress_min && plen <= LZ4_MAX_INPUT_SIZE) {
+        StringAccum z;
+        int zcap = LZ4_compressBound(plen);
+        char* zs = z.reserve(frame_header_size + 4 + zcap);
+        int zlen = LZ4_compress_default(s + frame_header_size,
+                                        zs + frame_header_size + 4, plen, zcap);
+        if (zlen > 0 && size_t(zlen) + 4 < plen) {
+            memcpy(zs, s, frame_header_size);
+            zs[3] |= frame_lz4;
+            write_in_net_order<uint32_t>(zs + 16, zlen + 4);
+            write_in_net_order<uint32_t>(zs + frame_header_size, plen);
+            z.adjust_length(frame_header_size + 4 + zlen);
+            return z.take_string();
+        }
+    }
+#else
+    (void) compress_min;
+#endif
+    write_in_net_order<uint32_t>(s + 16, plen);
+    return sa_.take_string();
+}
+
+bool Frame::assign(const String& data) {
+    n_ = 0;
+    first_ = last_ = nullptr;
+    if (size_t(data.length()) < frame_header_size + 4
+        || !is_frame(data.data()) || data[1] != frame_version
+        || wire_length(data.data(), data.length()) != size_t(data.length()))
+        return false;
+
+    buf_ = data;
+    const char* p = data.data() + frame_header_size;
+    const char* end = data.end();
+    if (data[3] & frame_lz4) {
+#if HAVE_LIBLZ4
+        uint32_t rawlen = read_in_net_order<uint32_t>(p);
+        if (rawlen < 4 || rawlen > LZ4_MAX_INPUT_SIZE)
+            return false;
+        buf_ = String::make_uninitialized(rawlen);
+        int amt = LZ4_decompress_safe(p + 4, buf_.mutable_data(),
+                                      end - p - 4, rawlen);
+        if (amt != int(rawlen))
+            return false;
+        p = buf_.data();
+        end = buf_.end();
+#else
+        return false;
+#endif
+    }
+
+    // check every record once so the iterator need not
+    if (end - p < 4)
+        return false;
+    uint32_t n = read_in_net_order<uint32_t>(p);
+    first_ = p + 4;
+    for (p = first_; n_ != n; ++n_) {
+        uint32_t klen, vlen;
+        if (!(p = read_varint(p, end, klen)) || uint32_t(end - p) < klen
+            || !(p = read_varint(p + klen, end, vlen))
+            || (vlen && uint32_t(end - p) < vlen - 1))
+            return false;
+        p += vlen ? vlen - 1 : 0;
+    }
+    last_ = p;
+    return true;
+}
+
+} // namespace pq
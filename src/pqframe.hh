@@ -0,0 +1,239 @@
+#ifndef PEQUOD_FRAME_HH
+#define PEQUOD_FRAME_HH
+#include "str.hh"
+#include "string.hh"
+#include "straccum.hh"
+#include "compiler.hh"
+
+namespace pq {
+
+// Binary frames for server-to-server traffic. A frame shares a msgpack_fd
+// stream with msgpack messages: it starts with 0xC1, a byte msgpack never
+// uses. The 20-byte header is
+//
+//   0       frame_marker
+//   1       frame_version
+//   2       command (int8; replies are negative, as in msgpack rpcs)
+//   3       flags
+//   4       status (int8, replies only)
+//   5..7    zero
+//   8..15   seq (as wide as RemoteClient's, so replies match after 2^32)
+//   16..19  payload length
+//
+// all in network order. The payload is a 4-byte record count, then each
+// record as a varint key length, the key, a varint of the value length
+// plus one, and the value; 0 in place of the value length marks a
+// missing value (an erase). If flags has frame_lz4, the payload is the
+// 4-byte uncompressed length followed by an LZ4 block.
+enum {
+    frame_marker = 0xC1, frame_version = 1, frame_header_size = 20,
+    frame_lz4 = 1
+};
+
+class FrameWriter {
+  public:
+    inline FrameWriter(int command, uint64_t seq, int status = 0);
+
+    inline void push(Str key, Str value);
+    inline void push_null(Str key);
+    inline uint32_t size() const;
+
+    // Finish the frame and return it. Payloads of at least compress_min
+    // bytes are LZ4 compressed if that makes them smaller; 0 never
+    // compresses.
+    String finish(size_t compress_min = 0);
+
+  private:
+    StringAccum sa_;
+    uint32_t n_;
+};
+
+class Frame {
+  public:
+    inline Frame();
+
+    // Return the size of the frame starting at s, or 0 if fewer than
+    // frame_header_size bytes are available.
+    static inline size_t wire_length(const char* s, size_t len);
+    static inline bool is_frame(const char* s);
+    static inline int command(const char* s);
+    static inline uint64_t seq(const char* s);
+    static inline int status(const char* s);
+
+    // Parse a whole frame. Records refer to data in place, or to a
+    // decompressed copy. Returns false if the frame is malformed or uses
+    // compression this build cannot read.
+    bool assign(const String& data);
+
+    inline uint32_t size() const;
+
+    class iterator {
+      public:
+        inline Str key() const;
+        inline Str value() const;
+        inline bool is_null() const;
+        inline void operator++();
+        inline bool operator!=(const iterator& x) const;
+        // for projections that need String values sharing the frame
+        inline String value_string() const;
+      private:
+        const char* p_;
+        const char* end_;
+        const char* kp_;
+        const char* vp_;
+        uint32_t klen_;
+        uint32_t vlen_;         // value length plus one; 0 if missing
+        const String* buf_;
+        inline iterator(const char* p, const char* end, const String* buf);
+        inline void load();
+        friend class Frame;
+    };
+    inline iterator begin() const;
+    inline iterator end() const;
+
+    static inline char* write_varint(char* s, uint32_t x);
+    static inline const char* read_varint(const char* s, const char* end,
+                                          uint32_t& x);
+
+  private:
+    String buf_;
+    const char* first_;
+    const char* last_;
+    uint32_t n_;
+};
+
+
+inline FrameWriter::FrameWriter(int command, uint64_t seq, int status)
+    : n_(0) {
+    char* s = sa_.extend(frame_header_size + 4);
+    memset(s, 0, frame_header_size + 4);
+    s[0] = char(frame_marker);
+    s[1] = frame_version;
+    s[2] = int8_t(command);
+    s[4] = int8_t(status);
+    write_in_net_order<uint64_t>(s + 8, seq);
+}
+
+inline char* Frame::write_varint(char* s, uint32_t x) {
+    for (; x >= 0x80; x >>= 7)
+        *s++ = char(x | 0x80);
+    *s++ = char(x);
+    return s;
+}
+
+// Returns the position after the varint, or null if it is cut off.
+inline const char* Frame::read_varint(const char* s, const char* end,
+                                      uint32_t& x) {
+    x = 0;
+    for (int shift = 0; s != end && shift < 35; shift += 7, ++s) {
+        x |= uint32_t(*s & 0x7F) << shift;
+        if (!(*s & 0x80))
+            return s + 1;
+    }
+    return nullptr;
+}
+
+inline void FrameWriter::push(Str key, Str value) {
+    char* s = sa_.reserve(key.length() + value.length() + 10);
+    s = Frame::write_varint(s, key.length());
+    memcpy(s, key.data(), key.length());
+    s = Frame::write_varint(s + key.length(), value.length() + 1);
+    memcpy(s, value.data(), value.length());
+    sa_.set_end(s + value.length());
+    ++n_;
+}
+
+inline void FrameWriter::push_null(Str key) {
+    char* s = sa_.reserve(key.length() + 6);
+    s = Frame::write_varint(s, key.length());
+    memcpy(s, key.data(), key.length());
+    s[key.length()] = 0;
+    sa_.set_end(s + key.length() + 1);
+    ++n_;
+}
+
+inline uint32_t FrameWriter::size() const {
+    return n_;
+}
+
+inline Frame::Frame()
+    : first_(nullptr), last_(nullptr), n_(0) {
+}
+
+inline bool Frame::is_frame(const char* s) {
+    return (unsigned char) s[0] == frame_marker;
+}
+
+inline size_t Frame::wire_length(const char* s, size_t len) {
+    if (len < frame_header_size)
+        return 0;
+    return frame_header_size + read_in_net_order<uint32_t>(s + 16);
+}
+
+inline int Frame::command(const char* s) {
+    return int8_t(s[2]);
+}
+
+inline uint64_t Frame::seq(const char* s) {
+    return read_in_net_order<uint64_t>(s + 8);
+}
+
+inline int Frame::status(const char* s) {
+    return int8_t(s[4]);
+}
+
+inline uint32_t Frame::size() const {
+    return n_;
+}
+
+inline Frame::iterator::iterator(const char* p, const char* end,
+                                 const String* buf)
+    : p_(p), end_(end), buf_(buf) {
+    load();
+}
+
+inline void Frame::iterator::load() {
+    // assign() checked the record lengths
+    if (p_ != end_) {
+        kp_ = read_varint(p_, end_, klen_);
+        vp_ = read_varint(kp_ + klen_, end_, vlen_);
+    }
+}
+
+inline Str Frame::iterator::key() const {
+    return Str(kp_, klen_);
+}
+
+inline bool Frame::iterator::is_null() const {
+    return vlen_ == 0;
+}
+
+inline Str Frame::iterator::value() const {
+    return is_null() ? Str() : Str(vp_, vlen_ - 1);
+}
+
+inline String Frame::iterator::value_string() const {
+    if (is_null())
+        return String();
+    return buf_->fast_substring(vp_, vp_ + vlen_ - 1);
+}
+
+inline void Frame::iterator::operator++() {
+    p_ = vp_ + (is_null() ? 0 : vlen_ - 1);
+    load();
+}
+
+inline bool Frame::iterator::operator!=(const iterator& x) const {
+    return p_ != x.p_;
+}
+
+inline auto Frame::begin() const -> iterator {
+    return iterator(first_, last_, &buf_);
+}
+
+inline auto Frame::end() const -> iterator {
+    return iterator(last_, last_, &buf_);
+}
+
+} // namespace pq
+#endif
@@ -1,18 +1,43 @@
 // -*- mode: c++ -*-
 #include "pqinterconnect.hh"
+#include "pqframe.hh"
 
 namespace pq {
 
+size_t Interconnect::notify_batch_bytes = 0;
+double Interconnect::notify_batch_delay = 0;
+bool Interconnect::binary_frames = false;
+size_t Interconnect::frame_compress_min = 0;
+uint64_t Interconnect::ndropped_notify = 0;
+
 tamed void Interconnect::subscribe(const String& first, const String& last,
                                    int32_t subscriber, event<scan_result> e) {
-    tvars { Json j; }
+    tvars { Json j, opt; }
+    opt = Json().set("subscriber", subscriber);
+    if (binary_frames)
+        opt.set("binary", true);
     twait ["subscribe " + first.substring(0, 2)] {
-        fd_->call(Json::array(pq_subscribe, seq_, first, last,
-                              Json().set("subscriber", subscriber)),
+        fd_->call(Json::array(pq_subscribe, seq_, first, last, opt),
                   make_event(j));
         ++seq_;
     }
-    e(scan_result(j && j[2].to_i() == pq_ok ? j[3] : Json::make_array()));
+    if (j && j[2].to_i() == pq_ok && j[3].is_s())
+        e(scan_result(frame_scan_result(j[3].as_s())));
+    else
+        e(scan_result(j && j[2].to_i() == pq_ok ? j[3] : Json::make_array()));
+}
+
+// Unpack a binary scan reply. Values share the frame's buffer.
+Json Interconnect::frame_scan_result(const String& data) {
+    Frame f;
+    if (!f.assign(data))
+        return Json::make_array();
+    Json r = Json::make_array_reserve(2 * f.size());
+    for (auto it = f.begin(); it != f.end(); ++it) {
+        r.push_back(String(it.key()));
+        r.push_back(it.value_string());
+    }
+    return r;
 }
 
 tamed void Interconnect::unsubscribe(const String& first, const String& last,
@@ -30,8 +55,17 @@ tamed void Interconnect::unsubscribe(const String& first, const String& last,
 tamed void Interconnect::notify_insert(const String& key, const String& value,
                                        event<> e) {
     tvars { Json j; }
+    if (notify_batch_bytes) {
+        queue_notify(key, Json(value), std::move(e));
+        return;
+    }
     twait ["notify+ " + key.substring(0, 2)] {
-        fd_->call(Json::array(pq_notify_insert, seq_, key, value), make_event(j));
+        if (binary_frames) {
+            FrameWriter fw(pq_notify_batch, seq_);
+            fw.push(key, value);
+            fd_->call_frame(fw.finish(frame_compress_min), make_event(j));
+        } else
+            fd_->call(Json::array(pq_notify_insert, seq_, key, value), make_event(j));
         ++seq_;
     }
     e();
@@ -39,16 +73,110 @@ tamed void Interconnect::notify_insert(const String& key, const String& value,
 
 tamed void Interconnect::notify_erase(const String& key, event<> e) {
     tvars { Json j; }
+    if (notify_batch_bytes) {
+        queue_notify(key, Json(), std::move(e));
+        return;
+    }
     twait ["notify- " + key.substring(0, 2)] {
-        fd_->call(Json::array(pq_notify_erase, seq_, key), make_event(j));
+        if (binary_frames) {
+            FrameWriter fw(pq_notify_batch, seq_);
+            fw.push_null(key);
+            fd_->call_frame(fw.finish(frame_compress_min), make_event(j));
+        } else
+            fd_->call(Json::array(pq_notify_erase, seq_, key), make_event(j));
         ++seq_;
     }
     e();
 }
 
+void Interconnect::queue_notify(const String& key, Json value, event<> e) {
+    auto p = notifyq_.insert(std::make_pair(key, Json()));
+    if (p.second)
+        notifybytes_ += key.length();
+    else if (p.first->second.is_s())
+        notifybytes_ -= p.first->second.as_s().length();
+    if (value.is_s())
+        notifybytes_ += value.as_s().length();
+    p.first->second = std::move(value);
+    if (e)
+        notifywait_.push_back(std::move(e));
+
+    if (notifybytes_ >= notify_batch_bytes)
+        flush_notify();
+    else if (!notify_scheduled_) {
+        notify_scheduled_ = true;
+        notify_timer();
+    }
+}
+
+void Interconnect::flush_notify() {
+    if (notifyq_.empty())
+        return;
+    Json req;
+    String frame;
+    if (binary_frames) {
+        FrameWriter fw(pq_notify_batch, seq_);
+        for (auto& x : notifyq_)
+            if (x.second.is_s())
+                fw.push(x.first, x.second.as_s());
+            else
+                fw.push_null(x.first);
+        frame = fw.finish(frame_compress_min);
+    } else {
+        // [pq_notify_batch, seq, [key, value, key, value, ...]], sorted by key
+        Json kv = Json::make_array_reserve(2 * notifyq_.size());
+        for (auto& x : notifyq_) {
+            kv.push_back(x.first);
+            kv.push_back(std::move(x.second));
+        }
+        req = Json::array(pq_notify_batch, seq_, std::move(kv));
+    }
+    notifyq_.clear();
+    notifybytes_ = 0;
+    std::vector<event<> > waiters;
+    waiters.swap(notifywait_);
+    send_notify(std::move(req), std::move(frame), std::move(waiters));
+    ++seq_;
+}
+
+tamed void Interconnect::notify_timer() {
+    // NB may outlive the interconnect, like RemoteClient::batch_timer
+    tvars {
+        tamer::event<> kill;
+        tamer::rendezvous<> rendez;
+    }
+
+    kill = notifykill_ = tamer::make_event(rendez);
+    if (notify_batch_delay > 0)
+        twait { tamer::at_delay(notify_batch_delay, make_event()); }
+    else
+        twait { tamer::at_asap(make_event()); }
+    if (kill) {
+        notify_scheduled_ = false;
+        flush_notify();
+        kill();
+    }
+}
+
+tamed void Interconnect::send_notify(Json req, String frame,
+                                     std::vector<event<> > waiters) {
+    tvars { Json j; size_t i; }
+    twait [twait_description("notify")] {
+        if (frame)
+            fd_->call_frame(frame, make_event(j));
+        else
+            fd_->call(req, make_event(j));
+    }
+    for (i = 0; i != waiters.size(); ++i)
+        waiters[i]();
+}
+
 tamed void Interconnect::invalidate(const String& first, const String& last,
                                     event<> e) {
     tvars { Json j; }
+    // queued notifications for the range must not arrive after it is
+    // invalidated
+    flush_notify();
     twait ["invalidate " + first.substring(0, 2)] {
         fd_->call(Json::array(pq_invalidate, seq_, first, last),
                   make_event(j));
@@ -57,4 +185,31 @@ tamed void Interconnect::invalidate(const String& first, const String& last,
     e();
 }
 
+tamed void Interconnect::migrate(const String& first, const String& last,
+                                 Json opt, event<bool> e) {
+    tvars { Json j; }
+    flush_notify();
+    flush_batch();
+    twait ["migrate " + first.substring(0, 2)] {
+        fd_->call(Json::array(pq_migrate, seq_, first, last, opt),
+                  make_event(j));
+        ++seq_;
+    }
+    e(j && j[2].to_i() == pq_ok);
+}
+
+tamed void Interconnect::repartition(const String& first, const String& last,
+                                     int32_t from, int32_t owner, event<> e) {
+    tvars { Json j; }
+    flush_notify();
+    flush_batch();
+    twait ["repartition " + first.substring(0, 2)] {
+        fd_->call(Json::array(pq_repartition, seq_, first, last,
+                              Json().set("from", from).set("owner", owner)),
+                  make_event(j));
+        ++seq_;
+    }
+    e();
+}
+
 }
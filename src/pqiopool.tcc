@@ -0,0 +1,131 @@
+#include "pqiopool.hh"
+#include "compiler.hh"
+#include "pqmemory.hh"
+#include "pqtrace.hh"
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+namespace pq {
+
+IOPool::IOPool(int nthreads)
+    : stopping_(false), wake_pending_(false), noutstanding_(0) {
+    int fds[2];
+    int r = pipe(fds);
+    mandatory_assert(r == 0 && "Could not create I/O pool pipe.");
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    wakerfd_ = tamer::fd(fds[0]);
+    wakewfd_ = fds[1];
+
+    if (nthreads < 1)
+        nthreads = 1;
+    Trace::add_threads(nthreads);
+    for (int i = 0; i < nthreads; ++i)
+        threads_.push_back(std::thread(&IOPool::worker, this));
+    drain();
+}
+
+IOPool::~IOPool() {
+    shutdown();
+}
+
+void IOPool::shutdown() {
+    if (threads_.empty())
+        return;
+    {
+        std::unique_lock<std::mutex> guard(lock_);
+        stopping_ = true;
+    }
+    cond_.notify_all();
+    for (auto& t : threads_)
+        t.join();
+    threads_.clear();
+
+    // jobs that never ran are dropped along with their events
+    for (auto j : pending_)
+        delete j;
+    for (auto j : finished_)
+        delete j;
+    pending_.clear();
+    finished_.clear();
+
+    drkill_();
+    wakerfd_.close();
+    close(wakewfd_);
+}
+
+void IOPool::submit(job* j) {
+    ++noutstanding_;
+    {
+        std::unique_lock<std::mutex> guard(lock_);
+        pending_.push_back(j);
+    }
+    cond_.notify_one();
+}
+
+void IOPool::worker() {
+    set_offloop_thread();
+    std::unique_lock<std::mutex> guard(lock_);
+    while (true) {
+        while (pending_.empty() && !stopping_)
+            cond_.wait(guard);
+        if (stopping_)
+            break;
+
+        job* j = pending_.front();
+        pending_.pop_front();
+        guard.unlock();
+        j->run();
+        guard.lock();
+
+        finished_.push_back(j);
+        if (!wake_pending_) {
+            // one byte per batch of completions is enough to wake the loop
+            wake_pending_ = true;
+            char c = 0;
+            ssize_t w;
+            do {
+                w = write(wakewfd_, &c, 1);
+            } while (w == -1 && errno == EINTR);
+        }
+    }
+}
+
+void IOPool::take_finished(std::deque<job*>& out) {
+    char buf[64];
+    while (read(wakerfd_.value(), buf, sizeof(buf)) > 0)
+        /* do nothing */;
+
+    std::unique_lock<std::mutex> guard(lock_);
+    out.swap(finished_);
+    wake_pending_ = false;
+}
+
+tamed void IOPool::drain() {
+    // NB The drain coroutine may outlive the pool; it checks `kill` after
+    // every wakeup, like msgpack_fd::reader_coroutine.
+    tvars {
+        tamer::event<> kill;
+        tamer::rendezvous<> rendez;
+        std::deque<job*> ready;
+    }
+
+    kill = drkill_ = tamer::make_event(rendez);
+
+    while (kill) {
+        twait { tamer::at_fd_read(wakerfd_.value(), make_event()); }
+        if (!kill)
+            break;
+
+        take_finished(ready);
+        noutstanding_ -= ready.size();
+        for (auto j : ready) {
+            j->complete();
+            delete j;
+        }
+        ready.clear();
+    }
+}
+
+}
@@ -32,12 +32,96 @@ Pattern::Pattern() {
 }
 
 void Pattern::clear() {
-    klen_ = plen_ = 0;
+    klen_ = plen_ = nrun_ = nlit_ = nslotrun_ = 0;
     memset(pat_, 0, sizeof(pat_));
+    memset(lit_, 0, sizeof(lit_));
+    memset(litpos_, 0, sizeof(litpos_));
     for (int i = 0; i != slot_capacity; ++i)
         slotlen_[i] = slotpos_[i] = 0;
 }
 
+void Pattern::compile() {
+    int pos = 0;
+    nrun_ = nlit_ = nslotrun_ = 0;
+    for (const uint8_t* p = pat_; p != pat_ + plen_; ++p)
+        if (*p < 128) {
+            if (nrun_ == 0 || run_[nrun_ - 1].slot != literal)
+                run_[nrun_++] = run{uint8_t(pos), 0, literal, nlit_};
+            lit_[nlit_] = *p;
+            litpos_[nlit_] = pos;
+            ++nlit_, ++pos;
+            ++run_[nrun_ - 1].len;
+        } else {
+            int slot = *p - 128;
+            run_[nrun_++] = run{uint8_t(pos), slotlen_[slot], uint8_t(slot), 0};
+            slotrun_[nslotrun_++] = run_[nrun_ - 1];
+            pos += slotlen_[slot];
+        }
+    assert(pos == klen_);
+}
+
+/** Return the literal byte at key position @a pos, or -1 if @a pos is
+    part of a slot. */
+int Pattern::literal_at(int pos) const {
+    for (const run* r = run_; r != run_ + nrun_; ++r)
+        if (pos < r->pos + r->len)
+            return r->slot == literal ? lit_[r->lit + pos - r->pos] : -1;
+    return -1;
+}
+
+bool Pattern::match_prefix(Str s, Match& m) const {
+    const uint8_t* ss = s.udata(), *ess = s.udata() + s.length();
+    for (const uint8_t* p = pat_; p != pat_ + plen_ && ss != ess; ++p)
+	if (*p < 128) {
+	    if (*ss != *p)
+		return false;
+	    ++ss;
+	} else {
+	    int slotlen = m.known_length(*p - 128);
+	    if (slotlen) {
+		if (slotlen > ess - ss)
+		    slotlen = ess - ss;
+		if (memcmp(ss, m.data(*p - 128), slotlen) != 0)
+		    return false;
+	    }
+	    if (slotlen < slotlen_[*p - 128] && slotlen < ess - ss) {
+		slotlen = slotlen_[*p - 128];
+		if (slotlen > ess - ss)
+		    slotlen = ess - ss;
+		m.set_slot(*p - 128, ss, slotlen);
+	    }
+	    ss += slotlen;
+	}
+    return true;
+}
+
+PatternFilter::PatternFilter(const Pattern& pat, const Match& m)
+    : klen_(pat.key_length()), nrepeat_(0) {
+    memset(mask_, 0, sizeof(mask_));
+    memset(value_, 0, sizeof(value_));
+    int first[slot_capacity];
+    for (int s = 0; s != slot_capacity; ++s)
+        first[s] = -1;
+    for (const Pattern::run* r = pat.run_; r != pat.run_ + pat.nrun_; ++r) {
+        if (r->slot == Pattern::literal) {
+            memcpy(value_ + r->pos, pat.lit_ + r->lit, r->len);
+            memset(mask_ + r->pos, 0xFF, r->len);
+            continue;
+        }
+        int len = std::min(m.known_length(r->slot), int(r->len));
+        if (len) {
+            memcpy(value_ + r->pos, m.data(r->slot), len);
+            memset(mask_ + r->pos, 0xFF, len);
+        }
+        if (len == r->len)
+            continue;
+        if (first[r->slot] < 0)
+            first[r->slot] = r->pos;
+        else
+            repeat_[nrepeat_++] = repeat{r->pos, uint8_t(first[r->slot]), r->len};
+    }
+}
+
 void Pattern::match_range(RangeMatch& rm) const {
     const uint8_t* fs = rm.first.udata(), *ls = rm.last.udata();
     const uint8_t* efs = fs + std::min(rm.first.length(), rm.last.length());
@@ -88,14 +172,15 @@ void Pattern::match_range(RangeMatch& rm) const {
 
 int Pattern::expand(uint8_t* s, const Match& m) const {
     uint8_t* first = s;
-    for (const uint8_t* p = pat_; p != pat_ + plen_; ++p)
-        if (*p < 128) {
-            *s = *p;
-            ++s;
+    for (const run* r = run_; r != run_ + nrun_; ++r)
+        if (r->slot == literal) {
+            copy_key_bytes(s, lit_ + r->lit, r->len);
+            s += r->len;
         } else {
-            memcpy(s, m.data(*p - 128), m.known_length(*p - 128));
-            s += m.known_length(*p - 128);
-            if (m.known_length(*p - 128) != slotlen_[*p - 128])
+            int len = m.known_length(r->slot);
+            copy_key_bytes(s, m.data(r->slot), len);
+            s += len;
+            if (len != r->len)
                 break;
         }
     return s - first;
@@ -151,6 +236,8 @@ void Join::clear() {
     }
     jvt_ = 0;
     maintained_ = true;
+    deferred_ = adaptive_ = ordered_ = false;
+    memset(nsink_copy_, 0, sizeof(nsink_copy_));
     filters_ = 0;
     lazy_ = 0;
 }
@@ -179,12 +266,12 @@ int Join::expand_first(uint8_t* buf, const Pattern& pat,
             sink_first = sink_first.prefix(sp);
     }
 
-    for (const uint8_t* ps = pat.pat_; ps != pat.pat_ + pat.plen_; ++ps)
-        if (*ps < 128) {
-            *os = *ps;
-            ++os;
+    for (const Pattern::run* r = pat.run_; r != pat.run_ + pat.nrun_; ++r)
+        if (r->slot == Pattern::literal) {
+            copy_key_bytes(os, pat.lit_ + r->lit, r->len);
+            os += r->len;
         } else {
-            int slot = *ps - 128;
+            int slot = r->slot;
 
             // search for slot values in match and range
             int matchlen = rm.match.known_length(slot);
@@ -249,12 +336,12 @@ int Join::expand_last(uint8_t* buf, const Pattern& pat,
             sink_last = sink_last.prefix(sp);
     }
 
-    for (const uint8_t* ps = pat.pat_; ps != pat.pat_ + pat.plen_; ++ps)
-        if (*ps < 128) {
-            *os = *ps;
-            ++os;
+    for (const Pattern::run* r = pat.run_; r != pat.run_ + pat.nrun_; ++r)
+        if (r->slot == Pattern::literal) {
+            copy_key_bytes(os, pat.lit_ + r->lit, r->len);
+            os += r->len;
         } else {
-            int slot = *ps - 128;
+            int slot = r->slot;
 
             // search for slot in match and range
             int matchlen = rm.match.known_length(slot);
@@ -388,6 +475,8 @@ int Join::parse_slot_name(Str word, ErrorHandler* errh) {
     }
     if (name == nameend && nc == -1)
         return errh->error("syntax error in slot in %<%p{Str}%>", &word);
+    else if ((type & stype_type_mask) == stype_binary_number && nc > 8)
+        return errh->error("binary number slot %<%p{Str}%> is longer than 8 bytes", &word);
     else if (s != word.end())
         return errh->error("name of slot should contain only letters and underscores in %<%p{Str}%>", &word);
 
@@ -505,6 +594,10 @@ int Join::hard_assign_parse(Str str, ErrorHandler* errh) {
             maintained_ = false;
         else if (words[i] == "push")
             maintained_ = true;
+        else if (words[i] == "defer")
+            maintained_ = deferred_ = true;
+        else if (words[i] == "adaptive")
+            maintained_ = adaptive_ = true;
         else if (words[i] == "and")
             /* do nothing */;
         else if (words[i] == "eager" || words[i] == "lazy") {
@@ -599,6 +692,9 @@ int Join::hard_assign_parse(Str str, ErrorHandler* errh) {
 }
 
 int Join::analyze(ErrorHandler* errh) {
+    for (int p = 0; p != npat_; ++p)
+        pat_[p].compile();
+
     // check that sink() is not used as a source
     for (int p = 1; p != npat_; ++p)
         if (pat_[p].table_name() == pat_[0].table_name())
@@ -659,20 +755,76 @@ int Join::analyze(ErrorHandler* errh) {
             memset(sk, 'X', slotlen_[*p - 128]);
             sk += slotlen_[*p - 128];
         }
+    compile_sink_copies();
+
+    // a single source is ordered like the sink if the sink's slots lead
+    // the source's, in the same order, and no output row is filtered out
+    ordered_ = npat_ == 2 && jvt_ < jvt_bounded_copy_last
+        && sink().nslotrun_ <= back_source().nslotrun_;
+    for (int i = 0; ordered_ && i != sink().nslotrun_; ++i)
+        ordered_ = sink().slotrun_[i].slot == back_source().slotrun_[i].slot;
 
     // success
     return 0;
 }
 
+void Join::compile_sink_copies() {
+    const Pattern& sinkpat = sink();
+    const Pattern& srcpat = back_source();
+    unsigned copyable = pat_mask_[0] & pat_mask_[npat_ - 1];
+
+    for (unsigned known = 0; known != (1 << slot_capacity); ++known) {
+        copy_op* c = sink_copy_[known];
+        int n = 0;
+        for (int i = 0; i != sinkpat.nrun_; ++i) {
+            const Pattern::run& r = sinkpat.run_[i];
+            if (r.slot == Pattern::literal || !(copyable & ~known & (1 << r.slot)))
+                continue;
+            int dst = r.pos, src = srcpat.slot_position(r.slot);
+            if (n) {
+                // extend the previous copy over a gap of equal literals
+                copy_op& prev = c[n - 1];
+                int dend = prev.dst + prev.len, send = prev.src + prev.len;
+                int gap = dst - dend;
+                bool extend = gap >= 0 && src - send == gap;
+                for (int x = 0; extend && x != gap; ++x) {
+                    int ch = sinkpat.literal_at(dend + x);
+                    extend = ch >= 0 && ch == srcpat.literal_at(send + x);
+                }
+                if (extend) {
+                    prev.len = dst + r.len - prev.dst;
+                    continue;
+                }
+            }
+            assert(n < Pattern::pcap);
+            c[n] = copy_op{uint8_t(dst), uint8_t(src), r.len};
+            ++n;
+        }
+        nsink_copy_[known] = n;
+    }
+}
+
 bool Join::assign_parse(Str str, ErrorHandler* errh) {
     return hard_assign_parse(str, errh) >= 0;
 }
 
+Json Join::unparse_slot(int slot, Str data) const {
+    // binary number slots are big-endian integers
+    if ((slottype_[slot] & stype_type_mask) == stype_binary_number
+        && data.length() <= 8) {
+        uint64_t x = 0;
+        for (int i = 0; i != data.length(); ++i)
+            x = (x << 8) | data.udata()[i];
+        return Json(x);
+    } else
+        return Json(data);
+}
+
 Json Join::unparse_context(Str context) const {
     Json j;
     const uint8_t* ends = context.udata() + context.length();
     for (const uint8_t* s = context.udata(); s != ends; ) {
-        j.set(slotname_[*s], Str(s + 1, slotlen_[*s]));
+        j.set(slotname_[*s], unparse_slot(*s, Str(s + 1, slotlen_[*s])));
         s += slotlen_[*s] + 1;
     }
     return j;
@@ -682,7 +834,7 @@ Json Join::unparse_match(const Match& m) const {
     Json j;
     for (int s = 0; s != slot_capacity; ++s)
         if (m.has_slot(s))
-            j.set(slotname_[s], m.slot(s));
+            j.set(slotname_[s], unparse_slot(s, m.slot(s)));
     return j;
 }
 
@@ -1,6 +1,9 @@
 #ifndef PEQUOD_PQJOIN_HH
 #define PEQUOD_PQJOIN_HH 1
 #include <stdint.h>
+#if __SSE2__
+#include <emmintrin.h>
+#endif
 #include "pqbase.hh"
 #include "str.hh"
 #include "local_str.hh"
@@ -20,6 +23,28 @@ class Table;
 enum { slot_capacity = 5 };
 enum { source_capacity = 4 };
 
+// Copy a slot or literal run. These are short and of varying length, so
+// two overlapping word moves beat a call to memcpy.
+inline void copy_key_bytes(uint8_t* dst, const uint8_t* src, int len) {
+    if (len >= 8 && len <= 16) {
+        uint64_t a, b;
+        memcpy(&a, src, 8);
+        memcpy(&b, src + len - 8, 8);
+        memcpy(dst, &a, 8);
+        memcpy(dst + len - 8, &b, 8);
+    } else if (len >= 4 && len < 8) {
+        uint32_t a, b;
+        memcpy(&a, src, 4);
+        memcpy(&b, src + len - 4, 4);
+        memcpy(dst, &a, 4);
+        memcpy(dst + len - 4, &b, 4);
+    } else if (len < 4) {
+        for (int i = 0; i != len; ++i)
+            dst[i] = src[i];
+    } else
+        memcpy(dst, src, len);
+}
+
 class Match {
   public:
     class state {
@@ -73,6 +98,7 @@ class Pattern {
 
     inline bool match(Str str) const;
     inline bool match(Str str, Match& m) const;
+    inline void assign_match(Str str, Match& m) const;
     void match_range(RangeMatch& rm) const;
 
     int expand(uint8_t* s, const Match& m) const;
@@ -95,7 +121,60 @@ class Pattern {
     uint8_t slotlen_[slot_capacity];
     uint8_t slotpos_[slot_capacity];
 
+    // pat_ compiled into runs at fixed key positions: each run is a
+    // literal string, stored in lit_, or a single slot.
+    enum { literal = 255 };
+    struct run {
+        uint8_t pos;
+        uint8_t len;
+        uint8_t slot;
+        uint8_t lit;
+    };
+    uint8_t nrun_;
+    uint8_t nlit_;
+    uint8_t nslotrun_;
+    run run_[pcap];
+    run slotrun_[pcap];
+    uint8_t lit_[pcap];
+    uint8_t litpos_[pcap];
+
+    void compile();
+    int literal_at(int pos) const;
+    inline bool match_literals(const uint8_t* s) const;
+    bool match_prefix(Str str, Match& m) const;
+
     friend class Join;
+    friend class PatternFilter;
+};
+
+// A pattern's literal bytes and the bytes of slots known in a Match, laid
+// out by key position. Source scans use it to reject keys a block at a
+// time before extracting slots. Later runs of a slot the Match does not
+// know are compared with its first run, as Pattern::match would.
+class PatternFilter {
+  public:
+    PatternFilter(const Pattern& pat, const Match& m);
+
+    inline bool match(Str key) const;
+
+  private:
+    enum { block = 16 };
+    struct repeat {
+        uint8_t pos;
+        uint8_t first;
+        uint8_t len;
+    };
+    int klen_;
+    int nrepeat_;
+    uint8_t value_[key_capacity];
+    uint8_t mask_[key_capacity];
+    repeat repeat_[Pattern::pcap];
+
+    inline bool match_bytes(const uint8_t* s) const;
+    static inline bool match_block(const uint8_t* s, const uint8_t* v,
+                                   const uint8_t* m);
+    static inline bool match_word(const uint8_t* s, const uint8_t* v,
+                                  const uint8_t* m);
 };
 
 // every type >=jvt_min_last is aggregation.
@@ -157,6 +236,9 @@ class Join {
     String expand_last(const Pattern& pat, const RangeMatch& rm) const;
 
     inline bool maintained() const;
+    inline bool deferred() const;
+    inline bool adaptive() const;
+    inline bool ordered() const;
     inline uint64_t staleness() const;
     void set_staleness(double sec);
     inline JoinValueType jvt() const;
@@ -181,6 +263,11 @@ class Join {
     uint64_t staleness_;  // validated ranges can be used in this time window.
                         // staleness_ > 0 implies maintained_ == false
     bool maintained_;   // if the output is kept up to date with changes to the input
+    bool deferred_;     // maintained, but changes are logged at the sink and
+                        // applied when it is next read
+    bool adaptive_;     // maintained, but each sink chooses between pushed and
+                        // deferred changes from its own reads and writes
+    bool ordered_;      // one source whose key order is the sink's key order
     uint8_t filters_;
     uint8_t lazy_;
     uint8_t slotlen_[slot_capacity];
@@ -191,6 +278,18 @@ class Join {
     uint8_t context_length_[1 << slot_capacity];
     mutable LocalStr<24> sink_key_;
 
+    // Copies from a back_source() key into sink_key_, one list per mask
+    // of sink slots already known. Slots adjacent in both keys, and
+    // separated by the same literals, share one copy. A slot repeated in
+    // the sink needs a copy per run, so lists hold up to one per run.
+    struct copy_op {
+        uint8_t dst;
+        uint8_t src;
+        uint8_t len;
+    };
+    copy_op sink_copy_[1 << slot_capacity][Pattern::pcap];
+    uint8_t nsink_copy_[1 << slot_capacity];
+
     enum {
         stype_unknown = 0, stype_text = 1, stype_decimal = 2,
         stype_binary_number = 3, stype_type_mask = 3,
@@ -202,10 +301,12 @@ class Join {
     int jvt_;
     Json jvtparam_;
 
+    Json unparse_slot(int slot, Str data) const;
     int parse_slot_name(Str word, ErrorHandler* errh);
     int parse_slot_names(Str word, String& out, ErrorHandler* errh);
     int hard_assign_parse(Str str, ErrorHandler* errh);
     int analyze(ErrorHandler* errh);
+    void compile_sink_copies();
 };
 
 
@@ -293,43 +394,98 @@ inline int Pattern::slot_position(int slot) const {
     return slotpos_[slot];
 }
 
-inline bool Pattern::match(Str str) const {
-    if (str.length() != key_length())
-	return false;
-    const uint8_t* ss = str.udata(), *ess = str.udata() + str.length();
-    for (const uint8_t* p = pat_; p != pat_ + plen_ && ss != ess; ++p)
-	if (*p < 128) {
-	    if (*ss != *p)
-		return false;
-	    ++ss;
-	} else
-	    ss += slotlen_[*p - 128];
+/** @brief Check the literal bytes of a key of length key_length(). */
+inline bool Pattern::match_literals(const uint8_t* s) const {
+    for (int i = 0; i != nlit_; ++i)
+        if (s[litpos_[i]] != lit_[i])
+            return false;
     return true;
 }
 
+inline bool Pattern::match(Str str) const {
+    return str.length() == key_length() && match_literals(str.udata());
+}
+
+/** @brief Match @a s, a key or key prefix, and fill unknown slots of @a m.
+
+    If the match fails, slots in @a m may or may not have been set. */
 inline bool Pattern::match(Str s, Match& m) const {
-    const uint8_t* ss = s.udata(), *ess = s.udata() + s.length();
-    for (const uint8_t* p = pat_; p != pat_ + plen_ && ss != ess; ++p)
-	if (*p < 128) {
-	    if (*ss != *p)
-		return false;
-	    ++ss;
-	} else {
-	    int slotlen = m.known_length(*p - 128);
-	    if (slotlen) {
-		if (slotlen > ess - ss)
-		    slotlen = ess - ss;
-		if (memcmp(ss, m.data(*p - 128), slotlen) != 0)
-		    return false;
-	    }
-	    if (slotlen < slotlen_[*p - 128] && slotlen < ess - ss) {
-		slotlen = slotlen_[*p - 128];
-		if (slotlen > ess - ss)
-		    slotlen = ess - ss;
-		m.set_slot(*p - 128, ss, slotlen);
-	    }
-	    ss += slotlen;
-	}
+    if (s.length() != key_length())
+        return match_prefix(s, m);
+    // every run lies at a fixed position in a full-length key
+    const uint8_t* ss = s.udata();
+    if (!match_literals(ss))
+        return false;
+    for (const run* r = slotrun_; r != slotrun_ + nslotrun_; ++r) {
+        int slotlen = m.known_length(r->slot);
+        if (slotlen && memcmp(ss + r->pos, m.data(r->slot), slotlen) != 0)
+            return false;
+        if (slotlen < r->len)
+            m.set_slot(r->slot, ss + r->pos, r->len);
+    }
+    return true;
+}
+
+/** @brief Fill the unknown slots of @a m from @a str.
+
+    @a str must be a full-length key known to match, for instance by a
+    PatternFilter built from @a m. */
+inline void Pattern::assign_match(Str str, Match& m) const {
+    for (const run* r = slotrun_; r != slotrun_ + nslotrun_; ++r)
+        if (m.known_length(r->slot) < r->len)
+            m.set_slot(r->slot, str.udata() + r->pos, r->len);
+}
+
+inline bool PatternFilter::match_word(const uint8_t* s, const uint8_t* v,
+                                      const uint8_t* m) {
+    uint64_t sw, vw, mw;
+    memcpy(&sw, s, 8);
+    memcpy(&vw, v, 8);
+    memcpy(&mw, m, 8);
+    return ((sw ^ vw) & mw) == 0;
+}
+
+inline bool PatternFilter::match_block(const uint8_t* s, const uint8_t* v,
+                                       const uint8_t* m) {
+#if __SSE2__
+    __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*) s),
+                              _mm_loadu_si128((const __m128i*) v));
+    x = _mm_and_si128(x, _mm_loadu_si128((const __m128i*) m));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) == 0xFFFF;
+#else
+    return match_word(s, v, m) && match_word(s + 8, v + 8, m + 8);
+#endif
+}
+
+// Keys at least a block long are checked in blocks, the last of which
+// may overlap its predecessor.
+inline bool PatternFilter::match_bytes(const uint8_t* s) const {
+    if (klen_ >= block) {
+        int pos = 0;
+        for (; pos + block < klen_; pos += block)
+            if (!match_block(s + pos, value_ + pos, mask_ + pos))
+                return false;
+        pos = klen_ - block;
+        return match_block(s + pos, value_ + pos, mask_ + pos);
+    } else if (klen_ >= 8)
+        return match_word(s, value_, mask_)
+            && match_word(s + klen_ - 8, value_ + klen_ - 8, mask_ + klen_ - 8);
+    else {
+        for (int i = 0; i != klen_; ++i)
+            if ((s[i] ^ value_[i]) & mask_[i])
+                return false;
+        return true;
+    }
+}
+
+/** @brief Test whether @a key has the pattern's length, literals, and
+    known slot bytes, and equal bytes wherever an unknown slot repeats. */
+inline bool PatternFilter::match(Str key) const {
+    if (key.length() != klen_ || !match_bytes(key.udata()))
+        return false;
+    for (const repeat* r = repeat_; r != repeat_ + nrepeat_; ++r)
+        if (memcmp(key.udata() + r->pos, key.udata() + r->first, r->len) != 0)
+            return false;
     return true;
 }
 
@@ -340,7 +496,8 @@ inline void Pattern::assign_optimized_match(Str str, int mopt, Match& m) const {
 }
 
 inline Join::Join()
-    : npat_(0), staleness_(0), maintained_(true), filters_(0), lazy_(0), 
+    : npat_(0), staleness_(0), maintained_(true), deferred_(false),
+      adaptive_(false), ordered_(false), filters_(0), lazy_(0), 
       refcount_(0), jvt_(jvt_copy_last), jvtparam_() {
 }
 
@@ -374,6 +531,23 @@ inline bool Join::maintained() const {
     return maintained_;
 }
 
+inline bool Join::deferred() const {
+    return maintained_ && deferred_;
+}
+
+inline bool Join::adaptive() const {
+    return maintained_ && adaptive_;
+}
+
+/** @brief Test whether sink keys sort in the order of their source keys.
+
+    True for single-source joins that output one row per source key, or
+    per run of adjacent source keys, so that a prefix or suffix of the
+    source computes a prefix or suffix of the sink. */
+inline bool Join::ordered() const {
+    return ordered_;
+}
+
 inline uint64_t Join::staleness() const {
     return staleness_;
 }
@@ -481,12 +655,11 @@ inline void Join::expand_sink_key_context(Str context) const {
 }
 
 inline void Join::expand_sink_key_source(Str source_key, unsigned mask) const {
-    mask = pat_mask_[0] & pat_mask_[npat_ - 1] & ~mask;
-    for (int s = 0; mask; mask >>= 1, ++s)
-        if (mask & 1)
-            memcpy(sink_key_.mutable_data() + pat_[0].slot_position(s),
-                   source_key.data() + pat_[npat_ - 1].slot_position(s),
-                   slotlen_[s]);
+    mask &= (1 << slot_capacity) - 1;
+    const copy_op* c = sink_copy_[mask];
+    for (const copy_op* ec = c + nsink_copy_[mask]; c != ec; ++c)
+        copy_key_bytes(sink_key_.mutable_udata() + c->dst,
+                       source_key.udata() + c->src, c->len);
 }
 
 inline Str Join::sink_key() const {
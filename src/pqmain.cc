@@ -8,6 +8,7 @@
 #include "pqpersistent.hh"
 #include "pqdbpool.hh"
 #include "pqclient.hh"
+#include "pqinterconnect.hh"
 #include "twitter.hh"
 #include "twitternew.hh"
 #include "hackernews.hh"
@@ -17,6 +18,10 @@
 #include "hashtableadapter.hh"
 #include <boost/random/random_number_generator.hpp>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 #include <set>
 
 static Clp_Option options[] = {
@@ -41,6 +46,7 @@ static Clp_Option options[] = {
     { "round-robin", 0, 2008, Clp_ValInt, 0 },
     { "block-report", 0, 2009, Clp_ValInt, 0 },
     { "rand-cache", 0, 2010, 0, Clp_Negate },
+    { "shards", 0, 2011, Clp_ValInt, 0 },
 
 
     // params that are generally useful to multiple apps
@@ -89,6 +95,25 @@ static Clp_Option options[] = {
     { "kvsdb",   0, 3039, 0, Clp_Negate },
     { "leveldb", 0, 3040, 0, Clp_Negate },
     { "rocksdb", 0, 3041, 0, Clp_Negate },
+    { "db-iothreads", 0, 3042, Clp_ValInt, 0 },
+    { "wb-size", 0, 3043, Clp_ValInt, 0 },
+    { "wb-delay", 0, 3044, Clp_ValInt, 0 },
+    { "durability", 0, 3045, Clp_ValStringNotOption, 0 },
+    { "db-scan-batch", 0, 3046, Clp_ValInt, 0 },
+    { "evict-policy", 0, 3047, Clp_ValStringNotOption, 0 },
+    { "evict-samples", 0, 3048, Clp_ValInt, 0 },
+    { "evict-slice", 0, 3049, Clp_ValInt, 0 },
+    { "evict-chunk", 0, 3050, Clp_ValInt, 0 },
+    { "table-quota", 0, 3051, Clp_ValString, 0 },
+    { "defer-max", 0, 3052, Clp_ValInt, 0 },
+    { "adaptive", 0, 3053, 0, Clp_Negate },
+    { "adaptive-writes", 0, 3054, Clp_ValInt, 0 },
+    { "notify-batch", 0, 3055, Clp_ValInt, 0 },
+    { "notify-delay", 0, 3056, Clp_ValDouble, 0 },
+    { "binary-interconnect", 0, 3057, 0, Clp_Negate },
+    { "interconnect-lz4", 0, 3058, Clp_ValInt, 0 },
+    { "rebalance", 0, 3059, Clp_ValDouble, 0 },
+    { "rebalance-slack", 0, 3060, Clp_ValDouble, 0 },
 
     // mostly twitter params
     { "shape", 0, 4000, Clp_ValDouble, 0 },
@@ -131,8 +156,58 @@ static Clp_Option options[] = {
 enum { mode_unknown, mode_twitter, mode_twitternew, mode_hn, mode_listen, mode_tests };
 enum { db_unknown, db_postgres, db_dummy, db_kvsdb, db_leveldb, db_rocksdb };
 
+// Fork `nshards` server processes, each pinned to its own core and joined
+// to every other shard by a socketpair. Returns the shard index in each
+// child, with peerfds[i] the descriptor leading to shard i. The parent
+// waits for all the shards and exits.
+static int fork_shards(int nshards, std::vector<int>& peerfds) {
+    std::vector<std::vector<int> > fds(nshards, std::vector<int>(nshards, -1));
+    for (int i = 0; i < nshards; ++i)
+        for (int j = i + 1; j < nshards; ++j) {
+            int sv[2];
+            int r = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+            mandatory_assert(r == 0 && "Could not create shard socketpair.");
+            fds[i][j] = sv[0];
+            fds[j][i] = sv[1];
+        }
+
+    for (int s = 0; s < nshards; ++s) {
+        pid_t p = fork();
+        mandatory_assert(p >= 0 && "Could not fork shard.");
+        if (p != 0)
+            continue;
+
+#ifdef __linux__
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(s % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+            perror("sched_setaffinity");
+#endif
+        for (int i = 0; i < nshards; ++i)
+            for (int j = 0; j < nshards; ++j)
+                if (fds[i][j] >= 0 && i != s)
+                    close(fds[i][j]);
+        for (int j = 0; j < nshards; ++j)
+            if (fds[s][j] >= 0)
+                fcntl(fds[s][j], F_SETFL, fcntl(fds[s][j], F_GETFL) | O_NONBLOCK);
+        peerfds = fds[s];
+        return s;
+    }
+
+    for (int i = 0; i < nshards; ++i)
+        for (int j = 0; j < nshards; ++j)
+            if (fds[i][j] >= 0)
+                close(fds[i][j]);
+
+    int status, ret = 0;
+    while (wait(&status) > 0)
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+            ret = 1;
+    exit(ret);
+}
+
 int main(int argc, char** argv) {
-    tamer::initialize();
 
     int mode = mode_unknown, db = db_unknown;
     int listen_port = 8000, client_port = -1, nbacking = 0;
@@ -140,10 +215,20 @@ int main(int argc, char** argv) {
     String hostfile, dbhostfile, partfunc;
     pq::DBPoolParams db_param;
     bool monitordb = false;
+    int db_iothreads = 4;
+    uint32_t wb_size = 64, wb_delay = 1000;
+    int durability = pq::durability_sync;
+    uint32_t db_scan_batch = 4096;
     uint64_t mem_hi_mb = 0, mem_lo_mb = 0;
     uint32_t round_robin = 0;
+    int nshards = 1, shard = -1;
+    std::vector<int> shardfds;
     bool evict_inline = false, evict_periodic = false; 
-    bool evict_rand = false, evict_tomb = true, evict_multi = true, evict_pref_sink = false;
+    bool evict_tomb = true, evict_multi = true, evict_pref_sink = false;
+    int evict_policy = pq::Server::evict_lru;
+    uint32_t evict_samples = 5;
+    uint32_t evict_slice = 1000, evict_chunk = 1024;
+    Json table_quotas = Json::make_object();
     Clp_Parser* clp = Clp_NewParser(argc, argv, sizeof(options) / sizeof(options[0]), options);
     Json tp_param = Json().set("nusers", 5000);
     int32_t block_report = 0;
@@ -191,12 +276,16 @@ int main(int argc, char** argv) {
             block_report = clp->val.i;
         else if (clp->option->long_name == String("rand-cache"))
             tp_param.set("rand_cache", !clp->negated);
+        else if (clp->option->long_name == String("shards"))
+            nshards = clp->val.i;
 
         // general
         else if (clp->option->long_name == String("push"))
 	    tp_param.set("push", !clp->negated);
         else if (clp->option->long_name == String("pull"))
             tp_param.set("pull", !clp->negated);
+        else if (clp->option->long_name == String("adaptive"))
+            tp_param.set("adaptive", !clp->negated);
         else if (clp->option->long_name == String("duration"))
             tp_param.set("duration", clp->val.i);
 	    else if (clp->option->long_name == String("nusers"))
@@ -255,6 +344,24 @@ int main(int argc, char** argv) {
             db = db_leveldb;
         else if (clp->option->long_name == String("rocksdb"))
             db = db_rocksdb;
+        else if (clp->option->long_name == String("db-iothreads"))
+            db_iothreads = clp->val.i;
+        else if (clp->option->long_name == String("wb-size"))
+            wb_size = clp->val.i;
+        else if (clp->option->long_name == String("wb-delay"))
+            wb_delay = clp->val.i;
+        else if (clp->option->long_name == String("durability")) {
+            if (strcmp(clp->vstr, "none") == 0)
+                durability = pq::durability_none;
+            else if (strcmp(clp->vstr, "batch") == 0)
+                durability = pq::durability_batch;
+            else if (strcmp(clp->vstr, "sync") == 0)
+                durability = pq::durability_sync;
+            else
+                mandatory_assert(false && "Unknown durability level.");
+        }
+        else if (clp->option->long_name == String("db-scan-batch"))
+            db_scan_batch = clp->val.i;
 
         else if (clp->option->long_name == String("mem-lo"))
             mem_lo_mb = clp->val.i;
@@ -267,7 +374,49 @@ int main(int argc, char** argv) {
         else if (clp->option->long_name == String("evict-tomb"))
             evict_tomb = !clp->negated;
         else if (clp->option->long_name == String("evict-rand"))
-            evict_rand = !clp->negated;
+            evict_policy = clp->negated ? pq::Server::evict_lru : pq::Server::evict_random;
+        else if (clp->option->long_name == String("evict-policy")) {
+            if (strcmp(clp->vstr, "lru") == 0)
+                evict_policy = pq::Server::evict_lru;
+            else if (strcmp(clp->vstr, "random") == 0)
+                evict_policy = pq::Server::evict_random;
+            else if (strcmp(clp->vstr, "sample-lru") == 0)
+                evict_policy = pq::Server::evict_sample_lru;
+            else if (strcmp(clp->vstr, "sample-lfu") == 0)
+                evict_policy = pq::Server::evict_sample_lfu;
+            else if (strcmp(clp->vstr, "greedy-dual") == 0)
+                evict_policy = pq::Server::evict_greedy_dual;
+            else
+                mandatory_assert(false && "Unknown eviction policy.");
+        }
+        else if (clp->option->long_name == String("evict-samples"))
+            evict_samples = clp->val.i;
+        else if (clp->option->long_name == String("evict-slice"))
+            evict_slice = clp->val.i;
+        else if (clp->option->long_name == String("evict-chunk"))
+            evict_chunk = clp->val.i;
+        else if (clp->option->long_name == String("table-quota")) {
+            // NAME=MB, e.g. --table-quota t=512
+            const char* eq = strchr(clp->vstr, '=');
+            mandatory_assert(eq && eq != clp->vstr, "Table quota must be NAME=MB.");
+            table_quotas.set(String(clp->vstr, eq), strtoull(eq + 1, nullptr, 10));
+        }
+        else if (clp->option->long_name == String("defer-max"))
+            pq::Sink::deferred_max = clp->val.i;
+        else if (clp->option->long_name == String("adaptive-writes"))
+            pq::Sink::adaptive_writes = clp->val.i;
+        else if (clp->option->long_name == String("notify-batch"))
+            pq::Interconnect::notify_batch_bytes = clp->val.i;
+        else if (clp->option->long_name == String("notify-delay"))
+            pq::Interconnect::notify_batch_delay = clp->val.d;
+        else if (clp->option->long_name == String("binary-interconnect"))
+            pq::Interconnect::binary_frames = !clp->negated;
+        else if (clp->option->long_name == String("interconnect-lz4"))
+            pq::Interconnect::frame_compress_min = clp->val.i;
+        else if (clp->option->long_name == String("rebalance"))
+            pq::Server::rebalance_interval = clp->val.d;
+        else if (clp->option->long_name == String("rebalance-slack"))
+            pq::Server::rebalance_slack = clp->val.d;
         else if (clp->option->long_name == String("evict-multi"))
             evict_multi = !clp->negated;
         else if (clp->option->long_name == String("evict-pref-sink"))
@@ -358,10 +507,26 @@ int main(int argc, char** argv) {
             testcases.insert(clp->vstr);
     }
 
+    // shards are separate processes, so fork before tamer or any store
+    // (and its I/O threads) exists
+    if (nshards > 1) {
+        mandatory_assert(mode == mode_listen && !hostfile
+                         && "Shards are only supported by a single listening server.");
+        mandatory_assert((db == db_unknown || db == db_postgres)
+                         && "Embedded stores cannot be shared between shards.");
+        mandatory_assert(partfunc && "Need to specify a partition function!");
+        shard = fork_shards(nshards, shardfds);
+        mem_lo_mb /= nshards;
+        mem_hi_mb /= nshards;
+    }
+
+    tamer::initialize();
+
     pq::Server server;
+    server.set_eviction_slicing(evict_slice, evict_chunk);
     const pq::Hosts* hosts = nullptr;
     const pq::Hosts* dbhosts = nullptr;
-    const pq::Partitioner* part = nullptr;
+    pq::Partitioner* part = nullptr;
 
     if (db != db_unknown) {
         pq::PersistentStore* pstore = nullptr;
@@ -377,7 +542,8 @@ int main(int argc, char** argv) {
         }
         else if (db == db_kvsdb) {
 #if HAVE_LIBKVSDB
-            pq::KVSDBStore* kvsdb = new pq::KVSDBStore();
+            // twitternew keys are binary unless --no-binary
+            pq::KVSDBStore* kvsdb = new pq::KVSDBStore(tp_param["binary"].as_b(true));
             pstore = kvsdb;
 #else
             mandatory_assert(false && "Not configured for KVSDB");
@@ -385,7 +551,7 @@ int main(int argc, char** argv) {
         }
         else if (db == db_leveldb) {
 #if HAVE_LIBLEVELDB
-            pq::LevelDBStore* leveldb = new pq::LevelDBStore();
+            pq::LevelDBStore* leveldb = new pq::LevelDBStore(db_iothreads);
             pstore = leveldb;
 #else
             mandatory_assert(false && "Not configured for LevelDB");
@@ -393,7 +559,7 @@ int main(int argc, char** argv) {
         }
         else if (db == db_rocksdb) {
 #if HAVE_LIBROCKSDB
-            pq::RocksDBStore* rocksdb = new pq::RocksDBStore();
+            pq::RocksDBStore* rocksdb = new pq::RocksDBStore(db_iothreads);
             pstore = rocksdb;
 #else
             mandatory_assert(false && "Not configured for RocksDB");
@@ -403,6 +569,9 @@ int main(int argc, char** argv) {
             mandatory_assert(false && "Unknown DB type.");
 
         server.set_persistent_store(pstore, !monitordb);
+        server.set_persisted_batch_size(db_scan_batch);
+        if (!monitordb)
+            server.set_write_behind(wb_size, wb_delay, durability);
         if (monitordb)
             pstore->run_monitor(server);
     }
@@ -422,7 +591,13 @@ int main(int argc, char** argv) {
     } 
     else if (mode == mode_listen) {
         const pq::Host* me = nullptr;
-        if (hosts) {
+        if (shard >= 0) {
+            char hostname[100];
+            gethostname(hostname, sizeof(hostname));
+            hosts = pq::Hosts::make_local(hostname, listen_port, nshards);
+            me = hosts->get_by_seqid(shard);
+            part = pq::Partitioner::make(partfunc, nbacking, hosts->count(), -1);
+        } else if (hosts) {
             mandatory_assert(partfunc && "Need to specify a partition function!");
             part = pq::Partitioner::make(partfunc, nbacking, hosts->count(), -1);
             char hostname[100];
@@ -431,14 +606,24 @@ int main(int argc, char** argv) {
         }
 
         server.set_eviction_details(mem_lo_mb, mem_hi_mb,
-                                        evict_tomb, evict_rand, evict_multi, evict_pref_sink,
-                                        evict_inline, evict_periodic);
+                                        evict_tomb, evict_policy, evict_samples,
+                                        evict_multi, evict_pref_sink,
+                                        evict_inline, evict_periodic,
+                                        table_quotas);
 
         extern void server_loop(pq::Server& server, int port, bool kill,
                                 const pq::Hosts* hosts, const pq::Host* me,
-                                const pq::Partitioner* part, uint32_t round_robin);
-        server_loop(server, listen_port, kill_old_server,
-                    hosts, me, part, round_robin);
+                                pq::Partitioner* part, uint32_t round_robin);
+        extern void shard_server_loop(pq::Server& server, int port,
+                                      const pq::Hosts* hosts, const pq::Host* me,
+                                      pq::Partitioner* part,
+                                      const std::vector<int>& peerfds,
+                                      uint32_t round_robin);
+        if (shard >= 0)
+            shard_server_loop(server, me->port(), hosts, me, part, shardfds, round_robin);
+        else
+            server_loop(server, listen_port, kill_old_server,
+                        hosts, me, part, round_robin);
     } 
     else if (mode == mode_twitter) {
         if (!tp_param.count("shape"))
@@ -463,8 +648,10 @@ int main(int argc, char** argv) {
             run_twitter_remote(*tp, client_port, hosts, dbhosts, part);
         } else {
             server.set_eviction_details(mem_lo_mb, mem_hi_mb,
-                                        evict_tomb, evict_rand, evict_multi, evict_pref_sink,
-                                        evict_inline, evict_periodic);
+                                        evict_tomb, evict_policy, evict_samples,
+                                        evict_multi, evict_pref_sink,
+                                        evict_inline, evict_periodic,
+                                        table_quotas);
             run_twitter_local(*tp, server);
         }
     } else if (mode == mode_twitternew || mode == mode_unknown) {
@@ -490,8 +677,10 @@ int main(int argc, char** argv) {
         }
         else {
             server.set_eviction_details(mem_lo_mb, mem_hi_mb,
-                                        evict_tomb, evict_rand, evict_multi, evict_pref_sink,
-                                        evict_inline, evict_periodic);
+                                        evict_tomb, evict_policy, evict_samples,
+                                        evict_multi, evict_pref_sink,
+                                        evict_inline, evict_periodic,
+                                        table_quotas);
             run_twitter_new_local(*tp, server);
         }
 
@@ -524,8 +713,10 @@ int main(int argc, char** argv) {
     	    }
     	    else {
                 server.set_eviction_details(mem_lo_mb, mem_hi_mb,
-                                        evict_tomb, evict_rand, evict_multi, evict_pref_sink,
-                                        evict_inline, evict_periodic);
+                                        evict_tomb, evict_policy, evict_samples,
+                                        evict_multi, evict_pref_sink,
+                                        evict_inline, evict_periodic,
+                                        table_quotas);
                 run_hn_local(*hp, server);
             }
         }
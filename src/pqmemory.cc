@@ -6,12 +6,21 @@ namespace pq {
 uint64_t mem_overhead_size = 0;
 uint64_t mem_other_size = 0;
 uint64_t mem_store_size = 0;
+std::atomic<int64_t> mem_offloop_size(0);
 
 namespace {
 struct meminfo {
     uint64_t* type;
     size_t sz;
 };
+
+// marks blocks allocated off the loop thread
+uint64_t offloop_type;
+thread_local bool offloop_thread = false;
+}
+
+void set_offloop_thread() {
+    offloop_thread = true;
 }
 
 void* allocate(size_t sz, uint64_t* type) {
@@ -24,8 +33,13 @@ void* allocate(size_t sz, uint64_t* type) {
     meminfo* mi;
     if (xsz < sz || !(mi = (meminfo*)malloc(xsz)))
 	return NULL;
-    mi->type = type;
     mi->sz = sz;
+    if (unlikely(offloop_thread)) {
+        mi->type = &offloop_type;
+        mem_offloop_size.fetch_add(xsz, std::memory_order_relaxed);
+        return (void *) (mi + 1);
+    }
+    mi->type = type;
     mem_overhead_size += xsz - sz;
     if (type)
         *type += sz;
@@ -43,6 +57,14 @@ void deallocate(void* p) {
     }
 
     meminfo* mi = (meminfo*)p - 1;
+    if (unlikely(offloop_thread || mi->type == &offloop_type)) {
+        // a loop-thread block freed off the loop leaves its own counters
+        // high; the shared total stays right
+        mem_offloop_size.fetch_sub(mi->sz + sizeof(meminfo),
+                                   std::memory_order_relaxed);
+        free(mi);
+        return;
+    }
     mem_overhead_size -= sizeof(meminfo);
     if (mi->type)
         *(mi->type) -= mi->sz;
@@ -51,6 +73,49 @@ void deallocate(void* p) {
     free(mi);
 }
 
+
+namespace {
+void* slab_buffer_allocate(size_t sz) {
+    void* p = malloc(sz);
+    mandatory_assert(p);
+    if (enable_memory_tracking)
+        mem_overhead_size += sz;
+    return p;
+}
+
+void slab_buffer_deallocate(void* p, size_t sz) {
+    if (enable_memory_tracking)
+        mem_overhead_size -= sz;
+    free(p);
+}
+}
+
+SlabPool* SlabPool::all_;
+
+SlabPool::SlabPool(const char* name, uint64_t* counter)
+    : name_(name), counter_(counter), live_objects_(0), live_bytes_(0),
+      next_(all_) {
+    for (size_t c = 0; c != nclasses; ++c)
+        classes_[c] = nullptr;
+    all_ = this;
+}
+
+HashAllocator* SlabPool::make_class(size_t c) {
+    assert(c < nclasses && !classes_[c]);
+    classes_[c] = new HashAllocator((c + 1) * granularity,
+                                    slab_buffer_allocate,
+                                    slab_buffer_deallocate);
+    return classes_[c];
+}
+
+const SlabPool* SlabPool::all() {
+    return all_;
+}
+
+SlabPool datum_pool("datum", &mem_other_size);
+SlabPool range_pool("range", &mem_other_size);
+SlabPool source_pool("source", &mem_other_size);
+
 } // namepace pq
 
 void* operator new(size_t size) {
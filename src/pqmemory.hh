@@ -2,7 +2,9 @@
 #define PQ_MEMORY_HH_ 1
 
 #include "compiler.hh"
+#include "hashallocator.hh"
 #include <memory>
+#include <atomic>
 #include <cstddef>
 
 void* operator new(size_t, int64_t* type);
@@ -66,12 +68,124 @@ extern uint64_t mem_overhead_size;
 extern uint64_t mem_other_size;
 extern uint64_t mem_store_size;
 
+// The counters above belong to the loop thread. Threads that call
+// set_offloop_thread(), like I/O pool workers and the database libraries
+// they run, charge every allocation and free, header included, to
+// mem_offloop_size instead; so does the loop thread when it frees their
+// blocks.
+extern std::atomic<int64_t> mem_offloop_size;
+void set_offloop_thread();
+
+// memory that eviction works against
+inline uint64_t mem_other_total() {
+    int64_t total = int64_t(mem_other_size)
+        + mem_offloop_size.load(std::memory_order_relaxed);
+    return total > 0 ? total : 0;
+}
+
+
+// Size-class slab pool for small, numerous server objects. Pooled objects
+// carry no meminfo header: the pool charges live bytes to its counter on
+// allocate and deallocate, and unused slab space to mem_overhead_size.
+// Objects larger than the biggest class fall back to pq::allocate. Like
+// the rest of the server, pools are not thread-safe.
+class SlabPool {
+  public:
+    SlabPool(const char* name, uint64_t* counter);
+
+    inline void* allocate(size_t sz);
+    inline void deallocate(void* p, size_t sz);
+
+    inline const char* name() const;
+    inline uint64_t live_objects() const;
+    inline uint64_t live_bytes() const;
+    inline const SlabPool* next() const;
+
+    static const SlabPool* all();
+
+  private:
+    enum { granularity = 16, nclasses = 32 };
+
+    const char* name_;
+    uint64_t* counter_;
+    uint64_t live_objects_;
+    uint64_t live_bytes_;
+    HashAllocator* classes_[nclasses];
+    SlabPool* next_;
+
+    static SlabPool* all_;
+
+    inline size_t class_of(size_t sz) const;
+    HashAllocator* make_class(size_t c);
+};
+
+extern SlabPool datum_pool;
+extern SlabPool range_pool;
+extern SlabPool source_pool;
+
 template <class T>
 struct heap_type {
     typedef pq::Allocator<T, &mem_store_size> store;
 };
 
 
+inline size_t SlabPool::class_of(size_t sz) const {
+    return (sz + granularity - 1) / granularity - 1;
+}
+
+inline void* SlabPool::allocate(size_t sz) {
+    size_t c = class_of(sz);
+    if (unlikely(!sz || c >= nclasses))
+        return pq::allocate(sz, counter_);
+
+    HashAllocator* a = classes_[c];
+    if (unlikely(!a))
+        a = make_class(c);
+    void* p = a->allocate();
+    if (enable_memory_tracking) {
+        size_t csz = (c + 1) * granularity;
+        mem_overhead_size -= csz;
+        *counter_ += csz;
+        ++live_objects_;
+        live_bytes_ += csz;
+    }
+    return p;
+}
+
+inline void SlabPool::deallocate(void* p, size_t sz) {
+    size_t c = class_of(sz);
+    if (unlikely(!sz || c >= nclasses)) {
+        pq::deallocate(p);
+        return;
+    }
+
+    classes_[c]->deallocate(p);
+    if (enable_memory_tracking) {
+        size_t csz = (c + 1) * granularity;
+        mem_overhead_size += csz;
+        *counter_ -= csz;
+        --live_objects_;
+        live_bytes_ -= csz;
+    }
+}
+
+inline const char* SlabPool::name() const {
+    return name_;
+}
+
+inline uint64_t SlabPool::live_objects() const {
+    return live_objects_;
+}
+
+inline uint64_t SlabPool::live_bytes() const {
+    return live_bytes_;
+}
+
+inline const SlabPool* SlabPool::next() const {
+    return next_;
+}
+
+
 // report rusage ru_maxrss in megabytes
 inline uint32_t maxrss_mb(int32_t rss) {
 #ifdef __APPLE__
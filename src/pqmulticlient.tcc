@@ -6,7 +6,8 @@ namespace pq {
 MultiClient::MultiClient(const Hosts* hosts, const Partitioner* part, int colocateCacheServer)
     : hosts_(hosts), part_(part), localNode_(nullptr),
       colocateCacheServer_(colocateCacheServer),
-      dbhosts_(nullptr), dbparams_(nullptr), rand_cache_(false) {
+      dbhosts_(nullptr), dbparams_(nullptr), rand_cache_(false),
+      batch_(default_batch) {
     gen_.seed(112181);
 }
 
@@ -14,7 +15,8 @@ MultiClient::MultiClient(const Hosts* hosts, const Partitioner* part, int coloca
                          const Hosts* dbhosts, const DBPoolParams* dbparams)
     : hosts_(hosts), part_(part), localNode_(nullptr),
       colocateCacheServer_(colocateCacheServer),
-      dbhosts_(dbhosts), dbparams_(dbparams), rand_cache_(false) {
+      dbhosts_(dbhosts), dbparams_(dbparams), rand_cache_(false),
+      batch_(default_batch) {
     gen_.seed(112181);
 }
 
@@ -36,6 +38,7 @@ tamed void MultiClient::connect(tamer::event<> done) {
         twait { tamer::tcp_connect(in_addr{htonl(INADDR_LOOPBACK)},
                                    colocateCacheServer_, make_event(fd)); }
         localNode_ = new RemoteClient(fd, "local");
+        localNode_->set_batch(batch_);
     }
     else {
         for (i = 0; i < hosts_->size(); ++i) {
@@ -50,6 +53,7 @@ tamed void MultiClient::connect(tamer::event<> done) {
             }
 
             clients_.push_back(new RemoteClient(fd, String(i)));
+            clients_.back()->set_batch(batch_);
         }
 
         if (colocateCacheServer_ >= 0) {
@@ -176,6 +180,11 @@ tamed void MultiClient::scan(const String& first, const String& last,
     cache_for(first, rand_cache_)->scan(first, last, scanlast, e);
 }
 
+tamed void MultiClient::scan(const String& first, const String& last,
+                             const Json& options, event<scan_result> e) {
+    cache_for(first, rand_cache_)->scan(first, last, options, e);
+}
+
 tamed void MultiClient::stats(event<Json> e) {
     tvars {
         Json j;
@@ -1,6 +1,8 @@
 #include "pqpersistent.hh"
 #include "pqserver.hh"
+#include "pqtrace.hh"
 #include <iostream>
+#include <memory>
 #include <assert.h>
 
 #if HAVE_LIBKVSDB
@@ -13,6 +15,7 @@
 #include "leveldb/db.h"
 #include "leveldb/options.h"
 #include "leveldb/cache.h"
+#include "leveldb/write_batch.h"
 #endif
 
 #if HAVE_LIBROCKSDB
@@ -20,43 +23,155 @@
 #include "rocksdb/options.h"
 #include "rocksdb/cache.h"
 #include "rocksdb/table.h"
+#include "rocksdb/write_batch.h"
 #endif
 
 namespace pq {
 
-static void* Complex2Simple(void* key, size_t len, size_t* len_simple) {
-    char* ptr = (char*)key;
-    char type = ptr[0];
-    if (type != 's' && type != 'p') return NULL;
+tamed void PersistentStore::write(WriteOps ops, tamer::event<> done) {
+    tvars {
+        tamer::gather_rendezvous gr;
+    }
 
-    char userid_char[9]; userid_char[8] = 0;
-    memcpy(userid_char, ptr+2, 8);
-    uint32_t userid_int = atoi(userid_char);
-    
-    if (type == 'p')
-        userid_int = userid_int | Prefix_P;
-    
-    char* newkey = (char*)malloc(len-6);
-    memcpy(newkey, &userid_int, 4);
-    memcpy(newkey+4, ptr+10, len-10);
-    *len_simple = len-6;
-    return newkey;
+    for (auto& op : ops)
+        if (op.erase)
+            erase(op.key, gr.make_event());
+        else
+            put(op.key, op.value, gr.make_event());
+    twait(gr);
+    done();
 }
 
-static void* Simple2Complex(void* key, size_t len, size_t* len_complex) {
-    size_t newkey_len = len + 6;
-    char* newkey = (char*)malloc(newkey_len);
-    char* ptr = (char*)key;
-    uint32_t target = *(uint32_t*)key;
-    
-    if (target & Prefix_P)
-        sprintf(newkey, "p|%08d", target & 0x7FFFFFFF);
-    else 
-        sprintf(newkey, "s|%08d", target & 0x7FFFFFFF); 
-       
-    memcpy(newkey+10, ptr+4, len-4);
-    *len_complex = newkey_len;
-    return newkey;
+void PersistentStore::scan_batch(Str first, Str last, uint32_t,
+                                 tamer::event<ResultSet> done) {
+    scan(first, last, done);
+}
+
+WriteBehind::WriteBehind(PersistentStore* store, uint32_t flush_size,
+                         uint32_t flush_delay, int durability)
+    : store_(store), flush_size_(flush_size ? flush_size : 1),
+      flush_delay_(flush_delay), durability_(durability), oldest_(0),
+      index_(-1), force_(false), writing_(false), timer_scheduled_(false),
+      nops_(0), nbatches_(0), ncoalesced_(0) {
+}
+
+WriteBehind::~WriteBehind() {
+    if (!ops_.empty())
+        std::cerr << "write-behind: dropping " << ops_.size()
+                  << " unwritten ops\n";
+    timerkill_();
+}
+
+void WriteBehind::put(Str key, Str value, tamer::event<> done) {
+    add(PersistentStore::WriteOp{key, value, false}, std::move(done));
+}
+
+void WriteBehind::erase(Str key, tamer::event<> done) {
+    add(PersistentStore::WriteOp{key, String(), true}, std::move(done));
+}
+
+void WriteBehind::add(PersistentStore::WriteOp op, tamer::event<> done) {
+    if (ops_.empty())
+        oldest_ = tstamp();
+    // the store may apply a batch's ops in any order, so a batch holds
+    // only the latest op for each key
+    int& pos = index_[op.key];
+    if (pos >= 0) {
+        ops_[pos] = std::move(op);
+        ++ncoalesced_;
+    } else {
+        pos = ops_.size();
+        ops_.push_back(std::move(op));
+    }
+    ++nops_;
+
+    if (durability_ == durability_none)
+        done();
+    else
+        waiters_.push_back(std::move(done));
+    if (durability_ == durability_sync)
+        force_ = true;
+
+    if (ops_.size() >= flush_size_)
+        maybe_flush();
+    else
+        schedule();
+}
+
+void WriteBehind::flush(tamer::event<> done) {
+    if (ops_.empty() && !writing_)
+        done();
+    else {
+        drained_.push_back(std::move(done));
+        force_ = true;
+        schedule();
+    }
+}
+
+void WriteBehind::schedule() {
+    if (timer_scheduled_ || writing_ || ops_.empty())
+        return;
+    uint64_t age = tstamp() - oldest_;
+    flush_timer(force_ || age >= flush_delay_ ? 0 : flush_delay_ - age);
+}
+
+tamed void WriteBehind::flush_timer(uint32_t delay) {
+    // NB may outlive the log, like RemoteClient::batch_timer
+    tvars {
+        tamer::event<> kill;
+        tamer::rendezvous<> rendez;
+    }
+
+    kill = timerkill_ = tamer::make_event(rendez);
+    timer_scheduled_ = true;
+    twait {
+        if (delay)
+            tamer::at_delay_usec(delay, make_event());
+        else
+            tamer::at_asap(make_event());
+    }
+    if (kill) {
+        timer_scheduled_ = false;
+        maybe_flush();
+        schedule();
+        kill();
+    }
+}
+
+tamed void WriteBehind::write_batch() {
+    tvars {
+        PersistentStore::WriteOps ops;
+        std::vector<tamer::event<> > waiters;
+        std::vector<tamer::event<> > drained;
+    }
+
+    ops.swap(ops_);
+    index_.clear();
+    waiters.swap(waiters_);
+    force_ = false;
+    writing_ = true;
+    ++nbatches_;
+
+    twait { store_->write(std::move(ops), make_event()); }
+
+    writing_ = false;
+    for (auto& w : waiters)
+        w();
+    if (ops_.empty()) {
+        drained.swap(drained_);
+        for (auto& d : drained)
+            d();
+    } else {
+        maybe_flush();
+        schedule();
+    }
+}
+
+Json WriteBehind::stats() const {
+    return Json().set("write_behind_ops", nops_)
+        .set("write_behind_batches", nbatches_)
+        .set("write_behind_coalesced", ncoalesced_)
+        .set("write_behind_buffered", ops_.size());
 }
 
 #if HAVE_LIBKVSDB
@@ -75,17 +190,22 @@ int PQ_Classify(void* key, size_t len) {
 #endif
 }
 
-KVSDBStore::KVSDBStore() {
+// AG_* calls are not known to be thread-safe, so KVSDB gets one I/O thread.
+KVSDBStore::KVSDBStore(bool binary_keys)
+    : io_(1), codec_(binary_keys) {
     Kvsdb_create(&kvsdb, (char*)"KVSDBStore", 10);
     handler = AG_Init(kvsdb, PQ_Classify);
 
 #if AGGREGATION_ON == 1
+    // key suffixes after the user id: "|<time>" for posts, "|<poster>"
+    // for subscriptions
+    int psuffix = binary_keys ? 5 : 11, ssuffix = binary_keys ? 5 : 9;
     for (int i=0; i<NUM_USERS; i++) {
-        int num = AG_Create(handler, i, 4, 11, 2);
+        int num = AG_Create(handler, i, 4, psuffix, 2);
         printf("AG_Create : P, %d th AG with id %d\n", num, i);        
     }
     for (int i=0; i<NUM_USERS; i++) {
-        int num = AG_Create(handler, i+NUM_USERS, 4, 9, 2);
+        int num = AG_Create(handler, i+NUM_USERS, 4, ssuffix, 2);
         printf("AG_Create : S, %d th AG with id %d\n", num, i);        
     } 
 #endif
@@ -94,111 +214,179 @@ KVSDBStore::KVSDBStore() {
 }
 
 KVSDBStore::~KVSDBStore() {
+    io_.shutdown();
     Kvsdb_close(kvsdb);
     std::cout << "[DB] KVSDBStore Destruction\n";
 }
 
-tamed void KVSDBStore::put(Str key, Str value, tamer::event<> done) {
-    tvars {
-        size_t key_len = 0;
-        char*  key_ptr = (char*)Complex2Simple((char*)key.data(), key.length(), &key_len);
-        char*  val_ptr = (char*)value.data();
-        size_t val_len = value.length();
-    }
-    assert(key_ptr);
-    
-    twait { AG_Put(handler, key_ptr, key_len, val_ptr, val_len); }
-        
-#if PrintLog == 1
-    std::cout << "[DB] PUT ";
-    key.PrintHex(); std::cout << " " << key.length() << " " << value.length() << '\n';
-    //fflush(stdout);
-#endif
-    done();
-    free(key_ptr);
+void KVSDBStore::put(Str key, Str value, tamer::event<> done) {
+    char kbuf[key_capacity];
+    mandatory_assert(key.length() <= key_capacity);
+    int klen = codec_.encode(key, kbuf);
+    assert(klen >= 0);
+    std::string k(kbuf, klen), v(value);
+    io_.run([this, k, v]() {
+            uint64_t t0 = Trace::start();
+            AG_Put(handler, (char*)k.data(), k.length(), (char*)v.data(), v.length());
+            Trace::record(trace_db_put, k.data(), k.length(), v.length(), t0);
+        }, done);
 }
 
 // @ Not called
-tamed void KVSDBStore::erase(Str key, tamer::event<> done) {
-    tvars {
-        size_t key_len = 0;
-        char*  key_ptr = (char*)Complex2Simple((char*)key.data(), key.length(), &key_len);
-    }
-    twait { Kvsdb_del(kvsdb, key_ptr, key_len); }
-    done();
-    free(key_ptr);
+void KVSDBStore::erase(Str key, tamer::event<> done) {
+    char kbuf[key_capacity];
+    mandatory_assert(key.length() <= key_capacity);
+    int klen = codec_.encode(key, kbuf);
+    assert(klen >= 0);
+    std::string k(kbuf, klen);
+    io_.run([this, k]() {
+            uint64_t t0 = Trace::start();
+            Kvsdb_del(kvsdb, (char*)k.data(), k.length());
+            Trace::record(trace_db_erase, k.data(), k.length(), 0, t0);
+        }, done);
 }
+
 // @ Not called
-tamed void KVSDBStore::get(Str key, tamer::event<String> done) {
-    tvars {
-        size_t key_len = 0;
-        char*  key_ptr = (char*)Complex2Simple((char*)key.data(), key.length(), &key_len);
-        char*  val_ptr = NULL;
-        size_t val_len = 0;
+void KVSDBStore::get(Str key, tamer::event<String> done) {
+    char kbuf[key_capacity];
+    mandatory_assert(key.length() <= key_capacity);
+    int klen = codec_.encode(key, kbuf);
+    assert(klen >= 0);
+    std::string k(kbuf, klen);
+    io_.call(std::function<String()>([this, k]() {
+            uint64_t t0 = Trace::start();
+            int val_len = 0;
+            char* val_ptr = (char*)AG_Get(handler, (char*)k.data(), (int)k.length(), &val_len);
+            Trace::record(trace_db_get, k.data(), k.length(), val_len, t0);
+            return val_ptr ? String(val_ptr, val_len) : String();
+        }), done);
+}
+
+void KVSDBStore::write(WriteOps ops, tamer::event<> done) {
+    // encode on the loop thread; one I/O job then issues every op
+    std::vector<std::pair<std::string, std::string> > kvs;
+    std::vector<bool> erases;
+    char kbuf[key_capacity];
+    kvs.reserve(ops.size());
+    for (auto& op : ops) {
+        mandatory_assert(op.key.length() <= key_capacity);
+        int klen = codec_.encode(op.key, kbuf);
+        assert(klen >= 0);
+        kvs.push_back(std::make_pair(std::string(kbuf, klen), std::string(op.value)));
+        erases.push_back(op.erase);
     }
-    
-    twait { val_ptr = (char*)AG_Get(handler, key_ptr, (int)key_len, (int*)&val_len); }
-    if (val_ptr)
-        done(String(val_ptr, val_len));
-    else
-        done("");
-    free(key_ptr);
+    io_.run([this, kvs, erases]() {
+            uint64_t t0 = Trace::start();
+            for (size_t i = 0; i != kvs.size(); ++i)
+                if (erases[i])
+                    Kvsdb_del(kvsdb, (char*)kvs[i].first.data(), kvs[i].first.length());
+                else
+                    AG_Put(handler, (char*)kvs[i].first.data(), kvs[i].first.length(),
+                           (char*)kvs[i].second.data(), kvs[i].second.length());
+            if (!kvs.empty())
+                Trace::record(trace_db_write, kvs[0].first.data(), kvs[0].first.length(),
+                              kvs.size(), t0);
+        }, done);
 }
 
 tamed void KVSDBStore::scan(Str first, Str last, tamer::event<ResultSet> done) {
     tvars {
-        char*  key_first_ptr = (char*)Complex2Simple((char*)first.data(), first.length(), &key_first_len);
-        char*  key_last_ptr  = (char*)Complex2Simple((char*)last.data(),  last.length(),  &key_last_len);
-        char*  key_ori       = NULL;
-        size_t key_first_len = 0;
-        size_t key_last_len  = 0;
-        size_t key_ori_len   = 0;
-    
-        ResultSet* rs = new ResultSet();        
-        std::string key, key_new, val;
-        std::vector<std::pair<std::string, std::string>>* result = NULL;
-        int count = 0;
-    }
-    assert(key_first_ptr);assert(key_last_ptr);
-
-#if PrintLog == 1
-    std::cout << "[DB] SCAN ";
-    first.PrintHex(); std::cout << " " << first.length() << " ";
-    last.PrintHex();  std::cout << " " <<  last.length() << " ";
-#endif
-
-    twait { 
-        result = (std::vector<std::pair<std::string, std::string>>*)\
-                AG_Scan(handler, key_first_ptr, key_first_len, key_last_ptr, key_last_len, key_first_ptr, 0, 4);    
-    }
-    assert(result != NULL);
-    
-    for (auto iter = result->begin(); iter != result->end(); iter++) {
-        key = iter->first;
-        val = iter->second;
-        key_ori = (char*)Simple2Complex((char*)key.c_str(), key.size(), &key_ori_len);
-        key_new = std::string(key_ori, key_ori_len);
-        free(key_ori); key_ori = NULL; key_ori_len = 0;
-
-        rs->emplace_back(Result(key_new, val));
-        count++;
+        ResultSet rs;
+        uint64_t t0 = Trace::start();
     }
-    free(key_first_ptr); free(key_last_ptr);
-    delete result;
 
-#if PrintLog == 1
-    std::cout << count << std::endl;
-    //fflush(stdout); 
-#endif
-    done(*rs);
+    twait { io_.call(scan_job(first, last), make_event(rs)); }
+
+    Trace::record(trace_db_scan, first, rs.size(), t0);
+    done(std::move(rs));
+}
+
+std::function<PersistentStore::ResultSet()> KVSDBStore::scan_job(Str first, Str last) {
+    char fbuf[key_capacity], lbuf[key_capacity];
+    mandatory_assert(first.length() <= key_capacity && last.length() <= key_capacity);
+    int flen = codec_.encode(first, fbuf), llen = codec_.encode(last, lbuf);
+    assert(flen >= 0 && llen >= 0);
+    std::string f(fbuf, flen), l(lbuf, llen);
+
+    return [this, f, l]() {
+        std::vector<std::pair<std::string, std::string>>* result =
+            (std::vector<std::pair<std::string, std::string>>*)
+            AG_Scan(handler, (char*)f.data(), f.length(), (char*)l.data(), l.length(),
+                    (char*)f.data(), 0, 4);
+        assert(result != NULL);
+
+        // decode straight into each result String's buffer
+        ResultSet rs;
+        rs.reserve(result->size());
+        for (auto iter = result->begin(); iter != result->end(); iter++) {
+            int len = iter->first.size();
+            String key = String::make_uninitialized(codec_.decoded_length(len));
+            codec_.decode(iter->first.data(), len, key.mutable_data());
+            rs.emplace_back(Result(std::move(key), String(iter->second)));
+        }
+        delete result;
+        return rs;
+    };
 }
     
 void KVSDBStore::flush() {return;}
 void KVSDBStore::run_monitor(Server& server) {return;}
 #endif
 
+#if HAVE_LIBLEVELDB || HAVE_LIBROCKSDB
+// LevelDB and RocksDB iterators share an interface, so both stores build
+// their scan jobs here. The job runs on an I/O thread and must not touch
+// anything owned by the tamer loop. It stops after `count` results and
+// the key that follows them.
+template <typename DB, typename ReadOptions>
+static std::function<PersistentStore::ResultSet()> iterator_scan_job(DB* db, Str first, Str last,
+                                                                    uint32_t count) {
+    std::string start(first), limit(last);
+
+    return [db, start, limit, count]() {
+        PersistentStore::ResultSet rs;
+        auto it = db->NewIterator(ReadOptions());
+        for (it->Seek(start); it->Valid(); it->Next()) {
+            std::string key = it->key().ToString();
+            if (key >= limit) break;
+            if (strncmp(key.c_str(), start.c_str(), 10) != 0) continue;
+            if (rs.size() == count) {
+                // the next batch starts here
+                rs.emplace_back(PersistentStore::Result(key, String()));
+                break;
+            }
+            rs.emplace_back(PersistentStore::Result(key, it->value().ToString()));
+        }
+        assert(it->status().ok());
+        delete it;
+        return rs;
+    };
+}
+
+// Build the WriteBatch on the loop thread: it holds its own copies of the
+// keys and values, so the job never touches pequod Strings.
+template <typename DB, typename Batch, typename Slice, typename WriteOptions>
+static std::function<void()> batch_write_job(DB* db, const PersistentStore::WriteOps& ops) {
+    std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+    std::string first = ops.empty() ? std::string() : std::string(ops[0].key);
+    size_t nops = ops.size();
+    for (auto& op : ops)
+        if (op.erase)
+            batch->Delete(Slice(op.key.data(), op.key.length()));
+        else
+            batch->Put(Slice(op.key.data(), op.key.length()),
+                       Slice(op.value.data(), op.value.length()));
+    return [db, batch, first, nops]() {
+        uint64_t t0 = Trace::start();
+        db->Write(WriteOptions(), batch.get());
+        Trace::record(trace_db_write, first.data(), first.length(), nops, t0);
+    };
+}
+#endif
+
 #if HAVE_LIBLEVELDB
-LevelDBStore::LevelDBStore() {
+LevelDBStore::LevelDBStore(int iothreads)
+    : io_(iothreads) {
     size_t megabyte   = 1024*1024;
     size_t cache_size = (size_t)470*megabyte;
     
@@ -214,72 +402,62 @@ LevelDBStore::LevelDBStore() {
 }
 
 LevelDBStore::~LevelDBStore() {
+    io_.shutdown();
     delete db;
 }
 
-tamed void LevelDBStore::put(Str key, Str value, tamer::event<> done){
-    tvars {
-        leveldb::Status status;
-    }
+void LevelDBStore::put(Str key, Str value, tamer::event<> done){
+    leveldb::DB* db = this->db;
+    std::string k(key), v(value);
+    io_.run([db, k, v]() {
+            uint64_t t0 = Trace::start();
+            db->Put(leveldb::WriteOptions(), k, v);
+            Trace::record(trace_db_put, k.data(), k.length(), v.length(), t0);
+        }, done);
+}
 
-#if PrintLog == 1
-    std::cout << " [DB] PUT ";
-    key.PrintHex(); std::cout << " " << key.length() << " " << value.length() << '\n';
-    //fflush(stdout);
-#endif
+void LevelDBStore::erase(Str key, tamer::event<> done){
+    leveldb::DB* db = this->db;
+    std::string k(key);
+    io_.run([db, k]() {
+            uint64_t t0 = Trace::start();
+            db->Delete(leveldb::WriteOptions(), k);
+            Trace::record(trace_db_erase, k.data(), k.length(), 0, t0);
+        }, done);
+}
 
-    twait { status = db->Put(leveldb::WriteOptions(), std::string(key), std::string(value)); }
-    done();
+void LevelDBStore::get(Str key, tamer::event<String> done){
+    leveldb::DB* db = this->db;
+    std::string k(key);
+    io_.call(std::function<String()>([db, k]() {
+            uint64_t t0 = Trace::start();
+            std::string value;
+            db->Get(leveldb::ReadOptions(), k, &value);
+            Trace::record(trace_db_get, k.data(), k.length(), value.length(), t0);
+            return String(value);
+        }), done);
 }
 
-tamed void LevelDBStore::erase(Str key, tamer::event<> done){
-    tvars {
-        leveldb::Status status;
-    }
-    twait { status = db->Delete(leveldb::WriteOptions(), std::string(key)); }
-    done();
+void LevelDBStore::scan(Str first, Str last, tamer::event<ResultSet> done){
+    scan_batch(first, last, uint32_t(-1), done);
 }
-tamed void LevelDBStore::get(Str key, tamer::event<String> done){
+
+tamed void LevelDBStore::scan_batch(Str first, Str last, uint32_t limit,
+                                    tamer::event<ResultSet> done){
     tvars {
-	    std::string value;
-        leveldb::Status status;
+        ResultSet rs;
+        uint64_t t0 = Trace::start();
     }
-    twait { status = db->Get(leveldb::ReadOptions(), std::string(key), &value); }
-    done(value);
-}
 
-tamed void LevelDBStore::scan(Str first, Str last, tamer::event<ResultSet> done){
-    tvars {  
-        leveldb::Iterator* it = db->NewIterator(leveldb::ReadOptions());
-        std::string start = std::string(first);
-        std::string limit = std::string(last);
-        ResultSet* rs = new ResultSet();
-        int count = 0;
-    }
-    
-#if PrintLog == 1  
-    std::cout <<" [DB] SCAN ";
-    first.PrintHex(); std::cout << " " << first.length() << " ";
-    last.PrintHex();  std::cout << " " <<  last.length() << " ";
-#endif
-    
-    twait {
-        for (it->Seek(start); it->Valid(); it->Next()) {
-            std::string key = it->key().ToString();
-            if (key >= limit) break;
-            if (strncmp(key.c_str(), start.c_str(), 10) != 0) continue;
-            rs->emplace_back(Result(key, it->value().ToString()));
-            count++;
-        }
-        assert(it->status().ok());
-        delete it;
-    }
+    twait { io_.call(iterator_scan_job<leveldb::DB, leveldb::ReadOptions>(db, first, last, limit), make_event(rs)); }
 
-#if PrintLog == 1
-    std::cout << count << std::endl;
-    //fflush(stdout);  
-#endif
-    done(*rs);
+    Trace::record(trace_db_scan, first, rs.size(), t0);
+    done(std::move(rs));
+}
+
+void LevelDBStore::write(WriteOps ops, tamer::event<> done) {
+    io_.run(batch_write_job<leveldb::DB, leveldb::WriteBatch, leveldb::Slice,
+                            leveldb::WriteOptions>(db, ops), done);
 }
 
 void LevelDBStore::flush() {return;}
@@ -381,7 +559,8 @@ void RocksDBStore::run_monitor(Server& server) {return;}
 
 #if HAVE_LIBROCKSDB
 
-RocksDBStore::RocksDBStore() {
+RocksDBStore::RocksDBStore(int iothreads)
+    : io_(iothreads) {
     size_t megabyte   = 1024*1024;
     size_t cache_size = (size_t)470*megabyte;
 
@@ -403,73 +582,63 @@ RocksDBStore::RocksDBStore() {
 }
 
 RocksDBStore::~RocksDBStore() {
+    io_.shutdown();
     delete db;
 }
 
-tamed void RocksDBStore::put(Str key, Str value, tamer::event<> done){
-    tvars {
-        rocksdb::Status status;
-    }
+void RocksDBStore::put(Str key, Str value, tamer::event<> done){
 
-#if PrintLog == 1
-    std::cout << " [DB] PUT ";
-    key.PrintHex(); std::cout << " " << key.length() << " " << value.length() << '\n';
-    //fflush(stdout);
-#endif
+    rocksdb::DB* db = this->db;
+    std::string k(key), v(value);
+    io_.run([db, k, v]() {
+            uint64_t t0 = Trace::start();
+            db->Put(rocksdb::WriteOptions(), k, v);
+            Trace::record(trace_db_put, k.data(), k.length(), v.length(), t0);
+        }, done);
+}
 
-    twait { status = db->Put(rocksdb::WriteOptions(), std::string(key), std::string(value)); }
-    done();
+void RocksDBStore::erase(Str key, tamer::event<> done){
+    rocksdb::DB* db = this->db;
+    std::string k(key);
+    io_.run([db, k]() {
+            uint64_t t0 = Trace::start();
+            db->Delete(rocksdb::WriteOptions(), k);
+            Trace::record(trace_db_erase, k.data(), k.length(), 0, t0);
+        }, done);
 }
 
-tamed void RocksDBStore::erase(Str key, tamer::event<> done){
-    tvars {
-        rocksdb::Status status;
-    }
-    twait { status = db->Delete(rocksdb::WriteOptions(), std::string(key)); }
-    done();
+void RocksDBStore::get(Str key, tamer::event<String> done){
+    rocksdb::DB* db = this->db;
+    std::string k(key);
+    io_.call(std::function<String()>([db, k]() {
+            uint64_t t0 = Trace::start();
+            std::string value;
+            db->Get(rocksdb::ReadOptions(), k, &value);
+            Trace::record(trace_db_get, k.data(), k.length(), value.length(), t0);
+            return String(value);
+        }), done);
 }
 
-tamed void RocksDBStore::get(Str key, tamer::event<String> done){ 
-    tvars {
-	    std::string value;
-        rocksdb::Status status;
-    }
-    twait { status = db->Get(rocksdb::ReadOptions(), std::string(key), &value); }
-    done(value);
+void RocksDBStore::scan(Str first, Str last, tamer::event<ResultSet> done){
+    scan_batch(first, last, uint32_t(-1), done);
 }
 
-tamed void RocksDBStore::scan(Str first, Str last, tamer::event<ResultSet> done){
-    tvars {    
-        rocksdb::Iterator* it = db->NewIterator(rocksdb::ReadOptions());
-        std::string start = std::string(first);
-        std::string limit = std::string(last);
-        ResultSet* rs = new ResultSet();
-        int count = 0;
+tamed void RocksDBStore::scan_batch(Str first, Str last, uint32_t limit,
+                                    tamer::event<ResultSet> done){
+    tvars {
+        ResultSet rs;
+        uint64_t t0 = Trace::start();
     }
 
-#if PrintLog == 1
-    std::cout << " [DB] SCAN ";
-    first.PrintHex(); std::cout << " " << first.length() << " ";
-    last.PrintHex();  std::cout << " " <<  last.length() << " ";
-#endif
-    
-    twait {
-        for (it->Seek(start); it->Valid(); it->Next()) {
-            std::string key = it->key().ToString();
-            if (key >= limit) break;
-            if (strncmp(key.c_str(), start.c_str(), 10) != 0) continue;
-            rs->push_back(Result(key, it->value().ToString()));
-            count++;
-        }
-        assert(it->status().ok());
-        delete it;
-    }
+    twait { io_.call(iterator_scan_job<rocksdb::DB, rocksdb::ReadOptions>(db, first, last, limit), make_event(rs)); }
 
-#if PrintLog == 1
-    std::cout << count << std::endl;    
-    //fflush(stdout);
-#endif
-    done(*rs);
+    Trace::record(trace_db_scan, first, rs.size(), t0);
+    done(std::move(rs));
+}
+
+void RocksDBStore::write(WriteOps ops, tamer::event<> done) {
+    io_.run(batch_write_job<rocksdb::DB, rocksdb::WriteBatch, rocksdb::Slice,
+                            rocksdb::WriteOptions>(db, ops), done);
 }
 
 void RocksDBStore::flush() {return;}
@@ -514,13 +683,11 @@ tamed void PostgresStore::put(Str key, Str value, tamer::event<> done) {
     tvars {
         String q = "EXECUTE kv_put('" + key + "','" + value + "')";
         Json j;
+        uint64_t t0 = Trace::start();
     }
 
     twait { pool_->execute(q, make_event(j)); }
-
-    std::cout << "[DB] PUT "; // DB log
-    key.PrintHex(); std::cout << " " << key.length() << " " << value.length() << '\n';
-    
+    Trace::record(trace_db_put, key, value.length(), t0);
     done();
 }
 
@@ -528,13 +695,11 @@ tamed void PostgresStore::erase(Str key, tamer::event<> done) {
     tvars {
         String q = "EXECUTE kv_erase('" + key + "')";
         Json j;
+        uint64_t t0 = Trace::start();
     }
 
     twait { pool_->execute(q, make_event(j)); }
-
-    std::cout << "[DB] ERASE "; // DB log
-    key.PrintHex(); std::cout << " " << key.length() << '\n';
-    
+    Trace::record(trace_db_erase, key, 0, t0);
     done();
 }
 
@@ -542,12 +707,11 @@ tamed void PostgresStore::get(Str key, tamer::event<String> done) {
     tvars {
         String q = "EXECUTE kv_get('" + key + "')";
         Json j;
+        uint64_t t0 = Trace::start();
     }
 
     twait { pool_->execute(q, make_event(j)); }
-
-    std::cout << "[DB] GET "; // DB log
-    key.PrintHex(); std::cout << " " << key.length() << '\n';
+    Trace::record(trace_db_get, key, 0, t0);
 
     if (j.is_a() && j.size() && j[0].size())
         done(j[0][0].as_s());
@@ -561,6 +725,7 @@ tamed void PostgresStore::scan(Str first, Str last, tamer::event<ResultSet> done
         String q = "EXECUTE kv_scan('" + first + "','" + last + "')";
         Json j;
         int count = 0;
+        uint64_t t0 = Trace::start();
     }
 
     twait { pool_->execute(q, make_event(j)); }
@@ -571,10 +736,7 @@ tamed void PostgresStore::scan(Str first, Str last, tamer::event<ResultSet> done
         count++;
     }
 
-    std::cout << "[DB] SCAN "; // DB log
-    first.PrintHex(); std::cout << " " << first.length() << " ";
-    last.PrintHex();  std::cout << " " <<  last.length() << " ";
-    std::cout << count << std::endl;  fflush(stdout);
+    Trace::record(trace_db_scan, first, count, t0);
 
     done.unblocker().trigger();
 }
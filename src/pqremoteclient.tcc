@@ -5,12 +5,11 @@ namespace pq {
 
 tamed void RemoteClient::add_join(const String& first, const String& last,
                                   const String& joinspec, event<Json> e) {
-    tvars { Json j, rj; unsigned long seq = this->seq_; }
+    tvars { Json j, rj; }
     rj.set("range", Json::array(first, last));
     twait {
-        fd_->call(Json::array(pq_add_join, seq_, first, last, joinspec),
-                  make_event(j));
-        ++seq_;
+        call(Json::array(pq_add_join, 0, first, last, joinspec),
+             make_event(j));
     }
     if (j[2].is_i() && j[2].as_i() == pq_ok)
         rj.set("ok", true);
@@ -20,41 +19,37 @@ tamed void RemoteClient::add_join(const String& first, const String& last,
 }
 
 tamed void RemoteClient::get(const String& key, event<String> e) {
-    tvars { Json j; unsigned long seq = this->seq_; }
+    tvars { Json j; }
     twait [twait_description("get", key)] {
-        fd_->call(Json::array(pq_get, seq_, key), make_event(j));
-        ++seq_;
+        call(Json::array(pq_get, 0, key), make_event(j));
     }
-    assert(j[0] == -pq_get && j[1] == seq);
+    assert(j[0] == -pq_get);
     e(j && j[2].to_i() == pq_ok ? j[3].to_s() : String());
 }
 
 tamed void RemoteClient::noop_get(const String& key, event<String> e) {
-    tvars { Json j; unsigned long seq = this->seq_; }
+    tvars { Json j; }
     twait [twait_description("noop_get", key)] {
-        fd_->call(Json::array(pq_noop_get, seq_, key), make_event(j));
-        ++seq_;
+        call(Json::array(pq_noop_get, 0, key), make_event(j));
     }
-    assert(j[0] == -pq_noop_get && j[1] == seq);
+    assert(j[0] == -pq_noop_get);
     e(j && j[2].to_i() == pq_ok ? j[3].to_s() : String());
 }
 
 tamed void RemoteClient::insert(const String& key, const String& value,
                                 event<> e) {
-    tvars { Json j; unsigned long seq = this->seq_; }
+    tvars { Json j; }
     twait [twait_description("insert", key)] {
-        fd_->call(Json::array(pq_insert, seq_, key, value), make_event(j));
-        ++seq_;
+        call(Json::array(pq_insert, 0, key, value), make_event(j));
     }
-    assert(j[0] == -pq_insert && j[1] == seq);
+    assert(j[0] == -pq_insert);
     e();
 }
 
 tamed void RemoteClient::erase(const String& key, event<> e) {
-    tvars { Json j; unsigned long seq = this->seq_; }
+    tvars { Json j; }
     twait [twait_description("erase", key)] {
-        fd_->call(Json::array(pq_erase, seq_, key), make_event(j));
-        ++seq_;
+        call(Json::array(pq_erase, 0, key), make_event(j));
     }
     e();
 }
@@ -74,34 +69,31 @@ tamed void RemoteClient::erase_db(const String& key, event<> e) {
 
 tamed void RemoteClient::count(const String& first, const String& last,
                                event<size_t> e) {
-    tvars { Json j; unsigned long seq = this->seq_; }
+    tvars { Json j; }
     twait [twait_description("count", first, last)] {
-        fd_->call(Json::array(pq_count, seq_, first, last), make_event(j));
-        ++seq_;
+        call(Json::array(pq_count, 0, first, last), make_event(j));
     }
-    assert(j[0] == -pq_count && j[1] == seq);
+    assert(j[0] == -pq_count);
     e(j && j[2].to_i() == pq_ok ? j[3].to_u64() : 0);
 }
 
 tamed void RemoteClient::count(const String& first, const String& last,
                                const String& scanlast, event<size_t> e) {
-    tvars { Json j; unsigned long seq = this->seq_; }
+    tvars { Json j; }
     twait [twait_description("count", first, last)] {
-        fd_->call(Json::array(pq_count, seq_, first, last, scanlast), make_event(j));
-        ++seq_;
+        call(Json::array(pq_count, 0, first, last, scanlast), make_event(j));
     }
-    assert(j[0] == -pq_count && j[1] == seq);
+    assert(j[0] == -pq_count);
     e(j && j[2].to_i() == pq_ok ? j[3].to_u64() : 0);
 }
 
 tamed void RemoteClient::add_count(const String& first, const String& last,
                                    event<size_t> e) {
-    tvars { Json j; unsigned long seq = this->seq_; }
+    tvars { Json j; }
     twait [twait_description("count", first, last)] {
-        fd_->call(Json::array(pq_count, seq_, first, last), make_event(j));
-        ++seq_;
+        call(Json::array(pq_count, 0, first, last), make_event(j));
     }
-    assert(j[0] == -pq_count && j[1] == seq);
+    assert(j[0] == -pq_count);
     if (e && j && j[2].to_i() == pq_ok)
         e(e.result() + j[3].to_u64());
     else
@@ -110,12 +102,11 @@ tamed void RemoteClient::add_count(const String& first, const String& last,
 
 tamed void RemoteClient::add_count(const String& first, const String& last,
                                    const String& scanlast, event<size_t> e) {
-    tvars { Json j; unsigned long seq = this->seq_; }
+    tvars { Json j; }
     twait [twait_description("count", first, last)] {
-        fd_->call(Json::array(pq_count, seq_, first, last, scanlast), make_event(j));
-        ++seq_;
+        call(Json::array(pq_count, 0, first, last, scanlast), make_event(j));
     }
-    assert(j[0] == -pq_count && j[1] == seq);
+    assert(j[0] == -pq_count);
     if (e && j && j[2].to_i() == pq_ok)
         e(e.result() + j[3].to_u64());
     else
@@ -126,8 +117,7 @@ tamed void RemoteClient::scan(const String& first, const String& last,
                               event<scan_result> e) {
     tvars { Json j; }
     twait [twait_description("scan", first, last)] {
-        fd_->call(Json::array(pq_scan, seq_, first, last), make_event(j));
-        ++seq_;
+        call(Json::array(pq_scan, 0, first, last), make_event(j));
     }
     e(scan_result(j && j[2].to_i() == pq_ok ? j[3] : Json::make_array()));
 }
@@ -136,29 +126,98 @@ tamed void RemoteClient::scan(const String& first, const String& last,
                               const String& scanlast, event<scan_result> e) {
     tvars { Json j; }
     twait [twait_description("scan", first, last)] {
-        fd_->call(Json::array(pq_scan, seq_, first, last, scanlast), make_event(j));
-        ++seq_;
+        call(Json::array(pq_scan, 0, first, last, scanlast), make_event(j));
     }
     e(scan_result(j && j[2].to_i() == pq_ok ? j[3] : Json::make_array()));
 }
 
+tamed void RemoteClient::scan(const String& first, const String& last,
+                              const Json& options, event<scan_result> e) {
+    tvars { Json j; }
+    twait [twait_description("scan", first, last)] {
+        call(Json::array(pq_scan, 0, first, last, Json(), options), make_event(j));
+    }
+    if (j && j[2].to_i() == pq_ok)
+        e(scan_result(Json(j[3]), j[4].is_s() ? j[4].as_s() : String()));
+    else
+        e(scan_result(Json::make_array()));
+}
+
 tamed void RemoteClient::stats(event<Json> e) {
-    tvars { Json j; unsigned long seq = this->seq_; }
+    tvars { Json j; }
     twait [twait_description("stats")] {
         assert(fd_->valid());
-        fd_->call(Json::array(pq_stats, seq_), make_event(j));
-        ++seq_;
+        call(Json::array(pq_stats, 0), make_event(j));
     }
 
     e(j && j[2].to_i() == pq_ok ? j[3] : Json::make_object());
 }
 
+void RemoteClient::call(Json req, event<Json> done) {
+    // req[1] is filled in here: a sequence number when sent alone, or the
+    // request's index in its batch
+    if (!batchmax_) {
+        req[1] = seq_;
+        fd_->call(req, std::move(done));
+        ++seq_;
+        return;
+    }
+
+    req[1] = batch_.size();
+    batch_.push_back(std::move(req));
+    batchwait_.push_back(std::move(done));
+    if (batch_.size() >= batchmax_)
+        flush_batch();
+    else if (!batch_scheduled_) {
+        batch_scheduled_ = true;
+        batch_timer();
+    }
+}
+
+void RemoteClient::flush_batch() {
+    if (batch_.empty())
+        return;
+    Json req = Json::array(pq_batch, seq_, std::move(batch_));
+    ++seq_;
+    batch_ = Json::make_array();
+    std::vector<event<Json> > waiters;
+    waiters.swap(batchwait_);
+    send_batch(std::move(req), std::move(waiters));
+}
+
+tamed void RemoteClient::batch_timer() {
+    // NB may outlive the client, like msgpack_fd::reader_coroutine
+    tvars {
+        tamer::event<> kill;
+        tamer::rendezvous<> rendez;
+    }
+
+    kill = batchkill_ = tamer::make_event(rendez);
+    twait { tamer::at_asap(make_event()); }
+    if (kill) {
+        batch_scheduled_ = false;
+        flush_batch();
+        kill();
+    }
+}
+
+tamed void RemoteClient::send_batch(Json req, std::vector<event<Json> > waiters) {
+    tvars { Json j; size_t i; }
+    twait [twait_description("batch")] {
+        fd_->call(req, make_event(j));
+    }
+    for (i = 0; i != waiters.size(); ++i)
+        if (j && j[2].to_i() == pq_ok && j.get(3).get(i).is_a())
+            waiters[i](j.get(3).get(i));
+        else
+            waiters[i](Json());
+}
+
 tamed void RemoteClient::control(const Json& cmd, event<Json> e) {
     tvars { Json j; }
     twait [twait_description("control")] {
         assert(fd_->valid());
-        fd_->call(Json::array(pq_control, seq_, cmd), make_event(j));
-        ++seq_;
+        call(Json::array(pq_control, 0, cmd), make_event(j));
     }
 
     assert(j && j[2].to_i() == pq_ok);
@@ -21,7 +21,24 @@ enum {
     pq_add_join = 11,
     pq_stats = 12,
     pq_control = 13,
-    pq_noop_get = 14
+    pq_noop_get = 14,
+
+    // [pq_batch, seq, [[command, i, args...], ...]]; the reply carries
+    // the array of single-rpc replies
+    pq_batch = 15,
+
+    // [pq_notify_batch, seq, [key, value, ...]] with keys sorted; a null
+    // value erases its key
+    pq_notify_batch = 16,
+
+    // [pq_migrate, seq, first, last, {"owner": N}] asks the server that
+    // owns [first, last) to move it to server N. Servers exchange the
+    // steps of a move as pq_migrate rpcs with a "phase"
+    pq_migrate = 17,
+
+    // [pq_repartition, seq, first, last, {"from": M, "owner": N}] tells a
+    // server that [first, last) moved from server M to server N
+    pq_repartition = 18
 };
 
 enum {
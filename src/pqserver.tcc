@@ -5,8 +5,10 @@
 #include "pqserver.hh"
 #include "pqjoin.hh"
 #include "pqinterconnect.hh"
+#include "pqframe.hh"
 #include "json.hh"
 #include "error.hh"
+#include "pqtrace.hh"
 #include <sys/resource.h>
 
 namespace pq {
@@ -15,6 +17,8 @@ const Datum Datum::empty_datum{Str()};
 const Datum Datum::max_datum(Str("\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF"));
 Table Table::empty_table{Str(), nullptr, nullptr};
 const char Datum::table_marker[] = "TABLE MARKER";
+double Server::rebalance_interval = 0;
+double Server::rebalance_slack = 0.25;
 
 void Table::iterator::fix() {
  retry:
@@ -34,10 +38,14 @@ void Table::iterator::fix() {
 
 Table::Table(Str name, Table* parent, Server* server)
     : Datum(name, String::make_stable(Datum::table_marker)),
-      triecut_(0), njoins_(0), server_{server}, parent_{parent}, 
-      ninsert_(0), nmodify_(0), nmodify_nohint_(0), nerase_(0), nvalidate_(0) {
+      triecut_(0), njoins_(0), server_{server}, parent_{parent},
+      top_(parent && parent->parent_ ? parent->top_ : this),
+      mem_total_(0), mem_quota_(0), over_quota_(false),
+      ninsert_(0), nmodify_(0), nmodify_nohint_(0), nerase_(0), nvalidate_(0),
+      nevict_quota_(0) {
 
     memset(&nsubtables_with_ranges_, 0, sizeof(nsubtables_with_ranges_));
+    memset(&mem_, 0, sizeof(mem_));
     memset(&nevict_sink_, 0, sizeof(nevict_sink_));
     memset(&nevict_remote_, 0, sizeof(nevict_remote_));
     memset(&nevict_persisted_, 0, sizeof(nevict_persisted_));
@@ -122,6 +130,45 @@ size_t Table::count(Str key) const {
     return 0;
 }
 
+// Return the number of keys in [first, last). The store's own keys are
+// counted by position; subtables that cut the range are counted
+// recursively, so the cost grows with the number of subtables touched.
+size_t Table::count(Str first, Str last) const {
+    if (!triecut_)
+        return store_distance(store_, store_.lower_bound(first, KeyCompare()),
+                              store_.lower_bound(last, KeyCompare()));
+    size_t n = 0;
+    auto ite = store_.lower_bound(last, KeyCompare());
+    for (auto it = store_.lower_bound(first.prefix(triecut_), KeyCompare());
+         it != ite; ++it)
+        if (it->is_table())
+            n += it->table().count(first, last);
+        else if (it->key() >= first)
+            ++n;
+    return n;
+}
+
+// Return an iterator to the key @a n places past lower_bound(first).
+auto Table::seek(Str first, size_t n) -> iterator {
+    iterator it = lower_bound(first), itend = it.table_end();
+    while (n && it != itend)
+        if (!it.table_->triecut_) {
+            store_type& store = it.table_->store_;
+            size_t left = store_distance(store, it.it_, store.end());
+            if (n < left) {
+                it.it_ = store_advance(store, it.it_, n);
+                break;
+            }
+            n -= left;
+            it.it_ = store.end();
+            it.fix();
+        } else {
+            ++it;
+            --n;
+        }
+    return it;
+}
+
 size_t Table::size() const {
     size_t x = store_.size();
     if (triecut_)
@@ -142,6 +189,7 @@ void Table::add_source(SourceRange* r) {
 	    return;
 	}
     source_ranges_.insert(*r);
+    account_range<SourceRange>(&mem_log::source_ranges, 1);
 }
 
 void Table::remove_source(Str first, Str last, Sink* sink, Str context) {
@@ -204,7 +252,7 @@ tamed void Table::insert(Str key, String value, tamer::event<> done) {
     if (unlikely(server_->is_remote(owner)))
         twait { server_->interconnect(owner)->insert(key, value, make_event()); }
     else if (unlikely(server_->writethrough() && server_->is_owned_public(owner)))
-        twait { server_->persistent_store()->put(key, value, make_event()); }
+        twait { server_->write_behind()->put(key, value, make_event()); }
 
     // [Log Generation Point] Put
     insert(key, value);
@@ -212,23 +260,38 @@ tamed void Table::insert(Str key, String value, tamer::event<> done) {
 }
 
 void Table::insert(Str key, String value) {
+    insert_after(nullptr, key, value);
+}
+
+// Insert key, looking first just past hint, a datum of this table, as a
+// run of sorted inserts would. Returns the key's datum.
+Datum* Table::insert_after(Datum* hint, Str key, String value) {
     assert(!triecut_ || key.length() < triecut_);
 
     //std::cerr << "INSERT: " << key << std::endl;
     store_type::insert_commit_data cd;
-    auto p = store_.insert_check(key, KeyCompare(), cd);
+    std::pair<store_type::iterator, bool> p;
+    if (hint && hint->valid()) {
+        auto it = store_.iterator_to(*hint);
+        ++it;
+        p = store_.insert_check(it, key, KeyCompare(), cd);
+    } else
+        p = store_.insert_check(key, KeyCompare(), cd);
     Datum* d;
     if (p.second) {
 	    d = new Datum(key, value);
         value = String();
 	    store_.insert_commit(*d, cd);
+        account_datum(d, 1);
     } else {
 	    d = p.first.operator->();
         d->value().swap(value);
+        account(&mem_log::values, int64_t(d->value().length()) - value.length());
     }
 
     notify(d, value, p.second ? SourceRange::notify_insert : SourceRange::notify_update);
     ++ninsert_;
+    return d;
 }
 
 tamed void Table::erase(Str key, tamer::event<> done) {
@@ -241,7 +304,7 @@ tamed void Table::erase(Str key, tamer::event<> done) {
     if (unlikely(server_->is_remote(owner)))
         twait { server_->interconnect(owner)->erase(key, make_event()); }
     else if (unlikely(server_->writethrough() && server_->is_owned_public(owner)))
-        twait { server_->persistent_store()->erase(key, make_event()); }
+        twait { server_->write_behind()->erase(key, make_event()); }
 
     // [Log Generation Point] Delete(erase)   
     erase(key);
@@ -299,11 +362,13 @@ void Table::finish_modify(std::pair<ServerStore::iterator, bool> p,
             d = new Datum(key, sink);
             sink->add_datum(d);
             p.first = store_.insert_commit(*d, cd);
+            account_datum(d, 1);
             n = SourceRange::notify_insert;
         }
     } else if (is_erase_marker(value)) {
         if (!p.second) {
             p.first = store_.erase(p.first);
+            account_datum(d, -1);
             n = SourceRange::notify_erase;
         } else
             goto done;
@@ -315,6 +380,8 @@ void Table::finish_modify(std::pair<ServerStore::iterator, bool> p,
         goto done;
 
     d->value().swap(value);
+    if (n != SourceRange::notify_erase)
+        account(&mem_log::values, int64_t(d->value().length()) - value.length());
     notify(d, value, n);
     if (n == SourceRange::notify_erase)
         d->invalidate();
@@ -355,8 +422,11 @@ std::pair<bool, Table::iterator> Table::validate_local(Str first, Str last,
             sr = const_cast<SinkRange*>(kitx->owner()->range());
 
             // single range covers lookup?
-            if (sr->ibegin() <= first && last <= sr->iend()) {
+            if (sr->evicted())
+                sr = nullptr;
+            else if (sr->ibegin() <= first && last <= sr->iend()) {
                 if (sr->valid(now)) {
+                    sr->note_read();
                     server_->lru_touch(sr);
                     return std::make_pair(true, iterator(this, kit, this));
                 }
@@ -378,9 +448,15 @@ std::pair<bool, Table::iterator> Table::validate_local(Str first, Str last,
 
         // either no valid SinkRange was found or the lookup is 
         // outside the span of the SinkRange found. fill in the gaps.
-        local_vector<SinkRange*, 4> ranges;
-        collect_ranges(first, last, ranges,
+        local_vector<SinkRange*, 4> ranges, found;
+        collect_ranges(first, last, found,
                        &Table::sink_ranges_, &Table::swr::sink);
+        // finish dropping ranges that eviction purged in part
+        for (auto it = found.begin(); it != found.end(); ++it)
+            if ((*it)->evicted())
+                (*it)->evict_table()->drop_sink(*it);
+            else
+                ranges.push_back(*it);
 
         Str have = first;
         uint32_t inserted = 0;
@@ -399,13 +475,17 @@ std::pair<bool, Table::iterator> Table::validate_local(Str first, Str last,
                     sr_last = (*it)->ibegin();
 
                 sr = new SinkRange(have, sr_last, this);
+                bool sr_completed = true;
                 for (auto j = t->join_ranges_.begin_overlaps(first, last);
                         j != t->join_ranges_.end(); ++j) {
 
                     //std::cerr << "  adding join to sink range: " << j->interval()
                     //          << " -> " << sr->interval() << std::endl;
-                    completed &= sr->add_sink(j.operator->(), *server_, now, log, gr);
+                    sr_completed &= sr->add_sink(j.operator->(), *server_, now, log, gr);
                 }
+                if (sr_completed && server_->measures_cost())
+                    sr->measure();
+                completed &= sr_completed;
 
                 sink_ranges_.insert(*sr);
                 server_->lru_touch(sr);
@@ -443,8 +523,13 @@ std::pair<bool, Table::iterator> Table::validate_local(Str first, Str last,
             }
             have = pr->iend();
 
-            if (pr->pending()) {
-                pr->add_waiting(gr.make_event());
+            // a scan that ends inside a pending range waits only for the
+            // fetch to reach its last key
+            if (pr->pending() && last > pr->loaded()) {
+                if (last < pr->iend())
+                    pr->add_waiting_loaded(last, gr.make_event());
+                else
+                    pr->add_waiting(gr.make_event());
                 fetching = true;
             }
 
@@ -630,6 +715,11 @@ tamed void Table::fetch_persisted(String first, String last, tamer::event<> done
     tvars {
         PersistedRange* pr = new PersistedRange(this, first, last);
         PersistentStore::ResultSet res;
+        String cursor = first;
+        uint32_t limit = server_->persisted_batch_size();
+        bool more = true;
+        uint64_t fetch_start = tstamp();
+        uint64_t bytes = 0;
     }
 
     pr->add_waiting(done);
@@ -639,22 +729,61 @@ tamed void Table::fetch_persisted(String first, String last, tamer::event<> done
         ++t->nsubtables_with_ranges_.persisted;
 
     //std::cerr << "fetching persisted data: " << pr->interval() << std::endl;
-    twait { server_->persistent_store()->scan(first, last, make_event(res)); }
+    // insert each batch as it arrives; the next batch starts at the key
+    // the store returned past the limit, so no scan comes back empty
+    while (more) {
+        twait { server_->persistent_store()->scan_batch(cursor, last, limit, make_event(res)); }
+
+        more = res.size() == size_t(limit) + 1;
+        if (more) {
+            cursor = res.back().first;
+            res.pop_back();
+        }
 
-    //std::cerr << "persisted data fetch: " << pr->interval() << " returned "
-    //          << res.size() << " results" << std::endl;
+        for (auto it = res.begin(); it != res.end(); ++it) {
+            server_->make_table_for(it->first).insert(it->first, it->second);
+            bytes += it->first.length() + it->second.length();
+        }
 
-    for (auto it = res.begin(); it != res.end(); ++it)
-        server_->make_table_for(it->first).insert(it->first, it->second);
+        if (more)
+            pr->set_loaded(cursor);
+        res.clear();
+    }
 
+    pr->set_loaded(last);
+    if (server_->measures_cost())
+        pr->set_cost(tstamp() - fetch_start, bytes);
     server_->lru_touch(pr);
     pr->notify_waiting();
 }
 
+bool Table::has_sources(Str first, Str last) {
+    Table* t = this;
+    do {
+        if (t->source_ranges_.begin_overlaps(first, last) != t->source_ranges_.end())
+            return true;
+    } while ((t = t->parent_) && t->triecut_);
+    return false;
+}
+
 void Table::evict_persisted(PersistedRange* pr) {
     assert(!pr->pending());
     assert(!nsubtables_with_ranges_.persisted);
 
+    // with no dependents a big range can be purged a chunk at a time.
+    // it is marked evicted meanwhile, so validation purges the rest and
+    // reloads it like any evicted range
+    if (!has_sources(pr->ibegin(), pr->iend())) {
+        bool more;
+        nevict_persisted_.keys += erase_purge(pr->ibegin(), pr->iend(),
+                                              server_->evict_chunk(), more);
+        if (more) {
+            ++nevict_persisted_.chunks;
+            pr->mark_evicted();
+            return;
+        }
+    }
+
     uint32_t kept = 0;
     Table* t = this;
 
@@ -692,9 +821,11 @@ tamed void Table::fetch_remote(String first, String last, int32_t owner,
     tvars {
         RemoteRange* rr = new RemoteRange(this, first, last, owner);
         Interconnect::scan_result res;
+        uint64_t t0 = Trace::start();
+        uint64_t fetch_start = tstamp();
+        uint64_t bytes = 0;
     }
 
-    std::cout << "[fetch_remote] called with [" << first << "," << last << ")\n"; // subscription log
     rr->add_waiting(done);
 
     for (Table* t = parent_; t; t = t->parent_)
@@ -710,11 +841,14 @@ tamed void Table::fetch_remote(String first, String last, int32_t owner,
     // std::cerr << "remote data fetch: " << rr->interval() << " returned "
     //          << res.size() << " results" << std::endl;
 
+    Trace::record(trace_fetch_remote, first, res.size(), t0);
     for (auto it = res.begin(); it != res.end(); ++it) {
-        std::cout << "[fetch_remote] "<< it->key() << "\n"; // subscription log
         server_->make_table_for(it->key()).insert(it->key(), it->value());
+        bytes += it->key().length() + it->value().length();
     }
 
+    if (server_->measures_cost())
+        rr->set_cost(tstamp() - fetch_start, bytes);
     server_->lru_touch(rr);
     rr->notify_waiting();
 }
@@ -723,6 +857,24 @@ void Table::evict_remote(RemoteRange* rr) {
     assert(!rr->pending());
     assert(!nsubtables_with_ranges_.remote);
 
+    // a range being migrated here will become this server's own data
+    if (unlikely(server_->migrating(rr->ibegin(), rr->iend()))) {
+        server_->lru_touch(rr);
+        return;
+    }
+
+    // purge in chunks, as in evict_persisted
+    if (!has_sources(rr->ibegin(), rr->iend())) {
+        bool more;
+        nevict_remote_.keys += erase_purge(rr->ibegin(), rr->iend(),
+                                           server_->evict_chunk(), more);
+        if (more) {
+            ++nevict_remote_.chunks;
+            rr->mark_evicted();
+            return;
+        }
+    }
+
     uint32_t kept = 0;
     Table* t = this;
 
@@ -763,36 +915,65 @@ void Table::invalidate_remote(Str first, Str last) {
     collect_ranges(first, last, ranges,
                    &Table::remote_ranges_, &Table::swr::remote);
 
-    for (auto r = ranges.begin(); r != ranges.end(); ++r) {
-        RemoteRange* rr = *r;
-        Table* rrt = rr->table();
-
-        if (rr->pending())
-            continue;
+    for (auto r = ranges.begin(); r != ranges.end(); ++r)
+        if (!(*r)->pending()) {
+            //std::cerr << "invalidating remote range " << (*r)->interval() << std::endl;
+            (*r)->table()->discard_remote(*r, Str(), Str());
+        }
+}
 
-        //std::cerr << "invalidating remote range " << rr->interval() << std::endl;
-        rrt->remote_ranges_.erase(*rr);
-        rrt->invalidate_dependents(rr->ibegin(), rr->iend());
+// Forget remote range rr and erase its data, except for keys in
+// [keep_first, keep_last).
+void Table::discard_remote(RemoteRange* rr, Str keep_first, Str keep_last) {
+    assert(rr->table() == this && !rr->pending());
+    remote_ranges_.erase(*rr);
+    invalidate_dependents(rr->ibegin(), rr->iend());
 
-        for (Table* t = rrt->parent_; t; t = t->parent_)
-            --t->nsubtables_with_ranges_.remote;
+    for (Table* t = parent_; t; t = t->parent_)
+        --t->nsubtables_with_ranges_.remote;
 
-        auto it = rrt->lower_bound(rr->ibegin());
-        auto itend = rrt->lower_bound(rr->iend());
-        while(it != itend)
+    auto it = lower_bound(rr->ibegin());
+    auto itend = lower_bound(rr->iend());
+    while (it != itend)
+        if (keep_first <= it->key() && it->key() < keep_last)
+            ++it;
+        else
             it = erase_invalid(it);
 
-        delete rr;
-    }
+    delete rr;
 }
 
-void Table::evict_sink(SinkRange* sr) {
-    assert(!sr->evicted());
+// Forget remote range rr but keep its data, which this server now owns.
+void Table::release_remote(RemoteRange* rr) {
+    assert(rr->table() == this && !rr->pending());
+    remote_ranges_.erase(*rr);
+    for (Table* t = parent_; t; t = t->parent_)
+        --t->nsubtables_with_ranges_.remote;
+    delete rr;
+}
 
+void Table::evict_sink(SinkRange* sr) {
     //todo: purge sources and keep sinkrange
 
     //std::cerr << "evicting sink range " << sink->interval() << std::endl;
 
+    // a big range gives up its outputs a chunk at a time, as in
+    // evict_persisted. it is marked evicted meanwhile: sources stop
+    // delivering to its sinks, and validation drops it and computes the
+    // range anew. under evict_lru it stays at the list front, so the next
+    // eviction continues it; the sampled policies return to it only when
+    // they happen to sample it
+    bool more;
+    nevict_sink_.keys += sr->purge(server_->evict_chunk(), more);
+    if (more) {
+        ++nevict_sink_.chunks;
+        sr->mark_evicted();
+        return;
+    }
+    drop_sink(sr);
+}
+
+void Table::drop_sink(SinkRange* sr) {
     uint64_t before = Sink::invalidate_hit_keys;
 
     sink_ranges_.erase(*sr);
@@ -820,24 +1001,49 @@ void Table::remove_subscription(Str first, Str last, int32_t peer) {
     remove_source(first, last, server_->remote_sink(peer), Str());
 }
 
+// Collect the subscriptions that lie within [first, last), here and, if
+// down, in subtables.
+void Table::collect_subscriptions(Str first, Str last,
+                                  std::vector<SubscribedRange*>& out, bool down) {
+    for (auto it = source_ranges_.begin_overlaps(first, last);
+         it != source_ranges_.end(); ++it)
+        if (!it->join() && first <= it->ibegin() && it->iend() <= last)
+            out.push_back(static_cast<SubscribedRange*>(it.operator->()));
+
+    if (down && triecut_)
+        for (auto it = store_.lower_bound(first, KeyCompare());
+             it != store_.end() && it->key() < last; ++it)
+            if (it->is_table())
+                it->table().collect_subscriptions(first, last, out, true);
+}
+
 
 Server::Server()
-    : persistent_store_(nullptr), writethrough_(false),
+    : persistent_store_(nullptr), writethrough_(false), write_behind_(nullptr),
+      persisted_batch_size_(4096),
       supertable_(Str(), nullptr, this),
       last_validate_at_(0), validate_time_(0), insert_time_(0), evict_time_(0),
-      part_(nullptr), me_(-1),
+      part_(nullptr), me_(-1), nload_(0),
       prob_rng_(0,1), evict_lo_(0), evict_hi_(0), evict_scale_(0),
-      evict_tomb_(true), evict_rand_(false), evict_multi_(true), 
+      evict_tomb_(true), evict_policy_(evict_lru), evict_samples_(5),
+      evict_inflation_(0), evict_slice_(1000), evict_chunk_(1024),
+      evict_pause_max_(0), evict_timer_scheduled_(false),
+      evict_multi_(true),
       evict_multi_perm_({0, 1, 2, 3}) {
 
     gettimeofday(&start_tv_, NULL);
     gen_.seed(112181);
+    memset(evict_pause_, 0, sizeof(evict_pause_));
 }
 
 Server::~Server() {
     for (auto& s : remote_sinks_)
         s->deref();
+    for (auto s : cold_sinks_)
+        s->deref();
+    evict_timerkill_();
 
+    delete write_behind_;
     if (persistent_store_)
         delete persistent_store_;
 }
@@ -859,6 +1065,7 @@ tamed void Server::insert(Str key, const String& value, tamer::event<> done) {
     insert_time_ += to_real(tv[1] - tv[0]);
 
     maybe_evict();
+    evict_deferred();
     done();
 }
 
@@ -866,6 +1073,322 @@ tamed void Server::erase(Str key, tamer::event<> done) {
     twait { table_for(key).erase(key, done); }
 }
 
+// Apply a pq_notify_batch from a peer: [key, value, ...] sorted by key,
+// where a null value erases. Each insert starts its search just past the
+// previous key in the same table.
+void Server::apply_notify_batch(const Json& kv) {
+    Table* t = nullptr;
+    Datum* hint = nullptr;
+    for (size_t i = 0; i + 1 < kv.size(); i += 2)
+        apply_notify(kv[i].as_s(), kv[i + 1].is_s() ? Str(kv[i + 1].as_s()) : Str(),
+                     !kv[i + 1].is_s(), t, hint);
+    if (hint)
+        hint->deref();
+}
+
+// The same, for a binary frame, read in place.
+void Server::apply_notify_batch(const Frame& f) {
+    Table* t = nullptr;
+    Datum* hint = nullptr;
+    for (auto it = f.begin(); it != f.end(); ++it)
+        apply_notify(it.key(), it.value(), it.is_null(), t, hint);
+    if (hint)
+        hint->deref();
+}
+
+inline void Server::apply_notify(Str key, Str value, bool erase,
+                                 Table*& t, Datum*& hint) {
+    Table* kt = &table_for(key);
+    if (kt != t && hint) {
+        hint->deref();
+        hint = nullptr;
+    }
+    t = kt;
+    if (!erase) {
+        Datum* d = t->insert_after(hint, key, String(value));
+        d->ref();
+        if (hint)
+            hint->deref();
+        hint = d;
+    } else
+        t->erase(key);
+}
+
+// Move [first, last), which this server owns, to server `owner`:
+//
+// 1. The new owner subscribes to the range, as a cache would. That copies
+//    the base data and forwards later writes.
+// 2. In one step, this server points its partition table at the new
+//    owner, hands over the subscriptions peers hold on the range, and
+//    sends a commit. Writes that arrive here afterward are forwarded
+//    behind the commit; reads here wait until the commit is answered.
+//    It drops its copy only once the commit is acknowledged; if the
+//    commit fails, it takes the range and the subscriptions back and
+//    tells the new owner to abort.
+// 3. The other servers learn of the move and repoint their remote
+//    ranges. The new owner then hears that the move is done; until then
+//    it will not move the range again.
+//
+// The range must lie in one table. Computed (joined) tables do not move,
+// nor does data whose home is a persistent store.
+tamed void Server::migrate(String first, String last, int32_t owner,
+                           tamer::event<bool> done) {
+    tvars {
+        std::vector<keyrange> parts;
+        Json subs = Json::make_array();
+        Interconnect* ic;
+        int32_t i;
+        bool ok = false, acked;
+    }
+
+    if (part_ && first < last && table_name(first, last))
+        partitions_for(first, last, parts);
+    if (parts.size() != 1 || parts[0].owner != me_
+        || owner == me_ || owner < 0
+        || owner >= (int32_t) interconnect_.size() || !interconnect_[owner]
+        || table(table_name(first, last)).njoins_ || persistent_store_
+        || migrating(first, last)) {
+        done(false);
+        return;
+    }
+
+    migrating_.push_back(std::make_pair(first, last));
+    ic = interconnect_[owner];
+    twait { ic->migrate(first, last, Json().set("phase", "pull").set("from", me_),
+                        make_event(ok)); }
+
+    if (ok) {
+        // updates already queued for any peer precede the handoff
+        for (i = 0; i != (int32_t) interconnect_.size(); ++i)
+            if (interconnect_[i])
+                interconnect_[i]->flush_notify();
+        committing_.push_back(std::make_pair(first, last));
+        part_->reassign(first, last, owner);
+        take_subscriptions(first, last, subs);
+        twait { ic->migrate(first, last,
+                            Json().set("phase", "commit").set("from", me_)
+                                  .set("subscriptions", subs),
+                            make_event(ok)); }
+
+        if (!ok) {
+            std::cerr << "migrate [" << first << "," << last << ") to "
+                      << owner << ": commit failed, keeping the range\n";
+            part_->reassign(first, last, me_);
+            restore_subscriptions(subs);
+            commit_done(first, last);
+            twait { ic->migrate(first, last, Json().set("phase", "abort"),
+                                make_event(acked)); }
+        } else {
+            drop_range(first, last);
+            commit_done(first, last);
+            twait {
+                for (i = 0; i != (int32_t) interconnect_.size(); ++i)
+                    if (i != me_ && i != owner && interconnect_[i])
+                        interconnect_[i]->repartition(first, last, me_, owner,
+                                                      make_event());
+            }
+            // the range has moved; a lost "done" only delays the next move
+            twait { ic->migrate(first, last, Json().set("phase", "done"),
+                                make_event(acked)); }
+        }
+    }
+
+    migrate_done(first, last);
+    done(ok);
+}
+
+// The new owner's half of migrate(): copy [first, last) from `from` and
+// hold it until the commit. Parts it already caches are not fetched again.
+tamed void Server::migrate_pull(String first, String last, int32_t from,
+                                tamer::event<bool> done) {
+    tvars {
+        Table* t;
+        uint32_t log = 0;
+        tamer::gather_rendezvous gr;
+    }
+
+    if (!part_ || !(first < last) || !table_name(first, last)
+        || migrating(first, last)) {
+        done(false);
+        return;
+    }
+
+    migrating_.push_back(std::make_pair(first, last));
+    t = &make_table_for(first, last);
+    do {
+        twait(gr);
+        t->validate_remote(first, last, from, log, gr);
+    } while (gr.has_waiting());
+    done(true);
+}
+
+// Fails unless a pull of [first, last) is under way.
+tamed void Server::migrate_commit(String first, String last, int32_t from,
+                                  Json subs, tamer::event<bool> done) {
+    if (!part_ || !migrating(first, last)) {
+        done(false);
+        return;
+    }
+
+    part_->reassign(first, last, me_);
+    restore_subscriptions(subs);
+    twait { adopt_remote(first, last, from, me_, make_event()); }
+    done(true);
+}
+
+// Subscribe peers to the [first, last, peer] ranges in subs.
+void Server::restore_subscriptions(const Json& subs) {
+    for (size_t i = 0; i != subs.size(); ++i) {
+        int32_t peer = subs[i][2].to_i();
+        if (peer != me_ && peer >= 0 && peer < (int32_t) remote_sinks_.size())
+            subscribe(subs[i][0].as_s(), subs[i][1].as_s(), peer);
+    }
+}
+
+// The commit of [first, last) is answered; wake the reads it held.
+void Server::commit_done(Str first, Str last) {
+    for (auto it = committing_.begin(); it != committing_.end(); ++it)
+        if (it->first == first && it->second == last) {
+            committing_.erase(it);
+            break;
+        }
+    std::vector<tamer::event<> > waiting;
+    waiting.swap(commit_waiting_);
+    for (auto& e : waiting)
+        e();
+}
+
+void Server::migrate_done(Str first, Str last) {
+    for (auto it = migrating_.begin(); it != migrating_.end(); ++it)
+        if (it->first == first && it->second == last) {
+            migrating_.erase(it);
+            break;
+        }
+}
+
+tamed void Server::repartition(String first, String last, int32_t from,
+                               int32_t owner, tamer::event<> done) {
+    if (part_ && first < last) {
+        part_->reassign(first, last, owner);
+        twait { adopt_remote(first, last, from, owner, make_event()); }
+    }
+    done();
+}
+
+// After [first, last) moves from `from` to `owner`, fix the remote ranges
+// fetched from `from`. One inside the move now belongs to the new owner,
+// or if that is this server, is simply its own data. One that straddles
+// the move is dropped: its subscription stayed behind, where those keys
+// no longer change. Fetches in flight are waited out first, so neither a
+// late reply nor a half-moved subscription survives the move.
+tamed void Server::adopt_remote(String first, String last, int32_t from,
+                                int32_t owner, tamer::event<> done) {
+    tvars {
+        local_vector<RemoteRange*, 4> ranges;
+        RemoteRange* rr;
+        size_t i;
+        bool again = true;
+    }
+
+    while (again) {
+        again = false;
+        ranges.clear();
+        table_for(first, last).collect_ranges(first, last, ranges,
+                                              &Table::remote_ranges_,
+                                              &Table::swr::remote);
+        for (i = 0; i != ranges.size(); ++i) {
+            rr = ranges[i];
+            if (rr->owner() != from)
+                continue;
+            if (rr->pending()) {
+                twait { rr->add_waiting(make_event()); }
+                again = true;
+                break;
+            }
+            if (first <= rr->ibegin() && rr->iend() <= last) {
+                if (owner == me_)
+                    rr->table()->release_remote(rr);
+                else
+                    rr->set_owner(owner);
+            } else {
+                interconnect_[from]->unsubscribe(rr->ibegin(), rr->iend(), me_,
+                                                 tamer::event<>());
+                if (owner == me_)
+                    rr->table()->discard_remote(rr, first, last);
+                else
+                    rr->table()->discard_remote(rr, Str(), Str());
+            }
+        }
+    }
+    done();
+}
+
+// Remove the subscriptions peers hold on ranges within [first, last),
+// listing them as [first, last, peer] in subs.
+void Server::take_subscriptions(Str first, Str last, Json& subs) {
+    std::vector<SubscribedRange*> ranges;
+    std::vector<int32_t> peers;
+    Table& t = table_for(first, last);
+    for (Table* p = t.parent_; p && p->parent_; p = p->parent_)
+        p->collect_subscriptions(first, last, ranges, false);
+    t.collect_subscriptions(first, last, ranges, true);
+
+    for (auto sr : ranges) {
+        peers.clear();
+        sr->peers(peers);
+        std::sort(peers.begin(), peers.end());
+        peers.erase(std::unique(peers.begin(), peers.end()), peers.end());
+        for (auto peer : peers)
+            subs.push_back(Json::array(String(sr->ibegin()), String(sr->iend()), peer));
+        // the range is deleted with its last sink
+        for (auto peer : peers)
+            sr->remove_sink(remote_sink(peer), Str());
+    }
+}
+
+// Drop this server's copy of [first, last), which it no longer owns.
+void Server::drop_range(Str first, Str last) {
+    Table& t = table_for(first, last);
+    t.invalidate_dependents(first, last);
+    auto it = t.lower_bound(first);
+    auto itend = t.lower_bound(last);
+    while (it != itend)
+        it = t.erase_invalid(it);
+}
+
+void Server::record_load_slow(Str key) {
+    ++nload_;
+    if (owner_for(key) != me_ || table(table_name(key)).njoins_)
+        return;
+    String k(key);
+    auto it = load_.upper_bound(k);
+    if (it != load_.begin() && k < (--it)->second.last)
+        ++it->second.n;
+    else {
+        String first, last;
+        part_->cell(key, first, last);
+        load_[first] = load_cell{last, 1};
+    }
+}
+
+// Find the owned partition cell with the most load recorded since the
+// last call that is at most max_share of all operations, then start
+// counting again.
+bool Server::take_load_range(double max_share, String& first, String& last) {
+    uint64_t limit = uint64_t(max_share * nload_), best = 0;
+    for (auto& c : load_)
+        if (c.second.n > best && c.second.n <= limit
+            && owner_for(c.first) == me_
+            && !migrating(c.first, c.second.last)) {
+            best = c.second.n;
+            first = c.first;
+            last = c.second.last;
+        }
+    load_.clear();
+    nload_ = 0;
+    return best != 0;
+}
+
 tamed void Server::validate(Str key, tamer::event<Table::iterator> done) {
     tvars {
         struct timeval tv[2];
@@ -921,21 +1444,155 @@ tamed void Server::validate(Str first, Str last, tamer::event<Table::iterator> d
     done(it.second);
 }
 
+// Return the join that alone computes [first, last), if it is ordered()
+// and no part of the range has been computed yet.
+Join* Table::ordered_join(Str first, Str last) {
+    // unknown tables, and ranges spanning tables, come as empty_table
+    if (this == &empty_table)
+        return nullptr;
+    Table* t = this;
+    while (t->parent_ && t->parent_->triecut_)
+        t = t->parent_;
+    if (!t->njoins_)
+        return nullptr;
+
+    local_vector<SinkRange*, 4> ranges;
+    collect_ranges(first, last, ranges,
+                   &Table::sink_ranges_, &Table::swr::sink);
+    if (!ranges.empty())
+        return nullptr;
+
+    Join* join = nullptr;
+    for (auto j = t->join_ranges_.begin_overlaps(first, last);
+         j != t->join_ranges_.end(); ++j) {
+        if (join || !j->join()->ordered()
+            || first < j->ibegin() || j->iend() < last)
+            return nullptr;
+        join = j->join();
+    }
+    return join;
+}
+
+// Find a window of [first, last) that holds its first (or, if reverse,
+// last) limit sink keys, so a limited scan need not compute the rest.
+// Reports the key where the window ends (or begins), or an empty string if
+// the window is the whole range. Windows are only found for ordered joins:
+// the source is validated and scanned, but only the window's sink keys
+// are materialized by the validation that follows.
+tamed void Server::limit_window(Str first, Str last, int limit, bool reverse,
+                                tamer::event<String> done) {
+    tvars {
+        Join* join = nullptr;
+        std::vector<keyrange> parts;
+        String kf, kl;
+        Table::iterator it;
+        std::vector<String> ring;
+        size_t n = 0;
+        String cut;
+    }
+
+    if (limit > 0 && (!partitions_for(first, last, parts)
+                      || (parts.size() == 1 && !is_remote(parts[0].owner))))
+        join = table_for(first, last).ordered_join(first, last);
+    if (!join) {
+        done(String());
+        return;
+    }
+
+    {
+        RangeMatch rm(first, last);
+        join->sink().match_range(rm);
+        kf = join->expand_first(join->back_source(), rm);
+        kl = join->expand_last(join->back_source(), rm);
+    }
+    join->ref();
+    twait { validate(kf, kl, make_event(it)); }
+
+    {
+        RangeMatch rm(first, last);
+        join->sink().match_range(rm);
+        PatternFilter filter(join->back_source(), rm.match);
+        ring.resize(reverse ? limit : 1);
+        for (auto itend = it.table_end(); it != itend && it->key() < kl; ++it) {
+            if (!filter.match(it->key()))
+                continue;
+            join->expand_sink_key_source(it->key(), 0);
+            Str sk = join->sink_key();
+            if (sk < first || (n && sk == ring[(n - 1) % ring.size()]))
+                continue;
+            else if (sk >= last)
+                break;
+            else if (!reverse && n == size_t(limit)) {
+                cut = sk;
+                break;
+            }
+            ring[n % ring.size()] = sk;
+            ++n;
+        }
+        if (reverse && n > size_t(limit))
+            cut = ring[n % ring.size()];
+    }
+
+    join->deref();
+    done(cut);
+}
+
+// Drop the ranges of adaptive sinks that filled their change log without
+// being read. They stop receiving changes and are recomputed when read.
+void Server::drop_cold_sinks() {
+    std::vector<Sink*> sinks;
+    sinks.swap(cold_sinks_);
+    for (Sink* sink : sinks) {
+        // dropped whole: evict_sink would purge a big range a chunk at a
+        // time and leave its sinks in place
+        if (sink->cold() && sink->valid()) {
+            sink->range()->evict_table()->drop_sink(sink->range());
+            ++Sink::ncold_dropped;
+        }
+        sink->deref();
+    }
+}
+
+tamed void Server::evict_timer() {
+    // NB may outlive the server, like WriteBehind::flush_timer
+    tvars {
+        tamer::event<> kill;
+        tamer::rendezvous<> rendez;
+    }
+
+    kill = evict_timerkill_ = tamer::make_event(rendez);
+    evict_timer_scheduled_ = true;
+    twait { tamer::at_asap(make_event()); }
+    if (kill) {
+        evict_timer_scheduled_ = false;
+        evict_deferred();
+        if (!over_quota_.empty())
+            schedule_evict_timer();
+        kill();
+    }
+}
+
 tamed void Server::periodic_eviction() {//
     tvars {
-        uint64_t start;
+        uint64_t start, now;
+        bool more;
     }
 
     while(true) {
         // todo: use store size once its allocation is broken out
-        while (mem_other_size >= evict_hi_) {
-            start = tstamp();
-            if (!evict_one())
-                break;
+        // evict in slices of at most evict_slice_ microseconds, letting
+        // the driver run between slices to avoid huge latency spikes
+        more = true;
+        while (more && mem_other_total() >= evict_hi_) {
+            start = now = tstamp();
+            while (more && mem_other_total() >= evict_hi_ && now - start < evict_slice_) {
+                more = evict_one();
+                now = tstamp();
+            }
+            record_evict_pause(now - start);
 
-            // let other stuff happen to avoid huge latency spikes
-            //if (tstamp() - start > 1000)
-            //    twait volatile { tamer::at_delay_msec(1, make_event()); }
+            if (more && mem_other_total() >= evict_hi_)
+                twait volatile { tamer::at_delay_usec(0, make_event()); }
         }
 
         twait volatile { tamer::at_delay_msec(250, make_event()); }
@@ -943,8 +1600,10 @@ tamed void Server::periodic_eviction() {//
 }
 
 tamed void Server::set_eviction_details(uint64_t low_mb, uint64_t high_mb,
-                                        bool etomb, bool erand, bool emulti, bool epref_sink, 
-                                        bool einline, bool eperiodic) {
+                                        bool etomb, int epolicy, uint32_t esamples,
+                                        bool emulti, bool epref_sink,
+                                        bool einline, bool eperiodic,
+                                        Json table_quota_mb) {
     if (!enable_memory_tracking)
         mandatory_assert(!low_mb && !high_mb, "Enable memory tracking to use eviction!");
     if (low_mb || high_mb) {
@@ -960,7 +1619,8 @@ tamed void Server::set_eviction_details(uint64_t low_mb, uint64_t high_mb,
         evict_scale_ = 1.0 / ((evict_hi_ - evict_lo_) / 12.0);
 
     evict_tomb_ = etomb;
-    evict_rand_ = erand;
+    evict_policy_ = epolicy;
+    evict_samples_ = esamples ? esamples : 1;
     evict_multi_ = emulti;
 
     if (epref_sink)
@@ -973,30 +1633,42 @@ tamed void Server::set_eviction_details(uint64_t low_mb, uint64_t high_mb,
                   << "       mode: " << String((einline) ? "inline " : "") + String((eperiodic) ? "periodic" : "") << std::endl
                   << " tombstones: " << etomb << std::endl
                   << "     policy: " 
-                  << ((erand) ? "random" 
-                              : ((emulti) ? "multi-LRU +" + String(((epref_sink) ? "sink" : "remote"))
-                                         : "LRU")) << std::endl
+                  << ((epolicy == evict_random) ? String("random")
+                      : String((epolicy == evict_greedy_dual) ? "GreedyDual"
+                               : (epolicy == evict_sample_lfu) ? "sampled-LFU"
+                               : ((epolicy == evict_sample_lru) ? "sampled-LRU" : "LRU"))
+                        + ((emulti) ? " multi +" + String(((epref_sink) ? "sink" : "remote")) : ""))
+                  << std::endl
                   << "=========================" << std::endl;
     }
     else
         std::cerr << "Eviction disabled." << std::endl;
 
+    if (table_quota_mb.is_o())
+        for (auto it = table_quota_mb.obegin(); it != table_quota_mb.oend(); ++it) {
+            mandatory_assert(enable_memory_tracking, "Enable memory tracking to use table quotas!");
+            make_table(it->first).set_mem_quota(it->second.to_u64() << 20);
+            std::cerr << "  table quota: " << it->first << " "
+                      << it->second.to_u64() << " MB" << std::endl;
+        }
+
     if (eperiodic && evict_lo_)
         periodic_eviction();
 }
 
 void add_evict_stats(Json& j, String label, Table::evict_log& log) {
-    if (!log.keys && !log.ranges && !log.reload)
+    if (!log.keys && !log.ranges && !log.reload && !log.chunks)
         return;
 
     if (!j[label])
         j[label] = Json().set("keys", 0).set("ranges", 0)
-                         .set("reload", 0).set("kept", 0);
+                         .set("reload", 0).set("kept", 0).set("chunks", 0);
 
     j[label]["keys"] += log.keys;
     j[label]["ranges"] += log.ranges;
     j[label]["reload"] += log.reload;
     j[label]["kept"] += log.kept;
+    j[label]["chunks"] += log.chunks;
 }
 
 void Table::add_stats(Json& j) {
@@ -1014,6 +1686,19 @@ void Table::add_stats(Json& j) {
     add_evict_stats(j, "nevict_sink", nevict_sink_);
     add_evict_stats(j, "nevict_remote", nevict_remote_);
     add_evict_stats(j, "nevict_persisted", nevict_persisted_);
+    j["nevict_quota"] += nevict_quota_;
+
+    j["mem_keys"] += mem_.keys;
+    j["mem_values"] += mem_.values;
+    j["mem_datums"] += mem_.datums;
+    j["mem_sink_ranges"] += mem_.sink_ranges;
+    j["mem_source_ranges"] += mem_.source_ranges;
+    j["mem_other_ranges"] += mem_.other_ranges;
+    j["mem_tree"] += mem_.tree;
+    if (top_ == this) {
+        j["mem_total"] += mem_total_;
+        j["mem_quota"] += mem_quota_;
+    }
 
     if (triecut_)
         for (auto& d : store_)
@@ -1070,6 +1755,21 @@ Json Server::stats() const {
         .set("server_wall_time_evict", evict_time_)
         .set("server_wall_time_other", wall_time - insert_time_ - validate_time_ - evict_time_);
 
+    // eviction pauses: bucket i counts pauses of [2^(i-1), 2^i) us
+    int npause = npause_buckets;
+    while (npause && !evict_pause_[npause - 1])
+        --npause;
+    if (npause) {
+        Json hist = Json::make_array();
+        for (int i = 0; i < npause; ++i)
+            hist.push_back(evict_pause_[i]);
+        answer.set("server_evict_pause_us", hist)
+              .set("server_evict_pause_max_us", evict_pause_max_);
+    }
+
+    if (part_ && part_->nreassigned())
+        answer.set("reassigned_ranges", part_->unparse_reassigned());
+
     if (enable_validation_logging) {
         uint32_t nclear = 0, ncompute = 0, nupdate = 0,
                  nrestart = 0, nremote = 0, npersisted = 0;
@@ -1099,6 +1799,10 @@ Json Server::stats() const {
               .set("server_validate_nfetch_persisted", npersisted);
     }
 
+    if (write_behind_)
+        answer.merge(write_behind_->stats());
+    answer.merge(Trace::stats());
+
     if (SourceRange::allocated_key_bytes)
         answer.set("source_allocated_key_bytes", SourceRange::allocated_key_bytes);
     if (ServerRangeBase::allocated_key_bytes)
@@ -1107,6 +1811,25 @@ Json Server::stats() const {
         answer.set("invalidate_hits", Sink::invalidate_hit_keys);
     if (Sink::invalidate_miss_keys)
         answer.set("invalidate_misses", Sink::invalidate_miss_keys);
+    if (Sink::ndeferred)
+        answer.set("sink_deferred", Sink::ndeferred)
+              .set("sink_replayed", Sink::nreplayed)
+              .set("sink_replay_full", Sink::nreplay_full);
+    if (Sink::ncold_dropped)
+        answer.set("sink_cold_dropped", Sink::ncold_dropped);
+    if (Interconnect::ndropped_notify)
+        answer.set("interconnect_dropped_notify", Interconnect::ndropped_notify);
+
+    Json pools = Json::make_array();
+    for (const SlabPool* p = SlabPool::all(); p; p = p->next())
+        pools.push_back(Json().set("name", p->name())
+                              .set("objects", p->live_objects())
+                              .set("bytes", p->live_bytes()));
+    answer.set("mem_overhead_size", mem_overhead_size)
+          .set("mem_other_size", mem_other_size)
+          .set("mem_store_size", mem_store_size)
+          .set("mem_offloop_size", mem_offloop_size.load())
+          .set("pools", pools);
     return answer.set("tables", tables);
 }
 
@@ -1143,6 +1866,13 @@ void Server::control(const Json& cmd) {
         if (persistent_store_)
             persistent_store_->flush();
     }
+    if (cmd["trace"].is_b())
+        Trace::enable(cmd["trace"].as_b());
+    if (cmd["trace_dump"].is_s()) {
+        ssize_t n = Trace::dump(cmd["trace_dump"].as_s());
+        std::cerr << "trace: wrote " << n << " records to "
+                  << cmd["trace_dump"].as_s() << std::endl;
+    }
 }
 
 void Table::print_sources(std::ostream& stream) const {
@@ -8,17 +8,19 @@
 #include "error.hh"
 #include "pqinterconnect.hh"
 #include "pqlog.hh"
+#include "pqtrace.hh"
 #include "sock_helper.hh"
 #include <vector>
 #include <set>
 #include <sys/resource.h>
 
 const pq::Host* me_ = nullptr;
-const pq::Partitioner* part_ = nullptr;
+pq::Partitioner* part_ = nullptr;
 std::vector<pq::Interconnect*> interconnect_;
 std::set<msgpack_fd*> clients_;
 bool ready_ = false;
 uint32_t round_robin_ = 0;
+double cpu_load_ = 0;                   // smoothed percent of one core
 
 pq::Log log_(tstamp());
 typedef struct {
@@ -29,6 +31,7 @@ typedef struct {
     uint32_t nscan;
     uint32_t ninvalidate;
     uint32_t nnotify;
+    uint32_t nbatch;
 } nrpc;
 nrpc diff_;
 
@@ -57,28 +60,94 @@ blocked_locations_shrink(std::vector<std::string>::iterator first,
     return out;
 }
 
-tamed void read_and_process_one(msgpack_fd* mpfd, pq::Server& server,
-                                tamer::event<bool> done) {
+enum { scan_all = 0, scan_keys = 1, scan_values = 2 };
+
+// Scan and count options follow the optional scanlast argument as an
+// object: {"limit": N, "offset": N, "reverse": true, "fields": "keys" or
+// "values"}. An offset skips that many rows from the start of the scan's
+// direction. A projected scan replies with empty strings in place of the
+// dropped field. When a limit cuts a scan short, the reply's fourth
+// element is a continuation key: the next forward page starts there, and
+// the next reverse page ends there, with no offset.
+static void parse_scan_options(const Json& opt, size_t& limit, size_t& offset,
+                               bool& reverse, int& fields) {
+    if (!opt.is_o())
+        return;
+    if (opt["limit"].is_i() && opt["limit"].as_i() > 0)
+        limit = opt["limit"].as_i();
+    if (opt["offset"].is_i() && opt["offset"].as_i() > 0)
+        offset = opt["offset"].as_i();
+    reverse = opt["reverse"].as_b(false);
+    if (opt["fields"] == "keys")
+        fields = scan_keys;
+    else if (opt["fields"] == "values")
+        fields = scan_values;
+}
+
+static inline void push_scan_pair(Json& aj, const pq::Datum& d, int fields) {
+    if (fields == scan_values)
+        aj.push_back(String());
+    else
+        aj.push_back(d.key());
+    if (fields == scan_keys)
+        aj.push_back(String());
+    else
+        aj.push_back(d.value());
+}
+
+// Write a scan reply as a binary frame, for peers that asked for one.
+static void write_frame_scan_reply(msgpack_fd* mpfd, int command, const Json& seq,
+                                   pq::Table::iterator it, pq::Table::iterator itend,
+                                   Str scanlast) {
+    pq::FrameWriter fw(command, seq.to_u(), pq_ok);
+    for (; it != itend && it->key() < scanlast; ++it)
+        fw.push(it->key(), it->value());
+    mpfd->write_frame(fw.finish(pq::Interconnect::frame_compress_min));
+}
+
+// Write a scan reply already gathered as [key, value, ...] as a binary frame.
+static void write_frame_scan_reply(msgpack_fd* mpfd, int command, const Json& seq,
+                                   const Json& aj) {
+    pq::FrameWriter fw(command, seq.to_u(), pq_ok);
+    for (Json::size_type i = 0; i + 1 < aj.size(); i += 2)
+        fw.push(aj[i].as_s(), aj[i + 1].as_s());
+    mpfd->write_frame(fw.finish(pq::Interconnect::frame_compress_min));
+}
+
+// If `direct` is true, a scan may write its reply straight to mpfd,
+// leaving rj null.
+tamed void process_one(msgpack_fd* mpfd, pq::Server& server,
+                       const Json& j, Json& rj, bool direct,
+                       tamer::event<> done) {
     tvars {
-        Json j, rj = Json::array(0, 0, 0), aj = Json::make_array();
+        Json aj = Json::make_array();
         int32_t command;
         String key, first, last, scanlast;
         pq::Table* t;
         pq::Table::iterator it;
         size_t count;
-        int32_t peer = -1;
+        int32_t peer = -1, owner;
+        uint64_t t0;
+        bool ok = false;
+        pq::Interconnect::scan_result res;
+        size_t limit = 0, offset = 0;
+        bool reverse = false, binary = false;
+        int fields = scan_all;
+        pq::Frame frame;
+        String cut, next;
+        std::vector<pq::Datum*> rows;
+        std::vector<pq::keyrange> parts;
+        size_t pi;
     }
 
-    twait { mpfd->read_request(make_event(j)); }
-
-    if (!j || !j.is_a() || j.size() < 2 || !j[0].is_i()) {
-        std::cerr << "bad rpc: " << j << std::endl;
-        done(false);
+    rj = Json::array(0, 0, 0);
+    if (!j.is_a() || j.size() < 2 || !j[0].is_i()) {
+        rj[1] = j.is_a() ? j[1] : Json();
+        rj[2] = pq_fail;
+        rj[3] = Json();
+        done();
         return;
-    } else
-        // allow the server to read and start processing another
-        // rpc while this one is being handled (iff it blocks)
-        done(true);
+    }
 
     command = j[0].as_i();
     assert(ready_ || command == pq_control);
@@ -117,23 +186,34 @@ tamed void read_and_process_one(msgpack_fd* mpfd, pq::Server& server,
             rj[3] = it->value();
         else
             rj[3] = String();
+        server.record_load(key);
         break;
     }
     case pq_insert:
         twait { server.insert(j[2].as_s(), j[3].as_s(), make_event()); }
         rj[2] = pq_ok;
+        server.record_load(j[2].as_s());
         ++diff_.ninsert;
         break;
     case pq_erase:
         twait { server.erase(j[2].as_s(), make_event()); }
         rj[2] = pq_ok;
+        server.record_load(j[2].as_s());
         break;
     case pq_count:
         rj[2] = pq_ok;
         first = j[2].as_s(), last = j[3].as_s();
         scanlast = (j[4] && j[4].is_s()) ? j[4].as_s() : last;
+        parse_scan_options(j[5], limit, offset, reverse, fields);
+        if (limit && scanlast == last)
+            twait { server.limit_window(first, last, limit + offset, false, make_event(cut)); }
+        if (cut)
+            last = scanlast = cut;
         twait { server.validate(first, last, make_event(it)); }
-        rj[3] = std::distance(it, server.table_for(first, last).lower_bound(scanlast));
+        count = server.table_for(first, last).count(first, scanlast);
+        count = count > offset ? count - offset : 0;
+        rj[3] = limit ? std::min(count, limit) : count;
+        server.record_load(first);
         ++diff_.ncount;
         break;
     case pq_unsubscribe:
@@ -155,28 +235,106 @@ tamed void read_and_process_one(msgpack_fd* mpfd, pq::Server& server,
             rj[2] = pq_fail;
             break;
         }
+        binary = j[4]["binary"].as_b(false);
         first = j[2].as_s(), last = j[3].as_s(), scanlast = last;
-        assert(part_ && part_->owner(first) == me_->seqid());
+        assert(part_);
         ++diff_.nsubscribe;
+        // a peer that has not yet heard that some of the range moved gets
+        // each current owner's answer, and its subscriptions move with them
+        part_->analyze(first, last, 0, parts);
+        if (unlikely(parts.size() > 1
+                     || (parts[0].owner != me_->seqid() && parts[0].owner >= 0))) {
+            rj[2] = pq_ok;
+            parts.push_back(pq::keyrange(last, -1));
+            for (pi = 0; pi + 1 != parts.size(); ++pi) {
+                owner = parts[pi].owner;
+                if (owner == peer)
+                    continue;
+                else if (owner == me_->seqid() || owner < 0) {
+                    twait { server.validate(parts[pi].key, parts[pi + 1].key,
+                                            make_event(it)); }
+                    server.subscribe(parts[pi].key, parts[pi + 1].key, peer);
+                    for (auto itend = it.table_end();
+                         it != itend && it->key() < parts[pi + 1].key; ++it)
+                        push_scan_pair(aj, *it, scan_all);
+                } else {
+                    twait { server.interconnect(owner)->subscribe(parts[pi].key,
+                                                                  parts[pi + 1].key,
+                                                                  peer, make_event(res)); }
+                    for (auto rit = res.begin(); rit != res.end(); ++rit) {
+                        aj.push_back(rit->key());
+                        aj.push_back(rit->value());
+                    }
+                }
+            }
+            if (direct && binary) {
+                write_frame_scan_reply(mpfd, -command, j[1], aj);
+                rj = Json();
+            } else
+                rj[3] = aj;
+            break;
+        }
         goto do_scan;
     case pq_scan: {
         first = j[2].as_s(), last = j[3].as_s();
         scanlast = (j[4] && j[4].is_s()) ? j[4].as_s() : last;
+        parse_scan_options(j[5], limit, offset, reverse, fields);
 
         do_scan:
         rj[2] = pq_ok;
+        // a limited scan of a range no one has read yet computes only the
+        // window that holds its rows
+        if (limit && scanlast == last)
+            twait { server.limit_window(first, last, limit + offset, reverse, make_event(cut)); }
+        if (cut && reverse)
+            first = cut;
+        else if (cut)
+            last = scanlast = cut;
         twait { server.validate(first, last, make_event(it)); }
         if (unlikely(peer >= 0))
             server.subscribe(first, last, peer);
 
         auto itend = it.table_end();
-        assert(!aj.shared());
-        aj.clear();
-        while (it != itend && it->key() < scanlast) {
-            aj.push_back(it->key()).push_back(it->value());
-            ++it;
+        if (direct && binary) {
+            write_frame_scan_reply(mpfd, -command, j[1], it, itend, scanlast);
+            rj = Json();
+        } else if (direct && !limit && !offset && !reverse && fields == scan_all) {
+            // serialize from the store without building a Json
+            mpfd->write_scan_reply(-command, j[1], pq_ok, it, itend, scanlast);
+            rj = Json();
+        } else if (!reverse) {
+            if (offset)
+                it = server.table_for(first, last).seek(first, offset);
+            assert(!aj.shared());
+            aj.clear();
+            for (count = 0; it != itend && it->key() < scanlast
+                     && (!limit || count != limit); ++it, ++count)
+                push_scan_pair(aj, *it, fields);
+            if (cut)
+                next = cut;
+            else if (limit && count == limit && it != itend && it->key() < scanlast)
+                next = it->key();
+            rj[3] = aj;
+        } else {
+            // count the rows, seek to the oldest one returned, then reply
+            // newest first
+            assert(!aj.shared());
+            aj.clear();
+            count = server.table_for(first, last).count(first, scanlast);
+            count = count > offset ? count - offset : 0;
+            it = server.table_for(first, last).seek(first, limit && count > limit ? count - limit : 0);
+            rows.clear();
+            for (; rows.size() != count && (!limit || rows.size() != limit); ++it)
+                rows.push_back(it.operator->());
+            for (auto rit = rows.rbegin(); rit != rows.rend(); ++rit)
+                push_scan_pair(aj, **rit, fields);
+            if (!rows.empty() && (count > rows.size() || cut))
+                next = rows.front()->key();
+            rj[3] = aj;
         }
-        rj[3] = aj;
+        if (next)
+            rj[4] = next;
+        server.record_load(first);
         ++diff_.nscan;
         break;
     }
@@ -188,18 +346,66 @@ tamed void read_and_process_one(msgpack_fd* mpfd, pq::Server& server,
         break;
     case pq_notify_insert:
         key = j[2].as_s();
-        std::cout << "pq_notify_insert: " << key << std::endl; // subscription log
+        t0 = pq::Trace::start();
         server.table_for(key).insert(key, j[3].as_s());
+        pq::Trace::record(pq::trace_notify_insert, key, j[3].as_s().length(), t0);
         rj[2] = pq_ok;
         ++diff_.nnotify;
         break;
     case pq_notify_erase:
         key = j[2].as_s();
-        std::cout << "pq_notify_erase : " << key << std::endl; // subscription log
+        t0 = pq::Trace::start();
         server.table_for(key).erase(key);
+        pq::Trace::record(pq::trace_notify_erase, key, 0, t0);
         rj[2] = pq_ok;
         ++diff_.nnotify;
         break;
+    case pq_notify_batch:
+        t0 = pq::Trace::start();
+        if (j[2].is_s()) {
+            // a binary frame, applied from the read buffer
+            if (!frame.assign(j[2].as_s()) || !frame.size())
+                break;
+            server.apply_notify_batch(frame);
+            count = frame.size();
+            key = frame.begin().key();
+        } else {
+            if (!j[2].is_a() || j[2].size() % 2 || j[2].empty())
+                break;
+            server.apply_notify_batch(j[2]);
+            count = j[2].size() / 2;
+            key = j[2][0].as_s();
+        }
+        pq::Trace::record(pq::trace_notify_batch, key, count, t0);
+        rj[2] = pq_ok;
+        diff_.nnotify += count;
+        break;
+    case pq_migrate:
+        if (!j[2].is_s() || !j[3].is_s() || !j[4].is_o())
+            break;
+        first = j[2].as_s(), last = j[3].as_s();
+        if (!j[4]["phase"])
+            twait { server.migrate(first, last, j[4]["owner"].to_i(),
+                                   make_event(ok)); }
+        else if (j[4]["phase"] == "pull")
+            twait { server.migrate_pull(first, last, j[4]["from"].to_i(),
+                                        make_event(ok)); }
+        else if (j[4]["phase"] == "commit")
+            twait { server.migrate_commit(first, last, j[4]["from"].to_i(),
+                                          j[4]["subscriptions"], make_event(ok)); }
+        else if (j[4]["phase"] == "abort" || j[4]["phase"] == "done") {
+            server.migrate_done(first, last);
+            ok = true;
+        }
+        rj[2] = ok ? pq_ok : pq_fail;
+        break;
+    case pq_repartition:
+        if (!j[2].is_s() || !j[3].is_s() || !j[4].is_o())
+            break;
+        twait { server.repartition(j[2].as_s(), j[3].as_s(), j[4]["from"].to_i(),
+                                   j[4]["owner"].to_i(), make_event()); }
+        rj[2] = pq_ok;
+        break;
     case pq_stats:
         rj[2] = pq_ok;
         rj[3] = server.stats();
@@ -217,6 +423,8 @@ tamed void read_and_process_one(msgpack_fd* mpfd, pq::Server& server,
                 rj[3] = Json().set("backend", (part_) ? part_->is_backend(me_->seqid()) : false)
                               .set("data", log_.as_json())
                               .set("internal", server.logs());
+            else if (j[2]["get_load"])
+                rj[3] = Json().set("cpu", cpu_load_);
             else if (j[2]["write_log"])
                 log_.write_json(std::cerr);
             else if (j[2]["clear_log"])
@@ -262,7 +470,111 @@ tamed void read_and_process_one(msgpack_fd* mpfd, pq::Server& server,
     }
 
  finish:
-    mpfd->write(rj);
+    done();
+}
+
+// Find the reads starting at ops[i] that can be validated before any of
+// them is answered, and merge their ranges per table. Returns the index
+// just past the run.
+static size_t batch_read_ranges(pq::Server& server, const Json& ops, size_t i,
+                                std::vector<std::pair<String, String> >& ranges) {
+    typedef std::pair<pq::Table*, std::pair<String, String> > table_range;
+    std::vector<table_range> rs;
+    for (; i != ops.size(); ++i) {
+        const Json& op = ops[i];
+        if (!op.is_a() || !op[0].is_i() || !op[2].is_s())
+            break;
+        // limited reads may compute less than their range
+        if (op[5].is_o() && (op[5]["limit"] || op[5]["offset"]))
+            break;
+        String first = op[2].as_s(), last;
+        if (op[0].as_i() == pq_get && pq::table_name(first))
+            last = first + String("\0", 1);
+        else if ((op[0].as_i() == pq_scan || op[0].as_i() == pq_count)
+                 && op[3].is_s() && pq::table_name(first, op[3].as_s()))
+            last = op[3].as_s();
+        else
+            break;
+        rs.push_back(table_range(&server.table_for(first, last),
+                                 std::make_pair(first, last)));
+    }
+
+    std::sort(rs.begin(), rs.end());
+    ranges.clear();
+    for (size_t k = 0; k != rs.size(); ++k)
+        if (k && rs[k].first == rs[k - 1].first
+            && rs[k].second.first <= ranges.back().second) {
+            if (ranges.back().second < rs[k].second.second)
+                ranges.back().second = rs[k].second.second;
+        } else
+            ranges.push_back(rs[k].second);
+    return i;
+}
+
+tamed void process_batch(msgpack_fd* mpfd, pq::Server& server,
+                         const Json& ops, Json& results, tamer::event<> done) {
+    tvars {
+        size_t i = 0, k, run;
+        std::vector<std::pair<String, String> > ranges;
+        std::vector<pq::Table::iterator> its;
+        Json rj;
+    }
+
+    results = Json::make_array_reserve(ops.size());
+    while (i != ops.size()) {
+        // validate a run of reads together so their fetches overlap; the
+        // reads then find their ranges valid. writes run one at a time,
+        // in order, like separate rpcs
+        run = batch_read_ranges(server, ops, i, ranges);
+        if (ranges.size() > 1) {
+            its.resize(ranges.size());
+            twait {
+                for (k = 0; k != ranges.size(); ++k)
+                    server.validate(ranges[k].first, ranges[k].second,
+                                    make_event(its[k]));
+            }
+        }
+        if (run == i)
+            ++run;
+        for (; i != run; ++i) {
+            twait { process_one(mpfd, server, ops[i], rj, false,
+                                    make_event()); }
+            results.push_back(std::move(rj));
+        }
+    }
+    ++diff_.nbatch;
+    done();
+}
+
+tamed void read_and_process_one(msgpack_fd* mpfd, pq::Server& server,
+                                tamer::event<bool> done) {
+    tvars {
+        Json j, rj;
+    }
+
+    twait { mpfd->read_request(make_event(j)); }
+
+    if (!j || !j.is_a() || j.size() < 2 || !j[0].is_i()) {
+        std::cerr << "bad rpc: " << j << std::endl;
+        done(false);
+        return;
+    } else
+        // allow the server to read and start processing another
+        // rpc while this one is being handled (iff it blocks)
+        done(true);
+
+    if (j[0].as_i() == pq_batch) {
+        rj = Json::array(-pq_batch, j[1], pq_ok, Json());
+        if (j[2].is_a())
+            twait { process_batch(mpfd, server, j.get(2), rj.get_insert(3),
+                                  make_event()); }
+        else
+            rj[2] = pq_fail;
+    } else
+        twait { process_one(mpfd, server, j, rj, true, make_event()); }
+
+    if (rj)
+        mpfd->write(rj);
 }
 
 tamed void connector(tamer::fd cfd, msgpack_fd* mpfd, pq::Server& server) {
@@ -394,6 +706,9 @@ tamed void periodic_logger() {
         log_.record_at("utime_us", now, utime);
         log_.record_at("stime_us", now, stime);
         log_.record_at("cpu_pct", now, (before) ? ((utime + stime) * scale / fromus(now - before)) : 0);
+        if (before)
+            cpu_load_ = 0.5 * cpu_load_
+                + 0.5 * (utime + stime) * scale / fromus(now - before);
         log_.record_at("mem_max_rss_mb", now, pq::maxrss_mb(u.ru_maxrss));
         log_.record_at("mem_size_store_mb", now, pq::mem_store_size >> 20);
         log_.record_at("mem_size_other_mb", now, pq::mem_other_size >> 20);
@@ -404,6 +719,7 @@ tamed void periodic_logger() {
         log_.record_at("nscan", now, diff_.nscan);
         log_.record_at("ninvalidate", now, diff_.ninvalidate);
         log_.record_at("nnotify", now, diff_.nnotify);
+        log_.record_at("nbatch", now, diff_.nbatch);
 
         lu = u;
         before = now;
@@ -412,11 +728,64 @@ tamed void periodic_logger() {
     }
 }
 
+// Every rebalance_interval seconds, compare this server's CPU load with
+// that of its peers of the same kind (backing or cache). If it runs more
+// than rebalance_slack above their mean, move its busiest partition cell
+// that fits in half the gap to the least loaded peer; a bigger cell would
+// just make that peer the hot spot.
+tamed void rebalancer(pq::Server& server) {
+    tvars {
+        std::vector<Json> loads;
+        int32_t i, n, target;
+        double mean, gap;
+        String first, last;
+        bool ok;
+    }
+
+    while (true) {
+        twait volatile { tamer::at_delay(pq::Server::rebalance_interval,
+                                         make_event()); }
+
+        loads.assign(interconnect_.size(), Json());
+        twait {
+            for (i = 0; i != (int32_t) interconnect_.size(); ++i)
+                if (interconnect_[i]
+                    && part_->is_backend(i) == part_->is_backend(me_->seqid()))
+                    interconnect_[i]->control(Json().set("get_load", true),
+                                              make_event(loads[i]));
+        }
+
+        mean = cpu_load_, n = 1, target = -1;
+        for (i = 0; i != (int32_t) loads.size(); ++i)
+            if (loads[i].is_o()) {
+                mean += loads[i]["cpu"].to_d();
+                ++n;
+                if (target < 0 || loads[i]["cpu"].to_d() < loads[target]["cpu"].to_d())
+                    target = i;
+            }
+        mean /= n;
+        gap = target >= 0 ? cpu_load_ - loads[target]["cpu"].to_d() : 0;
+
+        if (cpu_load_ <= mean * (1 + pq::Server::rebalance_slack) || gap <= 0
+            || !server.take_load_range(gap / 2 / cpu_load_, first, last)) {
+            server.take_load_range(0, first, last);
+            continue;
+        }
+
+        std::cerr << "rebalance: moving [" << first << ", " << last
+                  << ") to " << target << " (load " << cpu_load_
+                  << "%, mean " << mean << "%)" << std::endl;
+        twait { server.migrate(first, last, target, make_event(ok)); }
+        if (!ok)
+            std::cerr << "rebalance: move failed" << std::endl;
+    }
+}
+
 } // namespace
 
 tamed void server_loop(pq::Server& server, int port, bool kill,
                        const pq::Hosts* hosts, const pq::Host* me,
-                       const pq::Partitioner* part, uint32_t round_robin) {
+                       pq::Partitioner* part, uint32_t round_robin) {
     tvars {
         tamer::fd killer;
         bool connected = false;
@@ -440,7 +809,9 @@ tamed void server_loop(pq::Server& server, int port, bool kill,
         mandatory_assert(part && me);
         part_ = part;
         me_ = me;
-        interconnect_.assign(hosts->size(), nullptr);
+        // sharded servers arrive with their interconnect already in place
+        if (interconnect_.size() != (size_t) hosts->size())
+            interconnect_.assign(hosts->size(), nullptr);
     }
 
     std::cerr << "listening on port " << port << "\n";
@@ -455,12 +826,36 @@ tamed void server_loop(pq::Server& server, int port, bool kill,
         } while(!connected);
 
         server.set_cluster_details(me_->seqid(), interconnect_, part_);
+        if (pq::Server::rebalance_interval > 0)
+            rebalancer(server);
     }
 
     ready_ = true;
     interrupt_catcher();
 }
 
+// Run one shard of a sharded server. Shards on the same host are wired
+// together with socketpairs created before fork, so there is no TCP
+// connection setup: initialize_interconnect finds every peer present.
+void shard_server_loop(pq::Server& server, int port,
+                       const pq::Hosts* hosts, const pq::Host* me,
+                       pq::Partitioner* part, const std::vector<int>& peerfds,
+                       uint32_t round_robin) {
+    mandatory_assert(peerfds.size() == (size_t) hosts->size());
+    interconnect_.assign(hosts->size(), nullptr);
+
+    for (int32_t i = 0; i < hosts->size(); ++i) {
+        if (i == me->seqid())
+            continue;
+        tamer::fd fd(peerfds[i]);
+        interconnect_[i] = new pq::Interconnect(fd, i);
+        interconnect_[i]->set_wrlowat(1 << 12);
+        connector(fd, interconnect_[i]->fd(), server);
+    }
+
+    server_loop(server, port, false, hosts, me, part, round_robin);
+}
+
 tamed void block_report_loop(int32_t delay) {
     while (1) {
         twait { tamer::at_delay(delay, make_event(), true); }
@@ -8,6 +8,12 @@ namespace pq {
 uint64_t ServerRangeBase::allocated_key_bytes = 0;
 uint64_t Sink::invalidate_hit_keys = 0;
 uint64_t Sink::invalidate_miss_keys = 0;
+uint32_t Sink::deferred_max = 256;
+uint64_t Sink::ndeferred = 0;
+uint64_t Sink::nreplayed = 0;
+uint64_t Sink::nreplay_full = 0;
+uint32_t Sink::adaptive_writes = 8;
+uint64_t Sink::ncold_dropped = 0;
 
 Loadable::Loadable(Table* table) : table_(table) {
 }
@@ -15,22 +21,33 @@ Loadable::Loadable(Table* table) : table_(table) {
 Loadable::~Loadable() {
 }
 
-Evictable::Evictable() : evicted_(false), last_access_(0) {
+Evictable::Evictable()
+    : evicted_(false), naccess_(0), last_access_(0), cost_(0), bytes_(0),
+      credit_(0), index_(nullptr), index_pos_(0) {
 }
 
 Evictable::~Evictable() {
+    if (index_)
+        index_->remove(this);
 }
 
 uint32_t Evictable::priority() const {
     return pri_none;
 }
 
+Table* Evictable::evict_table() const {
+    return nullptr;
+}
+
 void Evictable::unlink() {
     lru_hook::unlink();
+    table_lru_hook_.unlink();
+    if (index_)
+        index_->remove(this);
 }
 
 bool Evictable::is_linked() const {
-    return lru_hook::is_linked();
+    return lru_hook::is_linked() || index_;
 }
 
 JoinRange::JoinRange(Str first, Str last, Join* join)
@@ -38,7 +55,10 @@ JoinRange::JoinRange(Str first, Str last, Join* join)
 }
 
 SinkRange::SinkRange(Str first, Str last, Table* table)
-    : ServerRangeBase(first, last), table_(table) {
+    : ServerRangeBase(first, last), table_(table), measure_(false), nread_(0),
+      cost_at_(0) {
+    if (table_)
+        table_->account_range<SinkRange>(&Table::mem_log::sink_ranges, 1);
 }
 
 SinkRange::~SinkRange() {
@@ -46,6 +66,8 @@ SinkRange::~SinkRange() {
         (*it)->invalidate();
         (*it)->deref();
     }
+    if (table_)
+        table_->account_range<SinkRange>(&Table::mem_log::sink_ranges, -1);
 }
 
 struct SinkRange::validate_args {
@@ -75,6 +97,7 @@ bool SinkRange::add_sink(JoinRange* jr, Server& server,
                          tamer::gather_rendezvous& gr) {
 
     //std::cerr << "add_sink " << ibegin() << ", " << iend() << "\n";
+    uint64_t t0 = server.measures_cost() ? tstamp() : 0;
     Sink* sink = new Sink(jr, this);
     sinks_.push_back(sink);
     sink->ref();
@@ -87,7 +110,12 @@ bool SinkRange::add_sink(JoinRange* jr, Server& server,
 
     log |= ValidateRecord::compute;
 
-    return validate_step(va, 0);
+    sink->validating_ = true;
+    bool complete = validate_step(va, 0);
+    sink->validating_ = false;
+    if (t0)
+        add_cost(now, tstamp() - t0);
+    return complete;
 }
 
 bool SinkRange::validate(Str first, Str last, Server& server,
@@ -99,12 +127,36 @@ bool SinkRange::validate(Str first, Str last, Server& server,
     for (auto sit = sinks_.begin(); sit != sinks_.end(); ++sit)
         complete &= (*sit)->validate(first, last, server, now, log, gr);
 
-    if (complete)
+    if (complete) {
+        if (measure_)
+            measure();
+        note_read();
         server.lru_touch(this);
+    }
 
     return complete;
 }
 
+uint32_t SinkRange::purge(uint32_t max, bool& more) {
+    uint32_t n = 0;
+    more = false;
+    for (auto it = sinks_.begin(); it != sinks_.end(); ++it) {
+        if (n < max)
+            n += (*it)->purge(max - n);
+        more |= (*it)->valid() && !(*it)->data_.empty();
+    }
+    return n;
+}
+
+void SinkRange::measure() {
+    uint64_t bytes = 0;
+    auto it = table_->lower_bound(ibegin());
+    for (auto itend = it.table_end(); it != itend && it->key() < iend(); ++it)
+        bytes += it->key().length() + it->value().length();
+    set_bytes(bytes);
+    measure_ = false;
+}
+
 bool SinkRange::validate_filters(validate_args& va) {
     bool complete = true;
     int filters = va.filters;
@@ -175,50 +227,48 @@ bool SinkRange::validate_step(validate_args& va, int joinpos) {
     if (it != itend) {
         Match::state mstate(va.rm.match.save());
         const Pattern& pat = join->source(joinpos);
+        PatternFilter patfilter(pat, va.rm.match);
         ++sourcet->nvalidate_;
 
         // match not optimizable
         if (!r) {
             for (; it != itend && it->key() < Str(kl, kllen); ++it)
-                if (it->key().length() == pat.key_length()) {
+                if (patfilter.match(it->key())) {
                     //std::cerr << "consider " << *it << "\n";
-                    if (pat.match(it->key(), va.rm.match))
-                        complete &= validate_step(va, joinpos + 1);
+                    pat.assign_match(it->key(), va.rm.match);
+                    complete &= validate_step(va, joinpos + 1);
                     va.rm.match.restore(mstate);
                 }
         } else if (va.filters) {
             bool filters_validated = false;
             uint8_t filterstr[key_capacity];
             for (; it != itend && it->key() < Str(kl, kllen); ++it)
-                if (it->key().length() == pat.key_length()) {
-                    if (pat.match(it->key(), va.rm.match)) {
-                        //std::cerr << "consider match " << *it << "\n";
-                        if (!filters_validated) {
-                            complete &= validate_filters(va);
-                            filters_validated = true;
-                        }
-                        if (!complete)
-                            break;
-                        int filters = va.filters;
-                        for (int jp = 0; filters; ++jp, filters >>= 1)
-                            if (filters & 1) {
-                                int filterlen = join->source(jp).expand(filterstr, va.rm.match);
-                                //std::cerr << "validate " << Str(filterstr, filterlen) << "\n";
-                                if (!va.sourcet[jp]->count(Str(filterstr, filterlen)))
-                                    goto give_up;
-                            }
-                        r->notify(it.operator->(), String(), va.notifier);
+                if (patfilter.match(it->key())) {
+                    pat.assign_match(it->key(), va.rm.match);
+                    //std::cerr << "consider match " << *it << "\n";
+                    if (!filters_validated) {
+                        complete &= validate_filters(va);
+                        filters_validated = true;
                     }
+                    if (!complete)
+                        break;
+                    int filters = va.filters;
+                    for (int jp = 0; filters; ++jp, filters >>= 1)
+                        if (filters & 1) {
+                            int filterlen = join->source(jp).expand(filterstr, va.rm.match);
+                            //std::cerr << "validate " << Str(filterstr, filterlen) << "\n";
+                            if (!va.sourcet[jp]->count(Str(filterstr, filterlen)))
+                                goto give_up;
+                        }
+                    r->notify(it.operator->(), String(), va.notifier);
                 give_up:
                     va.rm.match.restore(mstate);
                 }
         } else if (join->maintained() || (!join->maintained() && va.complete)) {
             for (; it != itend && it->key() < Str(kl, kllen); ++it)
-                if (it->key().length() == pat.key_length()) {
+                if (patfilter.match(it->key())) {
                     //std::cerr << "consider " << *it << "\n";
-                    if (pat.match(it->key(), va.rm.match))
-                        r->notify(it.operator->(), String(), va.notifier);
-                    va.rm.match.restore(mstate);
+                    r->notify(it.operator->(), String(), va.notifier);
                 }
         }
 
@@ -254,6 +304,10 @@ void SinkRange::evict() {
     table_->evict_sink(this);
 }
 
+Table* SinkRange::evict_table() const {
+    return table_;
+}
+
 uint32_t SinkRange::priority() const {
     return pri_sink;
 }
@@ -277,7 +331,8 @@ Restart::Restart(Sink* sink, int joinpos, const Match& m, int notifier)
 Sink::Sink(JoinRange* jr, SinkRange* sr)
     : valid_(true), validating_(false),
       table_(sr->table_), hint_{nullptr}, dangerous_slot_(0),
-      expires_at_(0), refcount_(0), data_free_(uintptr_t(-1)),
+      expires_at_(0), nwrite_(0), read_at_(0), cold_(false),
+      refcount_(0), data_free_(uintptr_t(-1)),
       jr_(jr), sr_(sr) {
 
     Join* j = jr_->join();
@@ -431,6 +486,13 @@ bool Sink::validate(Str first, Str last, Server& server,
                     uint64_t now, uint32_t& log, tamer::gather_rendezvous& gr) {
     bool complete = true;
 
+    if (need_replay()) {
+        log |= ValidateRecord::update;
+        replay();
+        if (server.measures_cost())
+            sr_->set_measure();
+    }
+
     assert(!validating_);
     validating_ = true;
 
@@ -446,15 +508,67 @@ bool Sink::validate(Str first, Str last, Server& server,
         valid_ = true;
     }
 
-    if (need_restart())
-        complete &= restart(first, last, server, now, log, gr);
-    if (!need_restart() && need_update())
-        complete &= update(first, last, server, now, log, gr);
+    if (need_restart() || need_update()) {
+        // only recomputation counts toward what the range would cost to
+        // bring back; updates just change its size
+        uint64_t t0 = server.measures_cost() ? tstamp() : 0;
+        bool restarting = need_restart();
+        if (restarting)
+            complete &= restart(first, last, server, now, log, gr);
+        if (!need_restart() && need_update())
+            complete &= update(first, last, server, now, log, gr);
+        if (t0 && restarting)
+            sr_->add_cost(now, tstamp() - t0);
+        else if (t0)
+            sr_->set_measure();
+    }
 
     validating_ = false;
     return complete;
 }
 
+void Sink::defer(SourceRange* source, Str sink_key, const Datum* src,
+                 const String& old_value, int notifier) {
+    if (!cold_ && deferred_.size() >= deferred_max) {
+        if (join()->adaptive()) {
+            // a cold sink's range is dropped, so replaying is wasted work.
+            // marked evicted, it is computed anew if read before then
+            cold_ = true;
+            for (auto& du : deferred_)
+                delete du.src;
+            deferred_.clear();
+            sr_->mark_evicted();
+            join()->server().note_cold_sink(this);
+        } else {
+            ++nreplay_full;
+            replay();
+            if (!valid())
+                return;
+        }
+    }
+    if (!cold_) {
+        deferred_.push_back(deferred_update{source, new Datum(src->key(), src->value()),
+                                            old_value, sink_key, notifier});
+        ++ndeferred;
+    }
+    // sinks computed from this one must look here before reading it
+    table_->invalidate_dependents(sink_key);
+}
+
+void Sink::replay() {
+    std::vector<deferred_update> log;
+    log.swap(deferred_);
+    auto it = log.begin();
+    // applying an update can invalidate the sink, which drops the rest
+    for (; it != log.end() && valid(); ++it) {
+        it->source->notify(it->sink_key, this, it->src, it->old_value, it->notifier);
+        delete it->src;
+        ++nreplayed;
+    }
+    for (; it != log.end(); ++it)
+        delete it->src;
+}
+
 void Sink::invalidate() {
     if (valid() && !validating_) {
         while (data_free_ != uintptr_t(-1)) {
@@ -486,8 +600,43 @@ void Sink::invalidate() {
     }
 }
 
+// Erase up to `max` outputs, newest first, leaving the sink valid but
+// incomplete.
+uint32_t Sink::purge(uint32_t max) {
+    if (!valid() || validating_)
+        return 0;
+
+    while (data_free_ != uintptr_t(-1)) {
+        uintptr_t pos = data_free_;
+        data_free_ = (uintptr_t) data_[pos];
+        data_[pos] = 0;
+    }
+    if (hint_) {
+        hint_->deref();
+        hint_ = nullptr;
+    }
+
+    Table* t = table();
+    uint32_t n = 0;
+    while (n < max && !data_.empty()) {
+        Datum* d = data_.back();
+        data_.pop_back();
+        if (d) {
+            t->invalidate_erase(d);
+            ++invalidate_hit_keys;
+            ++n;
+        }
+    }
+    return n;
+}
+
 PersistedRange::PersistedRange(Table* table, Str first, Str last)
-    : ServerRangeBase(first, last), Loadable(table) {
+    : ServerRangeBase(first, last), Loadable(table), loaded_(first) {
+    table_->account_range<PersistedRange>(&Table::mem_log::other_ranges, 1);
+}
+
+PersistedRange::~PersistedRange() {
+    table_->account_range<PersistedRange>(&Table::mem_log::other_ranges, -1);
 }
 
 void PersistedRange::evict() {
@@ -499,8 +648,34 @@ uint32_t PersistedRange::priority() const {
     return pri_persistent;
 }
 
+Table* PersistedRange::evict_table() const {
+    return table_;
+}
+
+void PersistedRange::add_waiting_loaded(Str last, tamer::event<> w) {
+    if (last <= loaded_)
+        w();
+    else
+        waiting_loaded_.push_back(std::make_pair(String(last), w));
+}
+
+void PersistedRange::set_loaded(Str key) {
+    loaded_ = key;
+    for (auto it = waiting_loaded_.begin(); it != waiting_loaded_.end(); )
+        if (it->first <= loaded_) {
+            it->second();
+            it = waiting_loaded_.erase(it);
+        } else
+            ++it;
+}
+
 RemoteRange::RemoteRange(Table* table, Str first, Str last, int32_t owner)
     : ServerRangeBase(first, last), Loadable(table), owner_(owner) {
+    table_->account_range<RemoteRange>(&Table::mem_log::other_ranges, 1);
+}
+
+RemoteRange::~RemoteRange() {
+    table_->account_range<RemoteRange>(&Table::mem_log::other_ranges, -1);
 }
 
 void RemoteRange::evict() {
@@ -512,6 +687,10 @@ uint32_t RemoteRange::priority() const {
     return pri_remote;
 }
 
+Table* RemoteRange::evict_table() const {
+    return table_;
+}
+
 RemoteSink::RemoteSink(Interconnect* conn, uint32_t peer)
     : Sink(new JoinRange("", "}", nullptr), new SinkRange("", "}", nullptr)),
       conn_(conn), peer_(peer) {
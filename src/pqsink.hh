@@ -9,6 +9,7 @@
 #include "pqdatum.hh"
 #include <tamer/tamer.hh>
 #include <list>
+#include <vector>
 
 namespace pq {
 class Server;
@@ -16,6 +17,7 @@ class Match;
 class RangeMatch;
 class JoinRange;
 class Sink;
+class SourceRange;
 class Interconnect;
 
 class ServerRangeBase {
@@ -31,6 +33,9 @@ class ServerRangeBase {
 
     static uint64_t allocated_key_bytes;
 
+    static inline void* operator new(size_t sz);
+    static inline void operator delete(void* p, size_t sz);
+
   protected:
     LocalStr<24> ibegin_;
     LocalStr<24> iend_;
@@ -39,6 +44,9 @@ class ServerRangeBase {
 
 namespace bi = boost::intrusive;
 typedef bi::list_base_hook<bi::link_mode<bi::auto_unlink>> lru_hook;
+typedef bi::list_member_hook<bi::link_mode<bi::auto_unlink>> table_lru_hook;
+
+class EvictionIndex;
 
 class Evictable : public lru_hook {
   public:
@@ -46,20 +54,68 @@ class Evictable : public lru_hook {
     virtual ~Evictable();
 
     enum { pri_none = 0, pri_persistent, pri_sink, pri_remote, pri_max };
+    enum { access_decay = 1000000 };    // halve access counts every second
 
     virtual void evict() = 0;
     virtual uint32_t priority() const;
+    virtual Table* evict_table() const;
 
     inline void mark_evicted();
     inline bool evicted() const;
     inline uint64_t last_access() const;
     inline void set_last_access(uint64_t now);
+    inline uint32_t access_count(uint64_t now) const;
+    inline void touch(uint64_t now);
     void unlink();
     bool is_linked() const;
 
+    // What it would take to bring this range back once evicted: the
+    // measured microseconds of its last computation or fetch, and the
+    // bytes of data it holds. Only measured under GreedyDual eviction;
+    // eviction resets both.
+    inline uint64_t cost() const;
+    inline uint64_t bytes() const;
+    inline void set_cost(uint64_t cost, uint64_t bytes);
+    inline void set_bytes(uint64_t bytes);
+
+    // GreedyDual credit: `base` plus the cost per byte at the last touch.
+    inline double credit() const;
+    inline void set_credit(double base);
+
   private:
     bool evicted_;
+    uint32_t naccess_;
     uint64_t last_access_;
+    uint64_t cost_;
+    uint64_t bytes_;
+    double credit_;
+    EvictionIndex* index_;
+    uint32_t index_pos_;
+  public:
+    table_lru_hook table_lru_hook_;     // in its top-level table's LRU
+
+    friend class EvictionIndex;
+};
+
+// Evictables of one priority class kept in a dense array, so a uniform
+// sample costs O(1). Each entry remembers its position, which makes
+// removal a swap with the last entry.
+class EvictionIndex {
+  public:
+    inline EvictionIndex();
+    inline ~EvictionIndex();
+
+    inline size_t size() const;
+    inline bool empty() const;
+    inline Evictable* operator[](size_t i) const;
+    inline void insert(Evictable* e);
+    inline void remove(Evictable* e);
+
+  private:
+    std::vector<Evictable*> v_;
+
+    EvictionIndex(const EvictionIndex&) = delete;
+    EvictionIndex& operator=(const EvictionIndex&) = delete;
 };
 
 class Loadable {
@@ -129,12 +185,29 @@ class SinkRange : public ServerRangeBase, public Evictable {
 
     virtual void evict();
     virtual uint32_t priority() const;
+    virtual Table* evict_table() const;
+
+    // Charge `cost` microseconds to the computation made by the validation
+    // at `now`; a later validation's computation replaces the old cost.
+    inline void add_cost(uint64_t now, uint64_t cost);
+    // Erase up to `max` of the range's outputs and return how many; set
+    // `more` if some remain. The range must not be read again.
+    uint32_t purge(uint32_t max, bool& more);
+    // Recount the bytes held once a computation completes.
+    void measure();
+    inline void set_measure();
+
+    inline uint32_t nread() const;
+    inline void note_read();
 
   public:
     rblinks<SinkRange> rblinks_;
   private:
     Table* table_;
     local_vector<Sink*, 4> sinks_;
+    bool measure_;
+    uint32_t nread_;
+    uint64_t cost_at_;
 
     struct validate_args;
     bool validate_step(validate_args& va, int joinpos);
@@ -157,6 +230,7 @@ class Sink {
 
     inline bool valid() const;
     void invalidate();
+    uint32_t purge(uint32_t max);
 
     inline Join* join() const;
     inline SinkRange* range() const;
@@ -187,6 +261,23 @@ class Sink {
     bool validate(Str first, Str last, Server& server,
                  uint64_t now, uint32_t& log, tamer::gather_rendezvous& gr);
 
+    // Deferred joins log source changes here instead of applying them;
+    // the log is replayed when the sink is next validated, or as soon as
+    // it holds deferred_max entries.
+    inline bool validating() const;
+    inline bool need_replay() const;
+    void defer(SourceRange* source, Str sink_key, const Datum* src,
+               const String& old_value, int notifier);
+    void replay();
+
+    // Adaptive joins push changes to a sink until it has seen
+    // adaptive_writes of them since its range was last read, then defer
+    // the rest. A sink whose log fills before the next read is cold: its
+    // log is discarded unapplied and the server drops its range, which is
+    // recomputed on demand.
+    inline bool note_write();
+    inline bool cold() const;
+
     inline void update_hint(const ServerStore& store, ServerStore::iterator hint) const;
     inline Datum* hint() const;
 
@@ -194,8 +285,22 @@ class Sink {
 
     static uint64_t invalidate_hit_keys;
     static uint64_t invalidate_miss_keys;
+    static uint32_t deferred_max;
+    static uint64_t ndeferred;
+    static uint64_t nreplayed;
+    static uint64_t nreplay_full;
+    static uint32_t adaptive_writes;
+    static uint64_t ncold_dropped;
 
   private:
+    struct deferred_update {
+        SourceRange* source;
+        Datum* src;             // copy of the source key and value
+        String old_value;
+        String sink_key;
+        int notifier;
+    };
+
     bool valid_;
     bool validating_;
     Table* table_;
@@ -206,6 +311,10 @@ class Sink {
     uint64_t expires_at_;
     interval_tree<IntermediateUpdate> updates_;
     std::list<Restart*> restarts_;
+    std::vector<deferred_update> deferred_;
+    uint32_t nwrite_;
+    uint32_t read_at_;
+    bool cold_;
     int refcount_;
     mutable uintptr_t data_free_;
     mutable local_vector<Datum*, 12> data_;
@@ -216,6 +325,8 @@ class Sink {
     bool update_iu(Str first, Str last, IntermediateUpdate* iu, bool& remaining,
                    Server& server, uint64_t now, uint32_t& log,
                    tamer::gather_rendezvous& gr);
+
+    friend class SinkRange;
 };
 
 class JoinRange : public ServerRangeBase {
@@ -233,21 +344,35 @@ class JoinRange : public ServerRangeBase {
 class PersistedRange : public ServerRangeBase, public Loadable, public Evictable {
   public:
     PersistedRange(Table* table, Str first, Str last);
+    ~PersistedRange();
 
     virtual void evict();
     virtual uint32_t priority() const;
+    virtual Table* evict_table() const;
+
+    // A fetch loads the range in key order: [ibegin(), loaded()) is
+    // already in the table while the rest is pending.
+    inline Str loaded() const;
+    void add_waiting_loaded(Str last, tamer::event<> w);
+    void set_loaded(Str key);
 
   public:
     rblinks<PersistedRange> rblinks_;
+  private:
+    String loaded_;
+    std::list<std::pair<String, tamer::event<>>> waiting_loaded_;
 };
 
 class RemoteRange : public ServerRangeBase, public Loadable, public Evictable {
   public:
     RemoteRange(Table* table, Str first, Str last, int32_t owner);
+    ~RemoteRange();
 
     inline int32_t owner() const;
+    inline void set_owner(int32_t owner);
     virtual void evict();
     virtual uint32_t priority() const;
+    virtual Table* evict_table() const;
 
   public:
     rblinks<RemoteRange> rblinks_;
@@ -274,6 +399,14 @@ class RemoteSink : public Sink {
 };
 
 
+inline void* ServerRangeBase::operator new(size_t sz) {
+    return range_pool.allocate(sz);
+}
+
+inline void ServerRangeBase::operator delete(void* p, size_t sz) {
+    range_pool.deallocate(p, sz);
+}
+
 inline ServerRangeBase::ServerRangeBase(Str first, Str last)
     : ibegin_(first), iend_(last) {
     if (!ibegin_.is_local())
@@ -321,8 +454,13 @@ inline Table* Loadable::table() const {
     return table_;
 }
 
+inline Str PersistedRange::loaded() const {
+    return loaded_;
+}
+
 inline void Evictable::mark_evicted() {
     evicted_ = true;
+    cost_ = bytes_ = 0;
 }
 
 inline bool Evictable::evicted() const {
@@ -337,13 +475,107 @@ inline void Evictable::set_last_access(uint64_t now) {
     last_access_ = now;
 }
 
+inline uint32_t Evictable::access_count(uint64_t now) const {
+    uint64_t periods = (now - last_access_) / access_decay;
+    return periods >= 32 ? 0 : naccess_ >> periods;
+}
+
+inline void Evictable::touch(uint64_t now) {
+    naccess_ = access_count(now);
+    if (naccess_ != uint32_t(-1))
+        ++naccess_;
+    last_access_ = now;
+}
+
+inline uint64_t Evictable::cost() const {
+    return cost_;
+}
+
+inline uint64_t Evictable::bytes() const {
+    return bytes_;
+}
+
+inline void Evictable::set_cost(uint64_t cost, uint64_t bytes) {
+    cost_ = cost;
+    bytes_ = bytes;
+}
+
+inline void Evictable::set_bytes(uint64_t bytes) {
+    bytes_ = bytes;
+}
+
+inline double Evictable::credit() const {
+    return credit_;
+}
+
+inline void Evictable::set_credit(double base) {
+    credit_ = base + double(cost_) / (bytes_ ? bytes_ : 1);
+}
+
+inline EvictionIndex::EvictionIndex() {
+}
+
+inline EvictionIndex::~EvictionIndex() {
+    for (auto e : v_)
+        e->index_ = nullptr;
+}
+
+inline size_t EvictionIndex::size() const {
+    return v_.size();
+}
+
+inline bool EvictionIndex::empty() const {
+    return v_.empty();
+}
+
+inline Evictable* EvictionIndex::operator[](size_t i) const {
+    return v_[i];
+}
+
+inline void EvictionIndex::insert(Evictable* e) {
+    assert(!e->index_);
+    e->index_ = this;
+    e->index_pos_ = v_.size();
+    v_.push_back(e);
+}
+
+inline void EvictionIndex::remove(Evictable* e) {
+    assert(e->index_ == this && v_[e->index_pos_] == e);
+    Evictable* back = v_.back();
+    back->index_pos_ = e->index_pos_;
+    v_[e->index_pos_] = back;
+    v_.pop_back();
+    e->index_ = nullptr;
+}
+
+inline void SinkRange::add_cost(uint64_t now, uint64_t cost) {
+    if (now != cost_at_) {
+        cost_at_ = now;
+        set_cost(cost, bytes());
+    } else
+        set_cost(this->cost() + cost, bytes());
+    measure_ = true;
+}
+
+inline void SinkRange::set_measure() {
+    measure_ = true;
+}
+
+inline uint32_t SinkRange::nread() const {
+    return nread_;
+}
+
+inline void SinkRange::note_read() {
+    ++nread_;
+}
+
 inline bool SinkRange::valid(uint64_t now) const {
 
     for (auto sit = sinks_.begin(); sit != sinks_.end(); ++sit) {
         Sink* sink = *sit;
 
-        if (!sink->valid() || sink->need_restart() || 
-                sink->need_update() || sink->has_expired(now))
+        if (!sink->valid() || sink->need_restart() || sink->need_update()
+                || sink->need_replay() || sink->has_expired(now))
             return false;
     }
 
@@ -405,6 +637,9 @@ inline void Sink::clear_updates() {
     for (auto it = restarts_.begin(); it != restarts_.end(); ++it)
         delete *it;
     restarts_.clear();
+    for (auto& du : deferred_)
+        delete du.src;
+    deferred_.clear();
 }
 
 inline bool Sink::has_expired(uint64_t now) const {
@@ -444,6 +679,27 @@ inline bool Sink::need_restart() const {
     return !restarts_.empty();
 }
 
+inline bool Sink::validating() const {
+    return validating_;
+}
+
+inline bool Sink::need_replay() const {
+    return !deferred_.empty();
+}
+
+inline bool Sink::note_write() {
+    if (sr_->nread() != read_at_) {
+        read_at_ = sr_->nread();
+        nwrite_ = 0;
+        cold_ = false;
+    }
+    return ++nwrite_ > adaptive_writes;
+}
+
+inline bool Sink::cold() const {
+    return cold_ && valid() && sr_->nread() == read_at_;
+}
+
 inline void Sink::update_hint(const ServerStore& store, ServerStore::iterator hint) const {
 #if HAVE_HINT_ENABLED
     Datum* hd = hint == store.end() ? 0 : hint.operator->();
@@ -486,6 +742,10 @@ inline int32_t RemoteRange::owner() const {
     return owner_;
 }
 
+inline void RemoteRange::set_owner(int32_t owner) {
+    owner_ = owner;
+}
+
 inline Interconnect* RemoteSink::conn() const {
     return conn_;
 }
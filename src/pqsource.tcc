@@ -1,6 +1,8 @@
 #include "pqsource.hh"
 #include "pqserver.hh"
 #include "pqinterconnect.hh"
+#include "straccum.hh"
+#include <algorithm>
 #include <typeinfo>
 
 namespace pq {
@@ -85,11 +87,13 @@ bool SourceRange::check_match(Str key) const {
 
 void SourceRange::notify(const Datum* src, const String& old_value, int notifier) {
     using std::swap;
+    // a sink whose range is being evicted in chunks is dropped: validation
+    // computes that range anew
     result* endit = results_.end();
     for (result* it = results_.begin(); it != endit; ) {
         if (it + 1 != endit)
             (it + 1)->sink->prefetch();
-        if (it->sink->valid()) {
+        if (it->sink->valid() && !it->sink->range()->evicted()) {
             it->sink->table()->prefetch();
             unsigned sink_mask = it->sink ? it->sink->context_mask() : 0;
             if (sink_mask)
@@ -97,7 +101,7 @@ void SourceRange::notify(const Datum* src, const String& old_value, int notifier
             if (it->context)
                 join_->expand_sink_key_context(it->context);
             join_->expand_sink_key_source(src->key(), sink_mask);
-            notify(join_->sink_key(), it->sink, src, old_value, notifier);
+            deliver(join_->sink_key(), it->sink, src, old_value, notifier);
             ++it;
         } else {
             it->sink->deref();
@@ -191,6 +195,11 @@ void SubscribedRange::kill() {
     delete this;
 }
 
+void SubscribedRange::peers(std::vector<int32_t>& out) const {
+    for (result* it = results_.begin(); it != results_.end(); ++it)
+        out.push_back(reinterpret_cast<RemoteSink*>(it->sink)->peer());
+}
+
 bool SubscribedRange::check_match(Str) const {
     return true;
 }
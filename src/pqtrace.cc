@@ -0,0 +1,107 @@
+#include "pqtrace.hh"
+#include "MurmurHash3.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+
+namespace pq {
+
+std::atomic<bool> Trace::enabled_(false);
+std::atomic<Trace::ring*> Trace::rings_(nullptr);
+thread_local Trace::ring* Trace::my_ring_ = nullptr;
+int Trace::nthreads_ = 1;
+int Trace::nrings_ = 0;
+std::mutex Trace::spare_lock_;
+std::vector<Trace::ring*> Trace::spare_;
+
+void Trace::enable(bool on) {
+    if (on)
+        make_rings();
+    enabled_.store(on, std::memory_order_relaxed);
+}
+
+void Trace::add_threads(int n) {
+    nthreads_ += n;
+    if (enabled())
+        make_rings();
+}
+
+void Trace::make_rings() {
+    // rings are never freed: a dump may still be reading one
+    while (nrings_ < nthreads_) {
+        ring* r = new ring;
+        r->head.store(0, std::memory_order_relaxed);
+        r->next = rings_.load(std::memory_order_relaxed);
+        rings_.store(r, std::memory_order_release);
+        std::lock_guard<std::mutex> guard(spare_lock_);
+        spare_.push_back(r);
+        ++nrings_;
+    }
+}
+
+Trace::ring* Trace::claim_ring() {
+    std::lock_guard<std::mutex> guard(spare_lock_);
+    if (spare_.empty())
+        return nullptr;
+    ring* r = spare_.back();
+    spare_.pop_back();
+    return r;
+}
+
+void Trace::record(int op, const char* key, int klen, uint32_t count,
+                   uint64_t start) {
+    if (!enabled())
+        return;
+    if (!my_ring_ && !(my_ring_ = claim_ring()))
+        return;
+
+    ring* r = my_ring_;
+    uint64_t h = r->head.load(std::memory_order_relaxed);
+    TraceRecord& tr = r->rec[h % ring_size];
+    tr.time = tstamp();
+    tr.latency = tr.time - start;
+    tr.op = op;
+    tr.klen = klen;
+    MurmurHash3_x86_32(key, klen, 112181, &tr.khash);
+    tr.count = count;
+    r->head.store(h + 1, std::memory_order_release);
+}
+
+ssize_t Trace::dump(const String& filename) {
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return -1;
+
+    ssize_t nrec = 0;
+    for (ring* r = rings_.load(); r; r = r->next) {
+        uint64_t h = r->head.load(std::memory_order_acquire);
+        uint64_t first = h > ring_size ? h - ring_size : 0;
+        for (uint64_t i = first; i != h; ) {
+            // write up to the end of the ring in one call
+            uint64_t n = std::min(h - i, ring_size - i % ring_size);
+            ssize_t w = write(fd, &r->rec[i % ring_size], n * sizeof(TraceRecord));
+            if (w != (ssize_t) (n * sizeof(TraceRecord))) {
+                close(fd);
+                return -1;
+            }
+            i += n;
+            nrec += n;
+        }
+    }
+
+    close(fd);
+    return nrec;
+}
+
+Json Trace::stats() {
+    uint64_t nrec = 0, nrings = 0;
+    for (ring* r = rings_.load(); r; r = r->next) {
+        nrec += r->head.load(std::memory_order_relaxed);
+        ++nrings;
+    }
+    return Json().set("trace_enabled", enabled())
+        .set("trace_records", nrec)
+        .set("trace_rings", nrings);
+}
+
+}
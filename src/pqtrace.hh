@@ -0,0 +1,91 @@
+#ifndef PQTRACE_HH_
+#define PQTRACE_HH_
+
+#include "str.hh"
+#include "string.hh"
+#include "json.hh"
+#include "time.hh"
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+
+namespace pq {
+
+enum TraceOp {
+    trace_db_put = 1, trace_db_erase, trace_db_get, trace_db_scan,
+    trace_db_write, trace_notify_insert, trace_notify_erase,
+    trace_fetch_remote, trace_notify_batch
+};
+
+struct TraceRecord {
+    uint64_t time;              // completion time, us
+    uint32_t latency;           // us
+    uint16_t op;
+    uint16_t klen;
+    uint32_t khash;
+    uint32_t count;             // value length, batch size or scan results
+};
+
+// Binary event trace. Every thread appends to its own fixed-size ring, so
+// recording takes no lock; old records are overwritten. While tracing is
+// off a trace point costs one relaxed load.
+//
+// Rings are allocated on the loop thread when tracing is enabled, one for
+// the loop and one for each thread announced by add_threads(); a thread
+// claims a ring with its first record. Records from threads beyond that
+// are dropped.
+class Trace {
+  public:
+    enum { ring_size = 1 << 16 };
+
+    static inline bool enabled();
+    static void enable(bool on);
+    static void add_threads(int n);
+    static inline uint64_t start();
+
+    // `start` is the tstamp() when the operation began
+    static inline void record(int op, Str key, uint32_t count, uint64_t start);
+    static void record(int op, const char* key, int klen, uint32_t count,
+                       uint64_t start);
+
+    // Write every ring's records to `filename` as raw TraceRecords.
+    // Records written concurrently with the dump may be torn.
+    static ssize_t dump(const String& filename);
+    static Json stats();
+
+  private:
+    struct ring {
+        TraceRecord rec[ring_size];
+        std::atomic<uint64_t> head;
+        ring* next;
+    };
+
+    static std::atomic<bool> enabled_;
+    static std::atomic<ring*> rings_;
+    static thread_local ring* my_ring_;
+    static int nthreads_;
+    static int nrings_;
+    static std::mutex spare_lock_;
+    static std::vector<ring*> spare_;
+
+    static void make_rings();
+    static ring* claim_ring();
+};
+
+inline bool Trace::enabled() {
+    return enabled_.load(std::memory_order_relaxed);
+}
+
+inline uint64_t Trace::start() {
+    return enabled() ? tstamp() : 0;
+}
+
+inline void Trace::record(int op, Str key, uint32_t count, uint64_t start) {
+    if (enabled())
+        record(op, key.data(), key.length(), count, start);
+}
+
+}
+
+#endif
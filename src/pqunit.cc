@@ -3,6 +3,7 @@
 #include <unistd.h>
 #include <set>
 #include <vector>
+#include <thread>
 #if DO_PERF
 #include <sys/prctl.h>
 #include <sys/wait.h>
@@ -13,6 +14,9 @@
 #include "time.hh"
 #include "check.hh"
 #include "partitioner.hh"
+#include "pqtrace.hh"
+#include "pqframe.hh"
+#include "pqrpc.hh"
 
 namespace  {
 
@@ -300,6 +304,105 @@ void test_expansion() {
     CHECK_EQ(rm.match.slot(j.slot("subscriber")), "11111");
 }
 
+void test_compiled_join() {
+    pq::Join j;
+    CHECK_TRUE(j.assign_parse("t|<a:2>|<b:3>|<c:2> = copy z|<a>|<b>|<c>"));
+    j.ref();
+
+    pq::Match m;
+    CHECK_TRUE(j.source(0).match("z|12|345|67"));
+    CHECK_TRUE(!j.source(0).match("z|12|345+67"));
+    CHECK_TRUE(!j.source(0).match("z|12|345|6"));
+    CHECK_TRUE(j.source(0).match("z|12|345|67", m));
+    CHECK_EQ(m.slot(j.slot("b")), "345");
+    CHECK_TRUE(!j.source(0).match("z|12|999|67", m));
+
+    m.clear();
+    m.set_slot(j.slot("a"), "1", 1);
+    CHECK_TRUE(j.source(0).match("z|12|345|67", m));
+    CHECK_EQ(m.slot(j.slot("a")), "12");
+    CHECK_EQ(m.slot(j.slot("c")), "67");
+
+    m.clear();
+    m.set_slot(j.slot("c"), "67", 2);
+    pq::PatternFilter filter(j.source(0), m);
+    CHECK_TRUE(filter.match("z|99|999|67"));
+    CHECK_TRUE(!filter.match("z|99|999|68"));
+    CHECK_TRUE(!filter.match("z|99+999|67"));
+    CHECK_TRUE(!filter.match("z|99|999|6"));
+    j.source(0).assign_match("z|99|999|67", m);
+    CHECK_EQ(m.slot(j.slot("b")), "999");
+
+    // an unknown slot that repeats must repeat its bytes
+    pq::Join jx;
+    CHECK_TRUE(jx.assign_parse("x|<a:2> = copy y|<a>|<b:1>|<a>"));
+    jx.ref();
+    m.clear();
+    pq::PatternFilter xfilter(jx.source(0), m);
+    CHECK_TRUE(xfilter.match("y|12|z|12"));
+    CHECK_TRUE(!xfilter.match("y|12|z|13"));
+    m.clear();
+    CHECK_TRUE(!jx.source(0).match("y|12|z|13", m));
+
+    // adjacent slots with equal separators copy as one run
+    j.expand_sink_key_source("z|12|345|67", 0);
+    CHECK_EQ(j.sink_key(), "t|12|345|67");
+    j.expand_sink_key_source("z|ab|cde|fg", 1 << j.slot("b"));
+    CHECK_EQ(j.sink_key(), "t|ab|345|fg");
+
+    // a sink that repeats slots needs more copies than there are slots
+    pq::Join jr;
+    CHECK_TRUE(jr.assign_parse("r|<a:1><b:1><a><b><a><b> = copy z|<a>|<b>"));
+    jr.ref();
+    jr.expand_sink_key_source("z|1|2", 0);
+    CHECK_EQ(jr.sink_key(), "r|121212");
+}
+
+void test_limit_window() {
+    pq::Server server;
+    char buf[64];
+    for (int i = 0; i != 100; ++i) {
+        sprintf(buf, "zz|%02d|%02d", i / 10, i % 10);
+        server.insert(buf, "v");
+    }
+
+    pq::Join j;
+    j.assign_parse("tt|<a:2>|<b:2> = copy zz|<a>|<b>");
+    j.ref();
+    server.add_join("tt|", "tt}", &j);
+    CHECK_TRUE(j.ordered());
+
+    // forward windows end before the first key past the limit
+    String cut = server.limit_window("tt|03|", "tt}", 5, false);
+    CHECK_EQ(cut, "tt|03|05");
+    server.validate("tt|03|", cut);
+    CHECK_EQ(server.count("tt|", "tt}"), size_t(5));
+
+    // reverse windows begin at the oldest key within the limit
+    cut = server.limit_window("tt|05|", "tt|07}", 5, true);
+    CHECK_EQ(cut, "tt|07|05");
+    server.validate(cut, "tt|07}");
+    CHECK_EQ(server.count("tt|", "tt}"), size_t(10));
+
+    // ranges with few keys, or with computed parts, are not narrowed
+    CHECK_EQ(server.limit_window("tt|09|", "tt}", 20, false), "");
+    CHECK_EQ(server.limit_window("tt|", "tt}", 5, false), "");
+
+    pq::Join j2;
+    j2.assign_parse("uu|<b:2>|<a:2> = copy zz|<a>|<b>");
+    j2.ref();
+    server.add_join("uu|", "uu}", &j2);
+    CHECK_TRUE(!j2.ordered());
+    CHECK_EQ(server.limit_window("uu|", "uu}", 5, false), "");
+
+    // limited scans and counts of unknown tables, or across tables
+    CHECK_EQ(server.limit_window("nn|", "nn}", 5, false), "");
+    CHECK_EQ(server.limit_window("tt|", "uu}", 5, true), "");
+    CHECK_EQ(server.table_for("nn|", "nn}").count("nn|", "nn}"), size_t(0));
+    server.validate("nn|", "nn}");
+    CHECK_EQ(server.count("nn|", "nn}"), size_t(0));
+}
+
 void test_count() {
     pq::Server server;
 
@@ -873,6 +976,43 @@ void test_partitioner_analyze() {
     CHECK_EQ(parts.begin()->key, "t|00000000|00000003");
 }
 
+void test_partitioner_reassign() {
+    pq::Partitioner* part = pq::Partitioner::make("twitternew-text", 6, -1);
+    std::vector<pq::keyrange> parts;
+    String first, last;
+
+    part->cell("p|00012|00000007", first, last);
+    CHECK_EQ(first, "p|00012");
+    CHECK_EQ(last, "p|00013");
+    CHECK_EQ(part->owner("p|00012|00000007"), 0);
+
+    part->reassign(first, last, 3);
+    CHECK_EQ(part->owner("p|00012|00000007"), 3);
+    CHECK_EQ(part->owner("p|00013"), 1);
+    part->analyze("p|00011", "p|00014", 0, parts);
+    CHECK_EQ(parts.size(), (uint32_t)3);
+    CHECK_EQ(parts[1].key, "p|00012");
+    CHECK_EQ(parts[1].owner, 3);
+
+    // a later move splits an earlier one
+    part->reassign("p|00012|5", "p|00012|7", 4);
+    CHECK_EQ(part->nreassigned(), (uint32_t)3);
+    CHECK_EQ(part->owner("p|00012|1"), 3);
+    CHECK_EQ(part->owner("p|00012|6"), 4);
+    CHECK_EQ(part->owner("p|00012|8"), 3);
+    part->analyze("p|00012|6", "p|00012|65", 0, parts);
+    CHECK_EQ(parts.size(), (uint32_t)1);
+    CHECK_EQ(parts[0].owner, 4);
+
+    // and a covering move replaces both
+    part->reassign("p|00010", "p|00020", 5);
+    CHECK_EQ(part->nreassigned(), (uint32_t)1);
+    CHECK_EQ(part->owner("p|00012|6"), 5);
+    CHECK_EQ(part->owner("p|00019|9"), 5);
+    CHECK_EQ(part->owner("p|00020"), 2);
+    delete part;
+}
+
 void test_cross() {
     pq::Server server;
     pq::Join j1, j2;
@@ -911,6 +1051,16 @@ void test_cross() {
     // crosses subtables
     server.validate("t|00001|0000000000", "t|00002}");
     CHECK_EQ(server.count("t|00001|0000000000", "t|00002}"), size_t(7));
+    CHECK_EQ(server.count("t|00001|0000000001", "t|00002|0000000011"), size_t(5));
+    CHECK_EQ(server.count("p|", "p}"), size_t(7));
+
+    pq::Table& t = server.table_for("t|00001|0000000000", "t|00002}");
+    auto it = t.seek("t|00001|0000000001", 4);
+    CHECK_EQ(it->key(), "t|00002|0000000010|10000");
+    it = t.seek("t|00001|0000000001", 6);
+    CHECK_TRUE(it == it.table_end());
+    it = server.table_for("p|", "p}").seek("p|", 3);
+    CHECK_EQ(it->key(), "p|10000|0000000010");
 
     // crosses top-level tables
     // todo: not supported right now...
@@ -1278,11 +1428,467 @@ void test_string() {
     CHECK_TRUE(String::natural_compare("1.2.10.4:100", "1.2.10.4:2") > 0);
 }
 
+String binary_key(const char* prefix, uint32_t a, uint32_t b) {
+    char buf[16];
+    memcpy(buf, prefix, 2);
+    write_in_net_order<uint32_t>(buf + 2, a);
+    buf[6] = '|';
+    write_in_net_order<uint32_t>(buf + 7, b);
+    return String(buf, 11);
+}
+
+void test_binary_slots() {
+    pq::Server server;
+    server.insert(binary_key("s|", 1, 2), "1");
+    server.insert(binary_key("s|", 1, 300), "1");
+    server.insert(binary_key("p|", 2, 10), "Hello");
+    server.insert(binary_key("p|", 300, 11), "World");
+    server.insert(binary_key("p|", 4, 12), "Not followed");
+
+    pq::Join j;
+    CHECK_TRUE(j.assign_parse("t|<user:4n>|<time:4n>|<poster:4n> = "
+                              "using s|<user>|<poster> "
+                              "copy p|<poster>|<time>"));
+    j.ref();
+    server.add_join("t|", "t}", &j);
+
+    String first = binary_key("t|", 1, 0), last = binary_key("t|", 1, -1);
+    server.validate(first, last);
+    CHECK_EQ(server.count(first, last), size_t(2));
+
+    pq::Match m;
+    auto it = server.table_for(first, last).lower_bound(first);
+    CHECK_TRUE(j.sink().match(it->key(), m));
+    Json mj = j.unparse_match(m);
+    CHECK_EQ(mj["user"].as_i(), 1);
+    CHECK_EQ(mj["time"].as_i(), 10);
+    CHECK_EQ(mj["poster"].as_i(), 2);
+
+    pq::Join bad;
+    CHECK_TRUE(!bad.assign_parse("x|<a:9n> = copy y|<a>"));
+
+    // the KV-SSD key codec round-trips both key forms
+    char ebuf[32], dbuf[32];
+    pq::KVSDBKeyCodec dcodec(false), bcodec(true);
+    int n = dcodec.encode("p|00012345|0000000099", ebuf);
+    CHECK_EQ(n, 15);
+    CHECK_EQ(read_in_host_order<uint32_t>(ebuf), 12345U | Prefix_P);
+    CHECK_EQ(Str(dbuf, dcodec.decode(ebuf, n, dbuf)), Str("p|00012345|0000000099"));
+    String bkey = binary_key("s|", 77, 78);
+    n = bcodec.encode(bkey, ebuf);
+    CHECK_EQ(n, 9);
+    CHECK_EQ(read_in_host_order<uint32_t>(ebuf), 77U);
+    CHECK_EQ(Str(dbuf, bcodec.decode(ebuf, n, dbuf)), Str(bkey));
+    CHECK_EQ(dcodec.encode("t|00000001", ebuf), -1);
+}
+
+void test_trace() {
+    String fname = String("/tmp/pqtrace.") + String(getpid());
+    pq::Trace::enable(false);
+    uint64_t before = pq::Trace::stats()["trace_records"].as_u();
+    pq::Trace::record(pq::trace_db_put, "k|1", 5, tstamp());
+    CHECK_EQ(pq::Trace::stats()["trace_records"].as_u(), before);
+
+    pq::Trace::enable(true);
+    uint64_t t0 = pq::Trace::start();
+    CHECK_TRUE(t0 != 0);
+    for (int i = 0; i < 3; ++i)
+        pq::Trace::record(pq::trace_db_scan, "k|2", i, t0);
+    pq::Trace::enable(false);
+    CHECK_EQ(pq::Trace::stats()["trace_records"].as_u(), before + 3);
+
+    ssize_t n = pq::Trace::dump(fname);
+    CHECK_EQ(n, (ssize_t) (before + 3));
+    FILE* f = fopen(fname.c_str(), "r");
+    std::vector<pq::TraceRecord> recs(n);
+    CHECK_EQ(fread(recs.data(), sizeof(pq::TraceRecord), n, f), (size_t) n);
+    fclose(f);
+    unlink(fname.c_str());
+    CHECK_EQ(recs.back().op, pq::trace_db_scan);
+    CHECK_EQ(recs.back().klen, 3);
+    CHECK_EQ(recs.back().count, 2U);
+    CHECK_TRUE(recs.back().time >= t0);
+
+    // an announced thread records into a ring made on this one
+    pq::Trace::add_threads(1);
+    pq::Trace::enable(true);
+    std::thread([]() {
+            pq::Trace::record(pq::trace_db_get, "k|3", 1, tstamp());
+        }).join();
+    pq::Trace::enable(false);
+    CHECK_EQ(pq::Trace::stats()["trace_records"].as_u(), before + 4);
+}
+
+struct test_evictable : public pq::Evictable {
+    int nevict = 0;
+    virtual void evict() {
+        ++nevict;
+    }
+};
+
+void test_eviction_index() {
+    test_evictable e[4];
+    {
+        pq::EvictionIndex index;
+        for (int i = 0; i < 4; ++i)
+            index.insert(&e[i]);
+        CHECK_EQ(index.size(), size_t(4));
+        CHECK_TRUE(e[1].is_linked());
+
+        // removal swaps the last entry into the hole
+        e[1].unlink();
+        CHECK_TRUE(!e[1].is_linked());
+        CHECK_EQ(index.size(), size_t(3));
+        CHECK_TRUE(index[1] == &e[3]);
+        index.remove(&e[0]);
+        CHECK_TRUE(index[0] == &e[2] && index[1] == &e[3]);
+        index.insert(&e[1]);
+        CHECK_TRUE(index[2] == &e[1]);
+    }
+    // a destroyed index releases its entries
+    CHECK_TRUE(!e[1].is_linked() && !e[2].is_linked());
+
+    // access counts halve every decay period
+    e[0].touch(0);
+    e[0].touch(1);
+    e[0].touch(2);
+    CHECK_EQ(e[0].access_count(2), uint32_t(3));
+    CHECK_EQ(e[0].access_count(2 + pq::Evictable::access_decay), uint32_t(1));
+    CHECK_EQ(e[0].access_count(2 + 40 * uint64_t(pq::Evictable::access_decay)), uint32_t(0));
+
+    // GreedyDual credit is the base plus cost per byte
+    e[1].set_cost(1000, 100);
+    e[1].set_credit(5);
+    e[2].set_cost(1000, 0);
+    e[2].set_credit(5);
+    CHECK_TRUE(e[1].credit() == 15 && e[2].credit() == 1005);
+    e[1].mark_evicted();
+    CHECK_TRUE(e[1].cost() == 0 && e[1].bytes() == 0);
+
+    // a sink range costs what its latest computation took
+    pq::SinkRange sr("s|a", "s|b", nullptr);
+    sr.add_cost(10, 5);
+    sr.add_cost(10, 7);
+    CHECK_EQ(sr.cost(), uint64_t(12));
+    sr.add_cost(20, 3);
+    CHECK_EQ(sr.cost(), uint64_t(3));
+}
+
+void test_erase_purge_chunk() {
+    pq::Server server;
+    for (int i = 0; i < 10; ++i)
+        server.insert(String("p|") + String(i), "x");
+
+    pq::Table& t = server.table_for("p|", "p}");
+    bool more;
+    CHECK_EQ(t.erase_purge("p|", "p}", 4, more), uint32_t(4));
+    CHECK_TRUE(more);
+    CHECK_EQ(server.count("p|", "p}"), size_t(6));
+    CHECK_EQ(t.erase_purge("p|", "p}", 6, more), uint32_t(6));
+    CHECK_TRUE(!more);
+    CHECK_EQ(server.count("p|", "p}"), size_t(0));
+}
+
+void test_evict_sink_chunk() {
+    pq::Server server;
+    for (int i = 0; i < 10; ++i)
+        server.insert(String("s|0000") + String(i), "x");
+
+    pq::Join j;
+    CHECK_TRUE(j.assign_parse("c|<k:5> = copy s|<k:5>"));
+    j.ref();
+    server.add_join("c|", "c}", &j);
+    server.validate("c|", "c}");
+    CHECK_EQ(server.count("c|", "c}"), size_t(10));
+
+    // a big sink range is purged a chunk per eviction, then dropped
+    server.set_eviction_slicing(1000, 4);
+    server.evict_one();
+    CHECK_EQ(server.count("c|", "c}"), size_t(6));
+    // updates no longer reach the partly purged range
+    server.insert("s|00020", "x");
+    CHECK_EQ(server.count("c|", "c}"), size_t(6));
+    server.evict_one();
+    server.evict_one();
+    CHECK_EQ(server.count("c|", "c}"), size_t(0));
+    Json stats;
+    server.table_for("c|", "c}").add_stats(stats);
+    CHECK_EQ(stats["nevict_sink"]["chunks"].as_i(), 2);
+    CHECK_EQ(stats["nevict_sink"]["ranges"].as_i(), 1);
+    CHECK_EQ(stats["sink_ranges_size"].as_i(), 0);
+
+    // a range read while partly purged is computed anew
+    server.validate("c|", "c}");
+    server.evict_one();
+    server.validate("c|00003", "c|00005");
+    CHECK_EQ(server.count("c|", "c}"), size_t(2));
+    server.validate("c|", "c}");
+    CHECK_EQ(server.count("c|", "c}"), size_t(11));
+}
+
+void test_table_quota() {
+    pq::Server server;
+    char buf[32];
+    for (int i = 0; i < 20; ++i) {
+        sprintf(buf, "s|%05d", i);
+        server.insert(buf, "x");
+    }
+
+    pq::Join j;
+    CHECK_TRUE(j.assign_parse("c|<k:5> = copy s|<k:5>"));
+    j.ref();
+    server.add_join("c|", "c}", &j);
+    for (int i = 0; i < 10; ++i) {
+        sprintf(buf, "c|%05d", i);
+        server.validate(buf, String(buf) + "}");
+    }
+    pq::Table& t = server.table_for("c|", "c}");
+    uint64_t quota = t.mem_total() / 2;
+    t.set_mem_quota(quota);
+
+    // validation leaves the table over quota rather than evicting
+    server.validate("c|00010", "c|00011");
+    CHECK_EQ(server.count("c|", "c}"), size_t(11));
+    CHECK_EQ(t.nevict_quota_, uint64_t(0));
+
+    // the next insert evicts the least recently used ranges
+    server.insert("s|00099", "x");
+    CHECK_TRUE(t.mem_total() <= quota);
+    CHECK_TRUE(t.nevict_quota_ > 0);
+    CHECK_TRUE(server.count("c|", "c}") < size_t(11));
+    CHECK_EQ(server.count("c|00010", "c|00011"), size_t(1));
+    CHECK_EQ(server.count("c|00000", "c|00001"), size_t(0));
+}
+
+void test_table_accounting() {
+    pq::Server server;
+    for (int i = 0; i < 10; ++i)
+        server.insert(String("q|") + String(i), "xyz");
+
+    pq::Table& t = server.table_for("q|", "q}");
+    CHECK_TRUE(t.top_table() == &t);
+    uint64_t base = 10 * (3 + 3 + sizeof(pq::Datum));
+    CHECK_EQ(t.mem_total(), base);
+
+    server.insert("q|0", "xyzzy");
+    CHECK_EQ(t.mem_total(), base + 2);
+    server.erase("q|0");
+    server.erase("q|1");
+    CHECK_EQ(t.mem_total(), base - 2 * (3 + 3 + sizeof(pq::Datum)));
+}
+
+void test_notify_batch() {
+    pq::Server server;
+    server.insert("a|01", "old");
+    server.insert("a|03", "gone");
+
+    pq::Join j;
+    CHECK_TRUE(j.assign_parse("b|<x:2> = copy a|<x>"));
+    j.ref();
+    server.add_join("b|", "b}", &j);
+    server.validate("b|", "b}");
+    CHECK_EQ(server.count("b|", "b}"), size_t(2));
+
+    // as a peer's pq_notify_batch delivers them: sorted, null erases
+    server.apply_notify_batch(Json::array("a|01", "new", "a|02", "two",
+                                          "a|03", Json(), "a|04", "four"));
+    CHECK_EQ(server.count("a|", "a}"), size_t(3));
+    CHECK_EQ(server["a|01"].value(), "new");
+    CHECK_EQ(server["a|04"].value(), "four");
+    server.validate("b|", "b}");
+    CHECK_EQ(server.count("b|", "b}"), size_t(3));
+    CHECK_EQ(server["b|01"].value(), "new");
+    CHECK_EQ(server["b|02"].value(), "two");
+}
+
+void test_notify_frame() {
+    pq::Server server;
+    server.insert("a|01", "old");
+    server.insert("a|03", "gone");
+
+    pq::FrameWriter fw(pq_notify_batch, 7);
+    fw.push("a|01", "new");
+    fw.push("a|02", String::make_fill('x', 1000));
+    fw.push_null("a|03");
+    fw.push("a|04", "");
+    String data = fw.finish(64);
+    CHECK_TRUE(pq::Frame::is_frame(data.data()));
+    CHECK_EQ(pq::Frame::wire_length(data.data(), data.length()),
+             size_t(data.length()));
+    CHECK_EQ(pq::Frame::seq(data.data()), uint64_t(7));
+
+    pq::Frame f;
+    CHECK_TRUE(f.assign(data));
+    CHECK_EQ(f.size(), uint32_t(4));
+    CHECK_TRUE(!f.assign(data.substring(0, data.length() - 1)));
+    CHECK_TRUE(f.assign(data));
+    server.apply_notify_batch(f);
+    CHECK_EQ(server.count("a|", "a}"), size_t(3));
+    CHECK_EQ(server["a|01"].value(), "new");
+    CHECK_EQ(server["a|02"].value().length(), 1000);
+    CHECK_EQ(server["a|04"].value(), "");
+}
+
+void test_fanout() {
+    pq::Server server;
+    pq::Join j[2];
+    CHECK_TRUE(j[0].assign_parse("t|<s:5>|<time:10>|<p:5> = "
+                                 "using s|<s>|<p> copy p|<p>|<time>"));
+    CHECK_TRUE(j[1].assign_parse("c|<s:5> = "
+                                 "count p|<p:5>|<time:10> using s|<s>|<p>"));
+    j[0].ref();
+    j[1].ref();
+    server.add_join("t|", "t}", &j[0]);
+    server.add_join("c|", "c}", &j[1]);
+
+    // one source range feeds every follower's timeline and count
+    const int nfollow = 20;
+    char buf[32];
+    for (int i = 0; i < nfollow; ++i) {
+        sprintf(buf, "s|%05d|00000", i);
+        server.insert(buf, "1");
+    }
+    server.insert("p|00000|0000000001", "first");
+    for (int i = 0; i < nfollow; ++i) {
+        sprintf(buf, "t|%05d|", i);
+        server.validate(buf, String(buf) + "}");
+        sprintf(buf, "c|%05d", i);
+        server.validate(buf, String(buf) + "}");
+    }
+    CHECK_EQ(server.count("t|", "t}"), size_t(nfollow));
+
+    server.insert("p|00000|0000000005", "hello");
+    server.insert("p|00000|0000000001", "first, edited");
+    CHECK_EQ(server.count("t|", "t}"), size_t(2 * nfollow));
+    for (int i = 0; i < nfollow; ++i) {
+        sprintf(buf, "t|%05d|0000000005|00000", i);
+        auto d = server.find(buf);
+        CHECK_TRUE(d && d->value() == "hello");
+        sprintf(buf, "t|%05d|0000000001|00000", i);
+        d = server.find(buf);
+        CHECK_TRUE(d && d->value() == "first, edited");
+        sprintf(buf, "c|%05d", i);
+        d = server.find(buf);
+        CHECK_TRUE(d && d->value() == "2");
+    }
+
+    server.erase("p|00000|0000000001");
+    CHECK_EQ(server.count("t|", "t}"), size_t(nfollow));
+    for (int i = 0; i < nfollow; ++i) {
+        sprintf(buf, "c|%05d", i);
+        auto d = server.find(buf);
+        CHECK_TRUE(d && d->value() == "1");
+    }
+}
+
+void test_deferred_join() {
+    pq::Server server;
+    pq::Join j[2];
+    CHECK_TRUE(j[0].assign_parse("t|<s:5>|<time:10>|<p:5> = defer "
+                                 "using s|<s>|<p> copy p|<p>|<time>"));
+    CHECK_TRUE(j[1].assign_parse("c|<s:5> = defer "
+                                 "sum p|<p:5>|<time:10> using s|<s>|<p>"));
+    CHECK_TRUE(j[0].deferred() && j[1].deferred());
+    j[0].ref();
+    j[1].ref();
+    server.add_join("t|", "t}", &j[0]);
+    server.add_join("c|", "c}", &j[1]);
+
+    server.insert("s|00001|00000", "1");
+    server.insert("p|00000|0000000001", "10");
+    server.validate("t|00001|", "t|00001}");
+    server.validate("c|00001", "c|00001}");
+    CHECK_EQ(server.count("t|00001|", "t|00001}"), size_t(1));
+    CHECK_EQ(server["c|00001"].value(), "10");
+
+    // changes are logged at the sink until it is read again
+    server.insert("p|00000|0000000002", "20");
+    server.insert("p|00000|0000000001", "5");
+    CHECK_EQ(server.count("t|00001|", "t|00001}"), size_t(1));
+    CHECK_EQ(server["c|00001"].value(), "10");
+    server.validate("t|00001|", "t|00001}");
+    server.validate("c|00001", "c|00001}");
+    CHECK_EQ(server.count("t|00001|", "t|00001}"), size_t(2));
+    CHECK_EQ(server["t|00001|0000000001|00000"].value(), "5");
+    CHECK_EQ(server["c|00001"].value(), "25");
+
+    // a full log is applied at once
+    uint32_t old_max = pq::Sink::deferred_max;
+    pq::Sink::deferred_max = 4;
+    char buf[32];
+    for (int i = 3; i < 13; ++i) {
+        sprintf(buf, "p|00000|%010d", i);
+        server.insert(buf, "1");
+    }
+    CHECK_EQ(server.count("t|00001|", "t|00001}"), size_t(10));
+    server.erase("p|00000|0000000002");
+    server.validate("t|00001|", "t|00001}");
+    server.validate("c|00001", "c|00001}");
+    CHECK_EQ(server.count("t|00001|", "t|00001}"), size_t(11));
+    CHECK_EQ(server["c|00001"].value(), "15");
+    pq::Sink::deferred_max = old_max;
+}
+
+void test_adaptive_join() {
+    pq::Server server;
+    pq::Join j;
+    CHECK_TRUE(j.assign_parse("t|<s:5>|<time:10>|<p:5> = adaptive "
+                              "copy p|<p>|<time> using s|<s>|<p>"));
+    CHECK_TRUE(j.adaptive() && j.maintained());
+    j.ref();
+    server.add_join("t|", "t}", &j);
+
+    uint32_t old_writes = pq::Sink::adaptive_writes;
+    uint32_t old_max = pq::Sink::deferred_max;
+    uint64_t old_dropped = pq::Sink::ncold_dropped;
+    pq::Sink::adaptive_writes = 2;
+    pq::Sink::deferred_max = 4;
+
+    server.insert("s|00001|00000", "1");
+    server.validate("t|00001|", "t|00001}");
+    CHECK_EQ(server.count("t|00001|", "t|00001}"), size_t(0));
+
+    // the first writes after a read are pushed, later ones wait for a read
+    char buf[32];
+    for (int i = 1; i <= 3; ++i) {
+        sprintf(buf, "p|00000|%010d", i);
+        server.insert(buf, "x");
+    }
+    CHECK_EQ(server.count("t|00001|", "t|00001}"), size_t(2));
+    server.validate("t|00001|", "t|00001}");
+    CHECK_EQ(server.count("t|00001|", "t|00001}"), size_t(3));
+    server.insert("p|00000|0000000004", "x");
+    CHECK_EQ(server.count("t|00001|", "t|00001}"), size_t(4));
+
+    // a sink that fills its log without a read is dropped unreplayed, and
+    // whole, though it holds more than one eviction chunk
+    uint64_t old_replayed = pq::Sink::nreplayed;
+    server.set_eviction_slicing(1000, 1);
+    for (int i = 5; i <= 12; ++i) {
+        sprintf(buf, "p|00000|%010d", i);
+        server.insert(buf, "x");
+    }
+    CHECK_EQ(pq::Sink::ncold_dropped, old_dropped + 1);
+    CHECK_EQ(pq::Sink::nreplayed, old_replayed);
+    CHECK_EQ(server.count("t|00001|", "t|00001}"), size_t(0));
+    server.insert("p|00000|0000000013", "x");
+    server.validate("t|00001|", "t|00001}");
+    CHECK_EQ(server.count("t|00001|", "t|00001}"), size_t(13));
+
+    pq::Sink::adaptive_writes = old_writes;
+    pq::Sink::deferred_max = old_max;
+}
+
 extern void test_mpfd();
 extern void test_mpfd2();
+extern void test_mpfd_scan();
+extern void test_mpfd_frames();
 extern void test_redis();
 extern void test_memcache();
 extern void test_postgres();
+extern void test_iopool();
+extern void test_write_behind();
+extern void test_migrate();
 
 void unit_tests(const std::set<String> &testcases) {
     std::vector<std::pair<String, test_func> > tests_;
@@ -1294,6 +1900,8 @@ void unit_tests(const std::set<String> &testcases) {
     ADD_TEST(test_simple);
     ADD_TEST(test_overlap);
     ADD_TEST(test_expansion);
+    ADD_TEST(test_compiled_join);
+    ADD_TEST(test_limit_window);
     ADD_TEST(test_recursive);
     ADD_TEST(test_count);
     ADD_TEST(test_annotation);
@@ -1306,6 +1914,7 @@ void unit_tests(const std::set<String> &testcases) {
     ADD_TEST(test_op_sum);
     //ADD_TEST(test_op_bounds);
     ADD_TEST(test_partitioner_analyze);
+    ADD_TEST(test_partitioner_reassign);
     ADD_TEST(test_cross);
     ADD_TEST(test_iupdate);
     ADD_TEST(test_iupdate2);
@@ -1314,15 +1923,32 @@ void unit_tests(const std::set<String> &testcases) {
     ADD_TEST(test_iupdate_t);
     ADD_TEST(test_celebrity);
     ADD_TEST(test_string);
+    ADD_TEST(test_binary_slots);
+    ADD_TEST(test_trace);
+    ADD_TEST(test_eviction_index);
+    ADD_TEST(test_erase_purge_chunk);
+    ADD_TEST(test_evict_sink_chunk);
+    ADD_TEST(test_table_accounting);
+    ADD_TEST(test_table_quota);
+    ADD_TEST(test_notify_batch);
+    ADD_TEST(test_notify_frame);
+    ADD_TEST(test_fanout);
+    ADD_TEST(test_deferred_join);
+    ADD_TEST(test_adaptive_join);
     ADD_EXP_TEST(test_karma);
     ADD_EXP_TEST(test_ma);
     ADD_EXP_TEST(test_swap);
     ADD_EXP_TEST(test_karma_online);
     ADD_OTHER_TEST(test_mpfd);
     ADD_OTHER_TEST(test_mpfd2);
+    ADD_OTHER_TEST(test_mpfd_scan);
+    ADD_OTHER_TEST(test_mpfd_frames);
+    ADD_OTHER_TEST(test_migrate);
     ADD_OTHER_TEST(test_redis);
     ADD_OTHER_TEST(test_memcache);
     ADD_OTHER_TEST(test_postgres);
+    ADD_OTHER_TEST(test_iopool);
+    ADD_OTHER_TEST(test_write_behind);
     size_t ntests = 0;
     for (auto& t : tests_)
         if (testcases.empty() || testcases.find(t.first) != testcases.end()) {
@@ -3,8 +3,14 @@
 #include "redisadapter.hh"
 #include "memcacheadapter.hh"
 #include "pqpersistent.hh"
+#include "pqiopool.hh"
+#include "pqrpc.hh"
+#include "pqinterconnect.hh"
+#include "pqserver.hh"
+#include "partitioner.hh"
 #include "check.hh"
 #include <fcntl.h>
+#include <map>
 
 namespace {
 void small_socket_buffer(int f) {
@@ -127,6 +133,441 @@ void test_mpfd2() {
         test_mpfd2_server(c2p[0], p2c[1]);
 }
 
+namespace {
+struct scan_entry {
+    String k;
+    String v;
+    Str key() const {
+        return k;
+    }
+    const String& value() const {
+        return v;
+    }
+};
+}
+
+tamed void test_mpfd_scan() {
+    tvars {
+        tamer::fd c2p[2], p2c[2];
+        msgpack_fd* client;
+        msgpack_fd* server;
+        std::vector<scan_entry> entries;
+        Json reply;
+    }
+
+    tamer::fd::pipe(c2p);
+    tamer::fd::pipe(p2c);
+    client = new msgpack_fd(p2c[0], c2p[1]);
+    server = new msgpack_fd(c2p[0], p2c[1]);
+    for (int i = 0; i < 10; ++i) {
+        String k = String("k") + String(i);
+        // every third value is large enough to be sent by reference
+        String v(std::string(i % 3 ? 10 : 20000, (char) ('a' + i)));
+        entries.push_back(scan_entry{k, v});
+    }
+
+    twait {
+        client->call(Json::array(1, 0), make_event(reply));
+        CHECK_EQ(server->write_scan_reply(-1, Json(0), 0, entries.begin(),
+                                          entries.end(), Str("k8")),
+                 (size_t) 8);
+    }
+    CHECK_TRUE(reply.is_a() && reply.size() == 4);
+    CHECK_EQ(reply[0].as_i(), -1);
+    CHECK_EQ(reply[3].size(), (size_t) 16);
+    for (int i = 0; i < 8; ++i) {
+        CHECK_EQ(reply[3][2 * i].as_s(), entries[i].k);
+        CHECK_EQ(reply[3][2 * i + 1].as_s(), entries[i].v);
+    }
+
+    delete client;
+    delete server;
+    for (int i = 0; i < 2; ++i) {
+        c2p[i].close();
+        p2c[i].close();
+    }
+    std::cerr << "PASS" << std::endl;
+}
+
+namespace {
+tamed void write_all(tamer::fd fd, String data, tamer::event<> done) {
+    tvars { size_t nwritten = 0; int ret; }
+    twait { fd.write(data.data(), data.length(), &nwritten, make_event(ret)); }
+    assert(ret == 0 && nwritten == size_t(data.length()));
+    done();
+}
+}
+
+tamed void test_mpfd_frames() {
+    tvars {
+        tamer::fd c2p[2], p2c[2];
+        msgpack_fd* client;
+        msgpack_fd* server;
+        String f1, f2, m1, m2, big;
+        Json req[4], reply;
+        pq::Frame frame;
+        tamer::rendezvous<> r;
+        uint64_t seq = (uint64_t(1) << 32) + 5;
+    }
+
+    tamer::fd::pipe(c2p);
+    tamer::fd::pipe(p2c);
+    server = new msgpack_fd(c2p[0], p2c[1]);
+    {
+        pq::FrameWriter fw1(pq_notify_batch, 1);
+        fw1.push("a", "1");
+        fw1.push_null("b");
+        f1 = fw1.finish();
+        // bigger than the read buffer, so it cannot be parsed in place
+        big = String::make_fill('z', 200000);
+        pq::FrameWriter fw2(pq_notify_batch, 3);
+        fw2.push("c", big);
+        f2 = fw2.finish();
+        StringAccum sa;
+        msgpack::unparse(sa, Json::array(pq_noop_get, 2, "x"));
+        m1 = sa.take_string();
+        msgpack::unparse(sa, Json::array(pq_noop_get, 4, "y"));
+        m2 = sa.take_string();
+    }
+
+    // a frame, a message, and a header cut short
+    twait { write_all(c2p[1], f1 + m1 + f2.substring(0, 10), make_event()); }
+    twait { server->read_request(make_event(req[0])); }
+    twait { server->read_request(make_event(req[1])); }
+    CHECK_EQ(req[0][0].as_i(), int(pq_notify_batch));
+    CHECK_EQ(req[0][1].to_u64(), uint64_t(1));
+    CHECK_TRUE(frame.assign(req[0][2].as_s()) && frame.size() == 2);
+    CHECK_EQ(req[1][1].as_i(), 2);
+    CHECK_EQ(req[1][2].as_s(), "x");
+
+    // the rest of the header, then the frame body across many reads
+    twait { write_all(c2p[1], f2.substring(10, 4000), make_event()); }
+    twait {
+        write_all(c2p[1], f2.substring(4010) + m2, make_event());
+        server->read_request(make_event(req[2]));
+    }
+    twait { server->read_request(make_event(req[3])); }
+    CHECK_EQ(req[2][1].to_u64(), uint64_t(3));
+    CHECK_TRUE(frame.assign(req[2][2].as_s()) && frame.size() == 1);
+    CHECK_TRUE(frame.begin().value() == big);
+    CHECK_EQ(req[3][2].as_s(), "y");
+
+    // replies to frames match sequence numbers past 2^32
+    client = new msgpack_fd(p2c[0], c2p[1]);
+    {
+        pq::FrameWriter fw(pq_notify_batch, seq);
+        fw.push("d", "4");
+        client->call_frame(fw.finish(), tamer::make_event(r, reply));
+    }
+    twait { server->read_request(make_event(req[0])); }
+    CHECK_EQ(req[0][1].to_u64(), seq);
+    server->write_frame(pq::FrameWriter(-pq_notify_batch, seq, pq_ok).finish());
+    twait(r);
+    CHECK_TRUE(reply.is_a() && reply[0].as_i() == -pq_notify_batch);
+    CHECK_EQ(reply[1].to_u64(), seq);
+
+    delete client;
+    delete server;
+    for (int i = 0; i < 2; ++i) {
+        c2p[i].close();
+        p2c[i].close();
+    }
+    std::cerr << "PASS" << std::endl;
+}
+
+namespace {
+bool migrate_fail_commit = false;
+// if set, triggered when a commit arrives, which then waits for
+// migrate_commit_release
+tamer::event<> migrate_commit_arrived;
+tamer::event<> migrate_commit_release;
+
+tamed void read_count(pq::Server& server, String first, String last,
+                      size_t& n, tamer::event<> done) {
+    tvars { pq::Table::iterator it; }
+    twait { server.validate(first, last, make_event(it)); }
+    n = server.count(first, last);
+    done();
+}
+
+// Answer the requests one server sends another during a migration.
+tamed void serve_peer(msgpack_fd* mpfd, pq::Server& server, tamer::event<> done) {
+    tvars { Json j, rj, aj; String first, last; pq::Table::iterator it; bool ok; }
+    while (1) {
+        j = Json();
+        twait { mpfd->read_request(make_event(j)); }
+        if (!j.is_a() || j.size() < 4)
+            break;
+        rj = Json::array(-j[0].as_i(), j[1], pq_fail);
+        first = j[2].to_s(), last = j[3].to_s();
+        switch (j[0].as_i()) {
+        case pq_subscribe:
+            twait { server.validate(first, last, make_event(it)); }
+            server.subscribe(first, last, j[4]["subscriber"].to_i());
+            aj = Json::make_array();
+            for (auto itend = it.table_end(); it != itend && it->key() < last; ++it)
+                aj.push_back(String(it->key())).push_back(it->value());
+            rj[2] = pq_ok;
+            rj[3] = aj;
+            break;
+        case pq_unsubscribe:
+            server.unsubscribe(first, last, j[4]["subscriber"].to_i());
+            rj[2] = pq_ok;
+            break;
+        case pq_notify_insert:
+            server.table_for(first).insert(first, last);
+            rj[2] = pq_ok;
+            break;
+        case pq_migrate:
+            ok = false;
+            if (j[4]["phase"] == "pull")
+                twait { server.migrate_pull(first, last, j[4]["from"].to_i(),
+                                            make_event(ok)); }
+            else if (j[4]["phase"] == "commit") {
+                if (migrate_commit_arrived) {
+                    migrate_commit_arrived();
+                    twait { migrate_commit_release = make_event(); }
+                }
+                if (!migrate_fail_commit)
+                    twait { server.migrate_commit(first, last, j[4]["from"].to_i(),
+                                                  j[4]["subscriptions"], make_event(ok)); }
+            } else if (j[4]["phase"] == "abort" || j[4]["phase"] == "done") {
+                server.migrate_done(first, last);
+                ok = true;
+            }
+            rj[2] = ok ? pq_ok : pq_fail;
+            break;
+        case pq_repartition:
+            twait { server.repartition(first, last, j[4]["from"].to_i(),
+                                       j[4]["owner"].to_i(), make_event()); }
+            rj[2] = pq_ok;
+            break;
+        }
+        mpfd->write(rj);
+    }
+    done();
+}
+}
+
+tamed void test_migrate() {
+    tvars {
+        tamer::fd req[3][3][2], rep[3][3][2];
+        msgpack_fd* client[3][3];
+        msgpack_fd* serve[3][3];
+        pq::Server* server[3];
+        pq::Partitioner* part[3];
+        std::vector<pq::Interconnect*> ics[3];
+        pq::Table::iterator it;
+        tamer::gather_rendezvous gr;
+        tamer::rendezvous<> r;
+        bool ok;
+        size_t nread;
+    }
+
+    // server i calls server k on client[i][k], which k answers on serve[i][k]
+    for (int i = 0; i != 3; ++i) {
+        server[i] = new pq::Server;
+        part[i] = pq::Partitioner::make("unit", 3, 0);
+        ics[i].assign(3, nullptr);
+        for (int k = 0; k != 3; ++k)
+            if (k != i) {
+                tamer::fd::pipe(req[i][k]);
+                tamer::fd::pipe(rep[i][k]);
+                client[i][k] = new msgpack_fd(rep[i][k][0], req[i][k][1]);
+                serve[i][k] = new msgpack_fd(req[i][k][0], rep[i][k][1]);
+                ics[i][k] = new pq::Interconnect(client[i][k], k);
+            }
+        server[i]->set_cluster_details(i, ics[i], part[i]);
+    }
+    for (int i = 0; i != 3; ++i)
+        for (int k = 0; k != 3; ++k)
+            if (k != i)
+                serve_peer(serve[i][k], *server[k], gr.make_event());
+
+    // server 0 owns b| and e|; server 2 caches b|
+    for (int i = 1; i <= 5; ++i) {
+        twait { server[0]->insert(String("b|") + String(i), String(i), make_event()); }
+        twait { server[0]->insert(String("e|") + String(i), String(i), make_event()); }
+    }
+    twait { server[2]->validate("b|", "b}", make_event(it)); }
+    CHECK_EQ(server[2]->count("b|", "b}"), (size_t) 5);
+
+    // a failed commit leaves the range, its data, and its owner in place;
+    // a read of the range during the commit waits for its answer
+    migrate_fail_commit = true;
+    migrate_commit_arrived = tamer::make_event(r);
+    server[0]->migrate("e|", "e}", 1, tamer::make_event(r, ok));
+    twait(r);
+    nread = size_t(-1);
+    read_count(*server[0], "e|", "e}", nread, tamer::make_event(r));
+    twait { tamer::at_delay_msec(20, make_event()); }
+    CHECK_EQ(nread, size_t(-1));
+    migrate_commit_release();
+    twait(r);
+    twait(r);
+    CHECK_TRUE(!ok);
+    CHECK_EQ(nread, (size_t) 5);
+    CHECK_EQ(part[0]->owner("e|1"), 0);
+    CHECK_EQ(server[0]->count("e|", "e}"), (size_t) 5);
+    CHECK_TRUE(!server[0]->migrating("e|", "e}"));
+    CHECK_TRUE(!server[1]->migrating("e|", "e}"));
+    migrate_fail_commit = false;
+
+    // pull, commit, repartition, and done move the range; server 2's
+    // subscription moves with it. a read at the old owner during the
+    // commit is answered by the new owner, and that copy stays valid
+    migrate_commit_arrived = tamer::make_event(r);
+    server[0]->migrate("b|", "b}", 1, tamer::make_event(r, ok));
+    twait(r);
+    nread = size_t(-1);
+    read_count(*server[0], "b|", "b}", nread, tamer::make_event(r));
+    twait { tamer::at_delay_msec(20, make_event()); }
+    CHECK_EQ(nread, size_t(-1));
+    migrate_commit_release();
+    twait(r);
+    twait(r);
+    CHECK_TRUE(ok);
+    CHECK_EQ(nread, (size_t) 5);
+    for (int i = 0; i != 3; ++i)
+        CHECK_EQ(part[i]->owner("b|1"), 1);
+    CHECK_EQ(server[0]->count("b|", "b}"), (size_t) 5);
+    CHECK_EQ(server[1]->count("b|", "b}"), (size_t) 5);
+    CHECK_TRUE(!server[1]->migrating("b|", "b}"));
+    twait { server[1]->insert("b|6", "6", make_event()); }
+    twait { tamer::at_delay_msec(20, make_event()); }
+    CHECK_EQ(server[2]->count("b|", "b}"), (size_t) 6);
+    twait { read_count(*server[0], "b|", "b}", nread, make_event()); }
+    CHECK_EQ(nread, (size_t) 6);
+
+    // the new owner's copy is its own data, which it can move back
+    twait { server[1]->migrate("b|", "b}", 0, make_event(ok)); }
+    CHECK_TRUE(ok);
+    for (int i = 0; i != 3; ++i)
+        CHECK_EQ(part[i]->owner("b|1"), 0);
+    CHECK_EQ(server[0]->count("b|", "b}"), (size_t) 6);
+    CHECK_EQ(server[1]->count("b|", "b}"), (size_t) 0);
+    twait { server[0]->insert("b|7", "7", make_event()); }
+    twait { tamer::at_delay_msec(20, make_event()); }
+    CHECK_EQ(server[2]->count("b|", "b}"), (size_t) 7);
+
+    for (int i = 0; i != 3; ++i)
+        for (int k = 0; k != 3; ++k)
+            if (k != i)
+                delete ics[i][k];
+    for (int i = 0; i != 3; ++i)
+        for (int k = 0; k != 3; ++k)
+            if (k != i) {
+                delete client[i][k];
+                delete serve[i][k];
+            }
+    twait(gr);
+    for (int i = 0; i != 3; ++i) {
+        delete server[i];
+        delete part[i];
+        for (int k = 0; k != 3; ++k)
+            if (k != i)
+                for (int x = 0; x != 2; ++x) {
+                    req[i][k][x].close();
+                    rep[i][k][x].close();
+                }
+    }
+    std::cerr << "PASS" << std::endl;
+}
+
+namespace {
+class BatchCountingStore : public pq::PersistentStore {
+  public:
+    std::vector<size_t> batches;
+    std::map<String, String> data;
+
+    virtual void put(Str key, Str value, tamer::event<> done) {
+        data[key] = value;
+        done();
+    }
+    virtual void erase(Str key, tamer::event<> done) {
+        data.erase(key);
+        done();
+    }
+    virtual void get(Str key, tamer::event<String> done) {
+        done(data[key]);
+    }
+    virtual void scan(Str, Str, tamer::event<ResultSet> done) {
+        done(ResultSet());
+    }
+    virtual void flush() {
+    }
+    virtual void write(WriteOps ops, tamer::event<> done) {
+        batches.push_back(ops.size());
+        for (auto& op : ops)
+            if (op.erase)
+                data.erase(op.key);
+            else
+                data[op.key] = op.value;
+        tamer::at_asap(done);
+    }
+    virtual void run_monitor(pq::Server&) {
+    }
+};
+}
+
+tamed void test_write_behind() {
+    tvars {
+        BatchCountingStore store;
+        pq::WriteBehind* wb;
+        tamer::gather_rendezvous gr;
+    }
+
+    // a full batch goes out at once; ops that arrive while it is being
+    // written form the next batch
+    wb = new pq::WriteBehind(&store, 4, 2000, pq::durability_batch);
+    for (int i = 0; i < 10; ++i)
+        wb->put(String("k") + String(i), String(i), gr.make_event());
+    wb->erase("k0", gr.make_event());
+    CHECK_EQ(store.batches.size(), (size_t) 1);
+    twait(gr);
+    CHECK_EQ(store.batches.size(), (size_t) 2);
+    CHECK_EQ(store.batches[0], (size_t) 4);
+    CHECK_EQ(store.batches[1], (size_t) 7);
+    CHECK_EQ(store.data.size(), (size_t) 9);
+    delete wb;
+
+    // durability_none acknowledges before the store sees the write
+    store.batches.clear();
+    wb = new pq::WriteBehind(&store, 64, 1000000, pq::durability_none);
+    twait { wb->put("x", "1", make_event()); }
+    CHECK_TRUE(store.batches.empty());
+    twait { wb->flush(make_event()); }
+    CHECK_EQ(store.batches.size(), (size_t) 1);
+    CHECK_EQ(store.data["x"], String("1"));
+    delete wb;
+
+    // a batch keeps only the last op for each key
+    store.batches.clear();
+    wb = new pq::WriteBehind(&store, 64, 1000000, pq::durability_none);
+    twait { wb->put("y", "1", make_event()); }
+    twait { wb->erase("y", make_event()); }
+    twait { wb->put("z", "1", make_event()); }
+    twait { wb->put("z", "2", make_event()); }
+    twait { wb->flush(make_event()); }
+    CHECK_EQ(store.batches.size(), (size_t) 1);
+    CHECK_EQ(store.batches[0], (size_t) 2);
+    CHECK_TRUE(!store.data.count("y"));
+    CHECK_EQ(store.data["z"], String("2"));
+    delete wb;
+
+    // durability_sync groups the writes of one turn
+    store.batches.clear();
+    wb = new pq::WriteBehind(&store, 64, 1000000, pq::durability_sync);
+    twait {
+        for (int i = 0; i < 5; ++i)
+            wb->put(String("s") + String(i), "v", make_event());
+    }
+    CHECK_EQ(store.batches.size(), (size_t) 1);
+    CHECK_EQ(store.batches[0], (size_t) 5);
+    delete wb;
+    std::cerr << "PASS" << std::endl;
+}
+
 #if HAVE_HIREDIS_HIREDIS_H
 tamed void test_redis() {
     tvars {
@@ -304,3 +745,38 @@ void test_postgres() {
 }
 #endif
 
+namespace {
+std::function<int()> iopool_square(int i) {
+    return [i]() {
+        usleep(1000 * (i % 3));
+        return i * i;
+    };
+}
+
+std::function<void()> iopool_flag(bool* flag) {
+    return [flag]() { *flag = true; };
+}
+}
+
+tamed void test_iopool() {
+    tvars {
+        pq::IOPool* pool = new pq::IOPool(3);
+        int squares[20];
+        bool ran = false;
+    }
+
+    twait {
+        for (int i = 0; i < 20; ++i)
+            pool->call(iopool_square(i), make_event(squares[i]));
+        CHECK_EQ(pool->noutstanding(), (uint64_t)20);
+    }
+    for (int i = 0; i < 20; ++i)
+        CHECK_EQ(squares[i], i * i);
+    CHECK_EQ(pool->noutstanding(), (uint64_t)0);
+
+    twait { pool->run(iopool_flag(&ran), make_event()); }
+    CHECK_TRUE(ran);
+
+    delete pool;
+    std::cerr << "PASS" << std::endl;
+}